@@ -63,6 +63,31 @@ using namespace std;
 #include <string.h> //for strcmp(string1,string2) string comparison returns a 0 if they are the same.
 #include <stdlib.h> //malloc is in this.
 #include <fstream> // basic file operations
+#include <vector>
+#include <algorithm> //sort
+#include <thread>
+#include <atomic>
+#include <unordered_set>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <queue> //priority_queue for merging shards.
+#include <immintrin.h> //the SSE4.2, AVX2 and AVX-512 FASTA kernels, each built for its own target.
+#include <sys/mman.h> //mmap of the packed cache.
+#include <sys/stat.h>
+#include <sys/resource.h> //getrusage() for the peak memory.
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h> //mbind() of the count tables, without needing libnuma.
+#include <zlib.h> //gzip and BGZF sequence files.
+#include <sys/socket.h> //the UNIX domain socket of "findKmer serve".
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/wait.h> //the child processes of --jobs.
+#include <signal.h>
+#include <errno.h>
+#include <string>
 /*
  * Below are some defaults you can setup at compile time.
  * Any combination of command line arguments can override these.
@@ -77,9 +102,115 @@ using namespace std;
 
 #define DEFAULT_K_VALUE 7
 #define OUT_FILE_COLUMN_HEADERS "Sequence, Shannon Entropy h, Shannon Entropy H, Frequency, Z score"
+#define MISMATCH_FILE_COLUMN_HEADERS "Sequence, Frequency, Neighborhood frequency, Neighborhood expected, Neighborhood Z score"
+#define POSITIONAL_FILE_COLUMN_HEADERS "Sequence, Frequency, Chi square, Degrees of freedom, Peak bin start, Peak bin frequency, Peak bin expected, Peak bin Z score"
 #define DEFAULT_SUPPRESS_OUTPUT_VALUE 0
 #define DEFAULT_Z_THRESHOLD_ENABLE 0
 #define DEFAULT_Z_THRESHOLD 1000
+#define DEFAULT_PER_RECORD_ENABLE 0
+#define DEFAULT_THREAD_COUNT 0 //0 means one thread per available core.
+#define DEFAULT_POSITIONAL_BIN_SIZE 0 //0 disables the positional histogram.
+#define MAX_POSITIONAL_K 12 //the positional table is dense, 4^k kmers by the number of bins.
+#define DEFAULT_DEDUP_ENABLE 0
+#define DEFAULT_CANONICAL_ENABLE 0
+#define DEFAULT_INDEX_ENABLE 0
+#define DEFAULT_MPHF_ENABLE 0
+#define DEFAULT_FINGERPRINT_BITS 8 //bits per kmer of the --mphf fingerprints, 0 stores none.
+#define MPHF_GAMMA 2 //bits of a level of the frozen index per kmer left, fewer levels for more bits.
+#define MPHF_MAX_LEVELS 24 //kmers that collide on every level are kept in a sorted fallback.
+#define DEFAULT_MISMATCHES 0 //0 disables the mismatch neighborhoods.
+#define MAX_MISMATCHES 2
+#define MAX_MISMATCH_K 12 //the neighborhoods are dense, 4^k counts per mismatch level.
+
+//How kmers are counted. The tree is the original engine, dense and hash are tables shared by all threads.
+#define ENGINE_TREE 0
+#define ENGINE_DENSE 1 //one counter for each of the 4^k kmers.
+#define ENGINE_HASH 2 //open addressing table sized by the number of bases.
+#define ENGINE_SORT 3 //kmer runs bucketed in memory by their leading bases, then sorted.
+#define ENGINE_DISK 4 //the same buckets kept in temporary files.
+#define ENGINE_AUTO 5 //picked by plan_memory() to fit the memory budget.
+#define DEFAULT_ENGINE ENGINE_TREE
+#define DEFAULT_MAX_MEMORY 0 //bytes, 0 means no budget.
+#define DEFAULT_PARTITION_COMBINE_SIZE 65536 //the sort and disk engines always buffer kmers per thread.
+#define SORT_PARTITIONS 256
+#define LONG_HASH_BUCKET_SLOTS 1024 //slots a bucket of the hash engine starts with for kmers of more than MAX_CODE_K bases.
+#define MAX_DISK_PARTITIONS 512 //one open temporary file each.
+#define MEMORY_SLACK (8ULL * 1024 * 1024) //program, stdio and record index, added to every prediction.
+#define DEFAULT_DIRECT_IO_ENABLE 0
+#define PIPELINE_BUFFER_SIZE (4 * 1024 * 1024) //bytes per read of the pipeline's reader thread, a multiple of the O_DIRECT alignment.
+#define PIPELINE_DEPTH 4 //buffers in flight between each pair of pipeline stages.
+#define PIPELINE_BLOCK_BASES (4 * 1024 * 1024) //bases per parsed block of the pipeline, packed 4 to a byte.
+#define DIRECT_IO_ALIGNMENT 4096
+//Kernel that classifies FASTA text 64 characters at a time, SIMD_AUTO picks the widest the CPU has.
+#define SIMD_SCALAR 0
+#define SIMD_SSE42 1
+#define SIMD_AVX2 2
+#define SIMD_AVX512 3
+#define SIMD_AUTO 4
+#define DEFAULT_SIMD SIMD_AUTO
+#define MAX_DENSE_K 16
+#define MAX_TREE_K 20 //the tree grows a node per base of every new kmer, longer kmers are for the count tables.
+#define MAX_CODE_K 31 //kmers up to this long are one kmer_code_t, the hash engine keys code + 1.
+#define MAX_K 64 //longer kmers are a long_kmer_t of two words, counted by the hash and sort engines.
+#define HISTO_RANGE_KMERS 65536 //kmers per range of the parallel histogram.
+#define HISTO_RANGES_AHEAD 4 //ranges per thread the histogram workers may run ahead of the out file.
+#define HISTO_TREE_PREFIX 5 //the tree histogram has a range for each of the 4^5 prefixes.
+#define DEFAULT_COMBINE_SIZE 0 //0 disables the write combining buffers.
+#define DEFAULT_INSERT_BATCH 64 //kmers whose slots are prefetched together, 0 adds them one at a time.
+#define MAX_INSERT_BATCH 1024
+#define BENCH_KMERS (1 << 24) //kmers "findKmer bench" adds for each k.
+#define BENCH_MAX_DENSE_K 14 //a 4^14 table of 16 bit counters is 512 mibibytes.
+#define HUGE_PAGES_OFF 0
+#define HUGE_PAGES_TRANSPARENT 1 //madvise(MADV_HUGEPAGE), the kernel backs the table with 2 MiB pages when it can.
+#define HUGE_PAGES_EXPLICIT 2 //MAP_HUGETLB from the reserved pool, falling back to transparent ones.
+#define DEFAULT_HUGE_PAGES HUGE_PAGES_TRANSPARENT
+#define HUGE_PAGE_SIZE (2ULL * 1024 * 1024)
+#define NUMA_OFF 0
+#define NUMA_INTERLEAVE 1 //count table pages round robin over the NUMA nodes.
+#define DEFAULT_NUMA NUMA_INTERLEAVE
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3 //from numaif.h, which is only there with libnuma.
+#endif
+#define DEFAULT_COUNTER_BITS 16 //counter width of the dense and hash engines, saturated counters spill to an overflow map.
+
+//What the program was asked to do. The first argument selects anything but counting.
+#define COMMAND_COUNT 0
+#define COMMAND_PACK 1 //"findKmer pack" converts the sequence file to a 2 bit packed cache.
+#define COMMAND_MERGE 2 //"findKmer merge" merges the shard files of --shard runs into one histogram.
+#define COMMAND_BENCH 3 //"findKmer bench" times the count tables on random kmers.
+#define SHARD_FILE_MAGIC "FKSHRD1"
+#define JOB_PENDING 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+#define JOB_FAILED 3
+#define SERVE_BINARY_LOOKUP 1 //first byte of a binary request of "findKmer serve", lines never start with it.
+#define SERVE_MAX_BATCH 65536 //kmers in one binary request.
+#define SERVE_MAX_LINE 65536 //bytes in one line request.
+#define DEFAULT_SHARD_COUNT 0 //0 counts every kmer, N > 0 counts only the kmers of one of N shards.
+#define MAX_COMPLEXITY_K 64
+#define MAX_PATTERN_SPAN 32 //the window of a spaced seed is one 64 bit code.
+#define DEFAULT_WINDOW_SIZE 0 //0 disables the --window scan for locally enriched kmers.
+#define DEFAULT_WINDOW_P 0.01 //chance of a window count at least as high, for all windows of the file together.
+#define MAX_DYAD_GAPS 256 //gap lengths of one --dyad run, the gap index takes up to 4 bases of the code.
+#define DEFAULT_MIN_ENTROPY 0 //bits per base, kmers with a lower h are masked. 0 disables it.
+#define DEFAULT_DUST_THRESHOLD 0 //kmers with a higher DUST triplet score are masked. 0 disables it.
+#define PACKED_CACHE_EXTENSION ".packed"
+#define PACKED_CACHE_MAGIC "FK2BIT1"
+#define STDIN_SEQUENCE_NAME "stdin" //what out files are named after when --parse is -.
+#define INPUT_CHUNK_SIZE (4 * 1024 * 1024) //bytes per read of stdin, per write of a decompressed gzip stream and of compressed read ahead.
+#define BGZF_HEADER_SIZE 18 //gzip header with the 6 byte BC extra field.
+#define BGZF_FOOTER_SIZE 8 //CRC32 and the uncompressed size.
+#define BGZF_MAX_BLOCK_SIZE 65536
+#define TEXT_PLAIN 0 //how the text of the sequence file is stored, see open_sequence_input().
+#define TEXT_GZIP 1
+#define TEXT_BGZF 2
+#define GZIP_TEXT_RATIO 4 //FASTA text is taken to deflate to a quarter of its size when its size is not known.
+#define DEFAULT_SAMPLE_FRACTION 0 //0 counts the whole file, --sample only estimates the run from part of it.
+#define SAMPLE_BLOCK_SIZE 65536 //bytes of text, or bases of a packed cache, in each block --sample reads.
+#define SAMPLE_TOP_KMERS 20
+#define SAMPLE_SEED 88172645463325252ULL //the blocks are the same every run of a file.
+#define DEFAULT_PLAN_SAMPLE_FRACTION 0.001 //of the file sampled to estimate the distinct kmers of a run, 0 plans without.
+#define PLAN_SAMPLE_MAX_BLOCKS 64 //the plan reads at most 4 MiB of text however large the file.
 
 //debugging
 #define DEBUG(x) //x
@@ -95,6 +226,23 @@ struct statistics_t {
 	long double Probability; //probability that this base will be encountered out of all bases in the file.
 };
 
+//Counts of what the scan of the sequence file did besides counting kmers. Reported in the stats file.
+struct scan_summary_t {
+	unsigned long long records; //number of '>' identifiers read.
+	unsigned long long duplicateRecords; //records skipped by --dedup because an identical record was already counted.
+	unsigned long long maskedKmers; //kmers not counted because --min-entropy or --dust found them low complexity.
+};
+
+//How the count tables of the dense and hash engines were mapped. Reported in the stats file.
+struct table_memory_t {
+	bool transparentHugePages; //the kernel has transparent huge pages enabled.
+	int numaNodes; //online NUMA nodes, 0 or 1 when there is nothing to interleave.
+	unsigned long long explicitBytes; //bytes on explicit huge pages.
+	unsigned long long transparentBytes; //bytes advised to use transparent huge pages.
+	unsigned long long fallbackBytes; //bytes on plain 4 KiB pages.
+	unsigned long long interleavedBytes; //bytes interleaved over the NUMA nodes.
+};
+
 /* Data structure for a tree.
  * http://msdn.microsoft.com/en-us/library/s3f49ktz.aspx
  * holds the ranges of each data type.
@@ -110,6 +258,8 @@ struct node_t {
 	unsigned int frequency; //number of times that this "sequence" was encountered in the whole file.
 };
 
+struct packed_cache_t;
+
 /* structure definition for configuration of file names, pointers, and length of k.
  * For enables: 0 == false, > 1 is true, < 1 means none supplied from user.
  */
@@ -122,10 +272,59 @@ static struct conf {
 	int suppressOutputEnable; //Suppress identifier printing and getchar(); breaks.
 	long double zThreshold; //holds the minimum Z score value to print to outfile
 	int zThresholdEnable; //The z threshold enable set to 1 OR GREATER causes outfile to only contain sequences with z score above z threshold.
+	int perRecordEnable; //1 OR GREATER writes a sparse kmer count vector for every record instead of the histogram.
+	int threads; //number of worker threads for the modes that run in parallel.
+	int positionalBinSize; //bases per position bin of the positional histogram, 0 disables it.
+	int dedupEnable; //1 OR GREATER skips records whose sequence is identical to one already counted.
+	int canonicalEnable; //1 OR GREATER counts a long kmer and its reverse complement as the smaller of the two.
+	int command; //COMMAND_COUNT or one of the other COMMAND_ values.
+	const packed_cache_t *packedCache; //the mapped sequence file when it is a 2 bit packed cache, else NULL.
+	int stdinEnable; //1 OR GREATER reads the sequence from stdin, --parse -.
+	int decompressedFd; //memory file holding the text of a gzip or stdin sequence file, -1 for a plain file.
+	int textFormat; //TEXT_PLAIN, TEXT_GZIP or TEXT_BGZF, what the reader pipeline inflates as it reads.
+	int engine; //one of the ENGINE_ values.
+	int combineSize; //kmers each thread buffers before adding them to a shared table, 0 adds them one at a time.
+	int insertBatch; //kmers whose slots are prefetched before they are added, 0 adds them one at a time.
+	int counterBits; //8, 16 or 32 bit counters for the dense and hash engines.
+	int hugePages; //one of the HUGE_PAGES_ values for the dense and hash tables.
+	int numa; //NUMA_OFF or NUMA_INTERLEAVE for the dense and hash tables.
+	unsigned long long maxMemory; //bytes the run may use, 0 means no budget.
+	int partitions; //buckets of the sort and disk engines, set by plan_memory().
+	unsigned long long predictedMemory; //peak bytes plan_memory() expects.
+	unsigned long long tableBudget; //bytes the hash engine table may grow to, set by plan_memory(), 0 means no limit.
+	int directIoEnable; //1 OR GREATER reads the sequence file with O_DIRECT, bypassing the page cache.
+	int simd; //one of the SIMD_ values.
+	int shardIndex; //with shardCount > 0 only kmers that hash to this shard are counted.
+	int shardCount;
+	char **mergeFiles; //shard files given to "findKmer merge".
+	int numMergeFiles;
+	double minEntropy; //kmers whose h is below this are masked.
+	double dustThreshold; //kmers whose DUST score is above this are masked.
+	int indexEnable; //1 OR GREATER also writes an index of where every kmer of the histogram occurs.
+	int mphfEnable; //1 OR GREATER also freezes the counts into a minimal perfect hash index.
+	int fingerprintBits; //bits of the fingerprint the frozen index keeps of every kmer to reject others.
+	int mismatches; //substitutions in the neighborhood of each kmer, 0 disables the neighborhoods.
+	const char *pattern; //--pattern spaced seed of '1' care and '0' gap positions, NULL counts plain kmers.
+	int span; //bases each kmer covers, k plus the gaps of the pattern, or the longest --dyad.
+	int dyadLeft; //--dyad bases of the left half-site, 0 counts kmers instead of dyads.
+	int dyadRight; //bases of the right half-site.
+	int dyadGapMin; //shortest and longest spacer between the half-sites.
+	int dyadGapMax;
+	int windowSize; //--window bases of each window of the enrichment scan, 0 disables it.
+	int windowStep; //bases between the starts of consecutive windows.
+	double windowP; //a kmer is enriched in a window when its count is this unlikely in any window of the file.
+	const char *jobsFile; //--jobs manifest, NULL runs the one job given by the options.
+	double sampleFraction; //above 0 counts random blocks of this fraction of the file and reports what a full run would find and need.
+	double planSampleFraction; //random blocks of this fraction of the file estimate the distinct kmers plan_memory() expects.
 } config; /* Config is a GLOBAL VARIABLE for configuration of file names, pointers, and length of k.*/
 
 //Global variable that needs to be localized.
 unsigned long long int nodeCounter = 0; //number of nodes created in memory.
+unordered_map<node_t*, unsigned long long> nodeOverflow; //counts beyond the 32 bit frequency of the few nodes that rolled over.
+mutex nodeOverflowLock; //held while a counter thread adds to nodeOverflow.
+table_memory_t tableMemory; //set by init_table_memory() and allocate_count_table().
+//distinct kmers of the whole file estimated by --sample, 0 without a sample.
+unsigned long long sampledDistinct = 0;
 
 extern int recurse_factorial(int i) {
 	if (i > 1)
@@ -217,6 +416,128 @@ void deallocate_array(void** array) {
 	free(*array);
 	*array = NULL;
 }
+/* Bits of the online NUMA nodes from /sys, 0 when the kernel has no NUMA support. */
+unsigned long online_numa_nodes() {
+	FILE *file = fopen("/sys/devices/system/node/online", "r");
+	if (!file) {
+		return 0;
+	}
+	unsigned long nodes = 0;
+	int first = 0;
+	int last = 0;
+	char separator = ',';
+	//the list looks like 0 or 0-3 or 0,2-3.
+	while (separator == ',' && fscanf(file, "%d", &first) == 1) {
+		last = first;
+		separator = fgetc(file);
+		if (separator == '-' && fscanf(file, "%d", &last) == 1) {
+			separator = fgetc(file);
+		}
+		for (int node = first; node <= last && node < 64; node++) {
+			nodes |= 1UL << node;
+		}
+	}
+	fclose(file);
+	return nodes;
+}
+/* Bytes mapped for a count table, whole huge pages so the mapping can be backed by them. */
+static unsigned long long count_table_mapping_bytes(
+		const unsigned long long count, const size_t element_size) {
+	return (count * element_size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+/*
+ * Allocates a zeroed count table, which can be far larger than allocate_array() can size.
+ * A table this large is read at random, so with 4 KiB pages nearly every add is also a TLB miss.
+ * The table is mapped in 2 MiB pages: explicit huge pages with --huge-pages explicit if the
+ * kernel has some reserved, else transparent huge pages, else plain pages. On a machine with
+ * more than one NUMA node the pages are interleaved over the nodes before they are touched,
+ * since every counting thread adds to every part of the table and first touch would put it all
+ * on the node of whichever thread zeroed it. tableMemory records which of these each table got.
+ */
+void *allocate_count_table(const unsigned long long count,
+		const size_t element_size) {
+	const unsigned long long bytes = count_table_mapping_bytes(count,
+			element_size);
+	void *mem = MAP_FAILED;
+	int pages = HUGE_PAGES_OFF;
+
+	if (config.hugePages == HUGE_PAGES_EXPLICIT) {
+		mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED) {
+			pages = HUGE_PAGES_EXPLICIT;
+		}
+	}
+	if (mem == MAP_FAILED) {
+		//map one huge page more than needed and trim it so the table starts on a huge page.
+		char *map = (char*) mmap(NULL, bytes + HUGE_PAGE_SIZE,
+				PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) {
+			fprintf(stderr,
+					"allocate_count_table():: memory allocation of %llu bytes failed\n",
+					count * element_size);
+			exit(EXIT_FAILURE);
+		}
+		const unsigned long long head = (HUGE_PAGE_SIZE
+				- ((unsigned long long) map & (HUGE_PAGE_SIZE - 1)))
+				& (HUGE_PAGE_SIZE - 1);
+		if (head) {
+			munmap(map, head);
+		}
+		munmap(map + head + bytes, HUGE_PAGE_SIZE - head);
+		mem = map + head;
+		if (config.hugePages != HUGE_PAGES_OFF && tableMemory.transparentHugePages
+				&& madvise(mem, bytes, MADV_HUGEPAGE) == 0) {
+			pages = HUGE_PAGES_TRANSPARENT;
+		}
+	}
+
+	if (config.numa != NUMA_OFF && tableMemory.numaNodes > 1) {
+		const unsigned long nodes = online_numa_nodes();
+		if (syscall(SYS_mbind, mem, bytes, MPOL_INTERLEAVE, &nodes,
+				8 * sizeof(nodes) + 1, 0) == 0) {
+			tableMemory.interleavedBytes += bytes;
+		}
+	}
+
+	if (pages == HUGE_PAGES_EXPLICIT) {
+		tableMemory.explicitBytes += bytes;
+	} else if (pages == HUGE_PAGES_TRANSPARENT) {
+		tableMemory.transparentBytes += bytes;
+	} else {
+		tableMemory.fallbackBytes += bytes;
+	}
+	return mem;
+}
+void deallocate_count_table(void *table, const unsigned long long count,
+		const size_t element_size) {
+	if (table) {
+		munmap(table, count_table_mapping_bytes(count, element_size));
+	}
+}
+/*
+ * Finds out once which of huge pages and NUMA interleaving allocate_count_table() can use.
+ */
+void init_table_memory() {
+	tableMemory.transparentHugePages = false;
+	FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if (file) {
+		char modes[128] = "";
+		if (fgets(modes, sizeof(modes), file)) {
+			tableMemory.transparentHugePages = strstr(modes, "[never]") == NULL;
+		}
+		fclose(file);
+	}
+	tableMemory.numaNodes = __builtin_popcountl(online_numa_nodes());
+}
+void write_or_die(const void * const data, const size_t size,
+		const size_t count, FILE * const file) {
+	if (count && fwrite(data, size, count, file) != count) {
+		fprintf(stderr,
+				"Unable to write to out file! The disk may be full.\n");
+		exit(EXIT_FAILURE);
+	}
+}
 //for testing purposes.
 void random_array(int sizeOfArray) {
 	//Initializing array to test code. this will come from the pre processed line
@@ -240,6 +561,61 @@ void check_file(const char *filename, const char *mode) {
 	} else
 		fclose(file);
 }
+/*
+ * What out file names start with, k or the --pattern, so runs of a spaced seed
+ * do not overwrite the runs of plain kmers with as many care positions.
+ */
+const char *kmer_label() {
+	static char label[48];
+	if (config.pattern) {
+		return config.pattern;
+	}
+	if (config.dyadLeft) {
+		sprintf(label, "%d,%d,%d-%d", config.dyadLeft, config.dyadRight,
+				config.dyadGapMin, config.dyadGapMax);
+		return label;
+	}
+	sprintf(label, "%d", config.k);
+	return label;
+}
+/*
+ * Builds the name of an additional out file the same way the default out file is named,
+ * <k><nameOfFile><sequence_file><outFileExension>. The caller must free the name.
+ */
+char *build_out_file_name(const char * const nameOfFile,
+		const char * const outFileExension) {
+	char *name = (char*) allocate_array(
+			strlen(kmer_label()) + strlen(nameOfFile)
+					+ strlen(config.sequence_file) + strlen(outFileExension)
+					+ 1, sizeof(char));
+	sprintf(name, "%s%s%s%s", kmer_label(), nameOfFile, config.sequence_file,
+			outFileExension);
+	return name;
+}
+/* Gap lengths a --dyad run counts, 1 for plain kmers. */
+int dyad_gaps() {
+	return config.dyadLeft ? config.dyadGapMax - config.dyadGapMin + 1 : 1;
+}
+/*
+ * Bases of the codes a count table holds. k, or for --dyad both half-sites
+ * under as many bases as the gap index takes.
+ */
+int count_table_k() {
+	int gapBases = 0;
+	while ((((unsigned long long) 1) << (2 * gapBases)) < (unsigned long long) dyad_gaps()) {
+		gapBases++;
+	}
+	return config.k + gapBases;
+}
+/* 4^k, the number of different kmers of k bases, or the largest count there is once that does not fit. */
+unsigned long long possible_kmers(const int k) {
+	return k < 32 ? ((unsigned long long) 1) << (2 * k) : ~0ULL;
+}
+const char *engine_name(const int engine) {
+	static const char * const names[] = { "tree", "dense", "hash", "sort",
+			"disk", "auto" };
+	return names[engine];
+}
 /* initialize the configuration
  * Set to null or an invalid value to determine default or user defined.
  */
@@ -252,17 +628,89 @@ void init_conf() {
 	config.suppressOutputEnable = -1;
 	config.zThresholdEnable = -1;
 	config.zThreshold = -1;
+	config.perRecordEnable = -1;
+	config.threads = -1;
+	config.positionalBinSize = -1;
+	config.dedupEnable = -1;
+	config.canonicalEnable = -1;
+	config.command = COMMAND_COUNT;
+	config.packedCache = NULL;
+	config.stdinEnable = -1;
+	config.decompressedFd = -1;
+	config.textFormat = TEXT_PLAIN;
+	config.engine = -1;
+	config.combineSize = -1;
+	config.insertBatch = -1;
+	config.counterBits = -1;
+	config.hugePages = -1;
+	config.numa = -1;
+	config.maxMemory = DEFAULT_MAX_MEMORY;
+	config.partitions = 0;
+	config.predictedMemory = 0;
+	config.tableBudget = 0;
+	config.directIoEnable = -1;
+	config.simd = -1;
+	config.shardIndex = -1;
+	config.shardCount = -1;
+	config.mergeFiles = NULL;
+	config.numMergeFiles = 0;
+	config.minEntropy = -1;
+	config.dustThreshold = -1;
+	config.indexEnable = -1;
+	config.mphfEnable = -1;
+	config.fingerprintBits = -1;
+	config.mismatches = -1;
+	config.pattern = NULL;
+	config.span = 0;
+	config.dyadLeft = 0;
+	config.dyadRight = 0;
+	config.dyadGapMin = 0;
+	config.dyadGapMax = 0;
+	config.windowSize = -1;
+	config.windowStep = 0;
+	config.windowP = -1;
+	config.jobsFile = NULL;
+	config.sampleFraction = -1;
+	config.planSampleFraction = -1;
 }
 /* This function fills in any gaps in the configuration file.*/
 void set_default_conf() {
 
 	if (!config.sequence_file) {
-		config.sequence_file = DEFAULT_SEQUENCE_FILE_NAME;
+		config.sequence_file = strdup(DEFAULT_SEQUENCE_FILE_NAME);
+	}
+
+	//a spaced seed counts its care positions, k is their number.
+	if (config.pattern) {
+		const int weight = count(config.pattern,
+				config.pattern + strlen(config.pattern), '1');
+		if (config.k && config.k != weight) {
+			fprintf(stderr,
+					"The pattern %s has %d care positions, it cannot be used with k = %d.\n",
+					config.pattern, weight, config.k);
+			exit(EXIT_FAILURE);
+		}
+		config.k = weight;
+	}
+
+	//a dyad is scored as a kmer of both half-sites.
+	if (config.dyadLeft) {
+		if (config.k && config.k != config.dyadLeft + config.dyadRight) {
+			fprintf(stderr,
+					"The dyad %s has %d half-site bases, it cannot be used with k = %d.\n",
+					kmer_label(), config.dyadLeft + config.dyadRight, config.k);
+			exit(EXIT_FAILURE);
+		}
+		config.k = config.dyadLeft + config.dyadRight;
 	}
 
 	if (!config.k) {
 		config.k = DEFAULT_K_VALUE;
 	}
+	config.span = config.pattern ? (int) strlen(config.pattern) : config.k;
+	if (config.dyadLeft) {
+		config.span = config.k + config.dyadGapMax;
+	}
 
 	//double check default and user defined K value.
 	if (!config.k) {
@@ -279,6 +727,161 @@ void set_default_conf() {
 		config.zThreshold = DEFAULT_Z_THRESHOLD;
 	}
 
+	if (config.perRecordEnable < 0) {
+		config.perRecordEnable = DEFAULT_PER_RECORD_ENABLE;
+	}
+
+	if (config.threads < 0) {
+		config.threads = DEFAULT_THREAD_COUNT;
+	}
+
+	if (config.positionalBinSize < 0) {
+		config.positionalBinSize = DEFAULT_POSITIONAL_BIN_SIZE;
+	}
+
+	if (config.dedupEnable < 0) {
+		config.dedupEnable = DEFAULT_DEDUP_ENABLE;
+	}
+
+	if (config.canonicalEnable < 0) {
+		config.canonicalEnable = DEFAULT_CANONICAL_ENABLE;
+	}
+
+	if (config.directIoEnable < 0) {
+		config.directIoEnable = DEFAULT_DIRECT_IO_ENABLE;
+	}
+
+	if (config.simd < 0) {
+		config.simd = DEFAULT_SIMD;
+	}
+
+	if (config.shardCount < 0) {
+		config.shardCount = DEFAULT_SHARD_COUNT;
+		config.shardIndex = 0;
+	}
+
+	if (config.minEntropy < 0) {
+		config.minEntropy = DEFAULT_MIN_ENTROPY;
+	}
+
+	if (config.dustThreshold < 0) {
+		config.dustThreshold = DEFAULT_DUST_THRESHOLD;
+	}
+
+	if (config.sampleFraction < 0) {
+		config.sampleFraction = DEFAULT_SAMPLE_FRACTION;
+	}
+
+	if (config.planSampleFraction < 0) {
+		config.planSampleFraction = DEFAULT_PLAN_SAMPLE_FRACTION;
+	}
+
+	if (config.windowSize < 0) {
+		config.windowSize = DEFAULT_WINDOW_SIZE;
+	}
+
+	if (config.windowStep == 0) {
+		config.windowStep = config.windowSize;
+	}
+
+	if (config.windowP < 0) {
+		config.windowP = DEFAULT_WINDOW_P;
+	}
+
+	if (config.indexEnable < 0) {
+		config.indexEnable = DEFAULT_INDEX_ENABLE;
+	}
+
+	if (config.mphfEnable < 0) {
+		config.mphfEnable = DEFAULT_MPHF_ENABLE;
+	}
+
+	if (config.fingerprintBits < 0) {
+		config.fingerprintBits = DEFAULT_FINGERPRINT_BITS;
+	}
+
+	if (config.mismatches < 0) {
+		config.mismatches = DEFAULT_MISMATCHES;
+	}
+
+	if (config.engine < 0) {
+		config.engine = config.maxMemory || config.shardCount > 0
+				|| config.pattern || config.dyadLeft || config.windowSize > 0
+				|| config.mphfEnable > 0 || config.k > MAX_TREE_K ?
+				ENGINE_AUTO : DEFAULT_ENGINE;
+	}
+
+	if (config.combineSize < 0) {
+		config.combineSize = DEFAULT_COMBINE_SIZE;
+	}
+
+	if (config.insertBatch < 0) {
+		config.insertBatch = DEFAULT_INSERT_BATCH;
+	}
+
+	if (config.counterBits < 0) {
+		config.counterBits = DEFAULT_COUNTER_BITS;
+	}
+
+	if (config.hugePages < 0) {
+		config.hugePages = DEFAULT_HUGE_PAGES;
+	}
+
+	if (config.numa < 0) {
+		config.numa = DEFAULT_NUMA;
+	}
+	if (config.threads == 0) {
+		config.threads = thread::hardware_concurrency();
+		if (config.threads < 1) {
+			config.threads = 1;
+		}
+	}
+
+	if (!config.out_file && config.command == COMMAND_PACK) {
+		config.out_file = (char*) allocate_array(
+				strlen(config.sequence_file) + strlen(PACKED_CACHE_EXTENSION)
+						+ 1, sizeof(char));
+		sprintf(config.out_file, "%s%s", config.sequence_file,
+				PACKED_CACHE_EXTENSION);
+	}
+
+	if (!config.out_file && config.shardCount > 0
+			&& config.command == COMMAND_COUNT) {
+		const char* nameOfFile = "mer_Shard_";
+		const char* outFileExension = ".bin";
+
+		config.out_file = (char*) allocate_array(
+				strlen(kmer_label()) + 1 + strlen(nameOfFile) + 2 * strlen("99999")
+						+ strlen("_of__Of_") + strlen(config.sequence_file)
+						+ strlen(outFileExension), sizeof(char));
+		sprintf(config.out_file, "%s%s%d_of_%d_Of_%s%s", kmer_label(), nameOfFile,
+				config.shardIndex, config.shardCount, config.sequence_file,
+				outFileExension);
+	}
+
+	if (!config.out_file && config.sampleFraction > 0
+			&& config.command == COMMAND_COUNT) {
+		const char* nameOfFile = "mer_Sample_Of_";
+		const char* outFileExension = ".txt";
+
+		config.out_file = (char*) allocate_array(
+				strlen(kmer_label()) + 1 + strlen(nameOfFile) + strlen(config.sequence_file)
+						+ strlen(outFileExension), sizeof(char));
+		sprintf(config.out_file, "%s%s%s%s", kmer_label(), nameOfFile,
+				config.sequence_file, outFileExension);
+	}
+
+	if (!config.out_file && config.perRecordEnable > 0) {
+		const char* nameOfFile = "mer_Profiles_Of_";
+		const char* outFileExension = ".bin";
+
+		config.out_file = (char*) allocate_array(
+				strlen(kmer_label()) + 1 + strlen(nameOfFile) + strlen(config.sequence_file)
+						+ strlen(outFileExension), sizeof(char));
+		sprintf(config.out_file, "%s%s%s%s", kmer_label(), nameOfFile,
+				config.sequence_file, outFileExension);
+	}
+
 	if (!config.out_file) {
 		const char* nameOfFile = "mer_Historam_Of_";
 		const char* outFileExension = ".csv";
@@ -286,99 +889,936 @@ void set_default_conf() {
 
 		if (config.zThresholdEnable == 0) {
 			config.out_file = (char*) allocate_array(
-					strlen("999") + strlen(nameOfFile)
+					strlen(kmer_label()) + 1 + strlen(nameOfFile)
 							+ strlen(config.sequence_file)
 							+ strlen(outFileExension), sizeof(char));
-			sprintf(config.out_file, "%d%s%s%s", config.k, nameOfFile,
+			sprintf(config.out_file, "%s%s%s%s", kmer_label(), nameOfFile,
 					config.sequence_file, outFileExension);
 		} else {
 			config.out_file = (char*) allocate_array(
-					strlen("999") + strlen(nameOfFile)
+					strlen(kmer_label()) + 1 + strlen(nameOfFile)
 							+ strlen(config.sequence_file)
 							+ strlen(outFileExension) + strlen(zScoreFiltered),
 					sizeof(char));
-			sprintf(config.out_file, "%d%s%s%s%s", config.k, nameOfFile,
+			sprintf(config.out_file, "%s%s%s%s%s", kmer_label(), nameOfFile,
 					config.sequence_file, zScoreFiltered, outFileExension);
 		}
 	}
 
 }
-/* print the configuration */
-void print_conf(int argc) {
-	fprintf(stdout, "\nATTEMPTING CONFIGURATION: \n");
-	set_default_conf();
-	if (config.sequence_file)
-		fprintf(stdout, "- sequence_file file: %s\n", config.sequence_file);
-	if (config.out_file)
-		fprintf(stdout, "- export file: %s\n", config.out_file);
-	if (config.k)
-		fprintf(stdout, "- k size: %d\n", config.k);
-
-	fprintf(stdout, "- %s\n",
-			config.suppressOutputEnable > 0 ?
-					"Suppressing file read output and breaks." :
-					"Showing DNA Sequence identifier and allowing breaks.");
+/*
+ * Where the text of the sequence file can be opened. A gzip file or stdin is decompressed
+ * into a memory file first, which is reopened through /proc so each reader has its own offset.
+ */
+const char *sequence_path() {
+	static char path[64];
+	if (config.decompressedFd < 0) {
+		return config.sequence_file;
+	}
+	sprintf(path, "/proc/self/fd/%d", config.decompressedFd);
+	return path;
+}
+/* Writes all of data to fd or exits. */
+void write_fd_or_die(const int fd, const char *data, size_t length) {
+	while (length > 0) {
+		const ssize_t written = write(fd, data, length);
+		if (written <= 0) {
+			fprintf(stderr,
+					"Unable to hold the decompressed sequence file in memory.\n");
+			exit(EXIT_FAILURE);
+		}
+		data += written;
+		length -= written;
+	}
+}
+/*
+ * A BGZF block: a gzip member whose header has a BC extra field giving its compressed size,
+ * holding at most 64 KiB of text. samtools and bgzip write them, so they can be inflated
+ * independently and in any order.
+ */
+struct bgzf_block_t {
+	size_t start; //offset of the block in the compressed file.
+	size_t size; //compressed bytes including header and footer.
+	size_t outStart; //offset of its text in the decompressed file.
+};
+/* The compressed size of the BGZF block at data, or 0 if it is not a BGZF block. */
+size_t bgzf_block_size(const unsigned char * const data, const size_t length) {
+	if (length < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE || data[0] != 0x1f
+			|| data[1] != 0x8b || data[2] != 8 || !(data[3] & 4)
+			|| data[10] != 6 || data[11] != 0 || data[12] != 'B'
+			|| data[13] != 'C' || data[14] != 2 || data[15] != 0) {
+		return 0;
+	}
+	const size_t size = (data[16] | (data[17] << 8)) + 1;
+	return size <= length && size >= BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE ? size : 0;
+}
+static inline unsigned int read_le32(const unsigned char * const data) {
+	return data[0] | (data[1] << 8) | (data[2] << 16)
+			| ((unsigned int) data[3] << 24);
+}
+/*
+ * Worker for decompress_bgzf() and text_source_bgzf(). Claims blocks until there are none
+ * left and inflates each straight into its place in out.
+ */
+void bgzf_worker(const unsigned char * const compressed,
+		const vector<bgzf_block_t> * const blocks, char * const out,
+		atomic<size_t> * const nextBlock) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit2(&stream, -15) != Z_OK) { //raw deflate, the gzip header is parsed here.
+		fprintf(stderr, "Unable to start the gzip decompressor.\n");
+		exit(EXIT_FAILURE);
+	}
+	size_t b;
+	while ((b = (*nextBlock)++) < blocks->size()) {
+		const bgzf_block_t &block = (*blocks)[b];
+		const unsigned char *footer = compressed + block.start + block.size
+				- BGZF_FOOTER_SIZE;
+		const unsigned int textLength = read_le32(footer + 4);
+
+		inflateReset(&stream);
+		stream.next_in = (Bytef*) compressed + block.start + BGZF_HEADER_SIZE;
+		stream.avail_in = block.size - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+		stream.next_out = (Bytef*) out + block.outStart;
+		stream.avail_out = textLength;
+		if (inflate(&stream, Z_FINISH) != Z_STREAM_END || stream.avail_out != 0
+				|| crc32(0, (const Bytef*) out + block.outStart, textLength)
+						!= read_le32(footer)) {
+			fprintf(stderr, "A BGZF block of %s is corrupt.\n",
+					config.sequence_file);
+			exit(EXIT_FAILURE);
+		}
+	}
+	inflateEnd(&stream);
+}
+/*
+ * Inflates a BGZF file into fd with config.threads threads. Returns false without writing
+ * anything if the file is not BGZF all the way through, like a plain gzip file.
+ */
+bool decompress_bgzf(const unsigned char * const compressed,
+		const size_t length, const int fd) {
+	vector<bgzf_block_t> blocks;
+	size_t textLength = 0;
+	for (size_t start = 0; start < length;) {
+		const size_t size = bgzf_block_size(compressed + start, length - start);
+		if (size == 0) {
+			return false;
+		}
+		bgzf_block_t block;
+		block.start = start;
+		block.size = size;
+		block.outStart = textLength;
+		blocks.push_back(block);
+		textLength += read_le32(compressed + start + size - 4);
+		start += size;
+	}
+	if (textLength == 0) {
+		return true;
+	}
 
-	fprintf(stdout, "- Z score filtering is %s",
-			config.zThresholdEnable ? "enabled" : "disabled");
+	if (ftruncate(fd, textLength) != 0) {
+		fprintf(stderr,
+				"Unable to hold the %llu decompressed bytes of %s in memory.\n",
+				(unsigned long long) textLength, config.sequence_file);
+		exit(EXIT_FAILURE);
+	}
+	char *out = (char*) mmap(NULL, textLength, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (out == MAP_FAILED) {
+		fprintf(stderr, "Unable to map the decompressed sequence file.\n");
+		exit(EXIT_FAILURE);
+	}
 
-	if (config.zThresholdEnable > 0) {
-		fprintf(stdout, "\n    with threshold of %LG", config.zThreshold);
+	atomic<size_t> nextBlock(0);
+	vector<thread> workers;
+	for (int t = 0; t < config.threads; t++) {
+		workers.push_back(
+				thread(bgzf_worker, compressed, &blocks, out, &nextBlock));
+	}
+	for (int t = 0; t < config.threads; t++) {
+		workers[t].join();
+	}
+	munmap(out, textLength);
+	fprintf(stdout,
+			"Decompressed %lu BGZF blocks of %s with %d threads, %llu bytes.\n",
+			(unsigned long) blocks.size(), config.sequence_file,
+			config.threads, (unsigned long long) textLength);
+	return true;
+}
+/* Inflates one or more concatenated gzip members into fd, one thread. */
+void decompress_gzip(const unsigned char * const compressed,
+		const size_t length, const int fd) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit2(&stream, 15 + 16) != Z_OK) { //gzip wrapper.
+		fprintf(stderr, "Unable to start the gzip decompressor.\n");
+		exit(EXIT_FAILURE);
+	}
+	char *out = (char*) allocate_array(INPUT_CHUNK_SIZE, sizeof(char));
+	unsigned long long textLength = 0;
+	stream.next_in = (Bytef*) compressed;
+	stream.avail_in = 0;
+	size_t remaining = length;
+	int status = Z_OK;
+	while (status != Z_STREAM_END || remaining > 0 || stream.avail_in > 0) {
+		if (status == Z_STREAM_END) {
+			inflateReset(&stream); //the next member of a concatenated file.
+		}
+		if (stream.avail_in == 0) {
+			//avail_in is 32 bits, feed a large file in pieces.
+			stream.avail_in = min(remaining, (size_t) 1 << 30);
+			remaining -= stream.avail_in;
+		}
+		stream.next_out = (Bytef*) out;
+		stream.avail_out = INPUT_CHUNK_SIZE;
+		status = inflate(&stream, Z_NO_FLUSH);
+		if (status != Z_OK && status != Z_STREAM_END) {
+			fprintf(stderr, "%s is not a valid gzip file: %s\n",
+					config.sequence_file, stream.msg ? stream.msg : "truncated");
+			exit(EXIT_FAILURE);
+		}
+		write_fd_or_die(fd, out, INPUT_CHUNK_SIZE - stream.avail_out);
+		textLength += INPUT_CHUNK_SIZE - stream.avail_out;
+	}
+	inflateEnd(&stream);
+	free(out);
+	fprintf(stdout, "Decompressed gzip file %s, %llu bytes.\n",
+			config.sequence_file, textLength);
+}
+//bytes of stdin open_sequence_input() read to tell what it holds, a text source reads them first.
+vector<unsigned char> stdinHead;
+/* True when the sequence is read from stdin as it arrives, with no file behind it to open again. */
+static inline bool sequence_streams_stdin() {
+	return config.stdinEnable > 0 && config.decompressedFd < 0;
+}
+/* TEXT_PLAIN, TEXT_GZIP or TEXT_BGZF from the first block of a sequence file. */
+int text_format(const unsigned char * const head, const size_t length) {
+	if (length < 2 || head[0] != 0x1f || head[1] != 0x8b) {
+		return TEXT_PLAIN;
+	}
+	return bgzf_block_size(head, length) ? TEXT_BGZF : TEXT_GZIP;
+}
+/* Whether the gzip stream that starts with head inflates to a packed cache. */
+bool gzip_holds_packed_cache(const unsigned char * const head,
+		const size_t length) {
+	char magic[8];
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit2(&stream, 15 + 16) != Z_OK) { //gzip wrapper.
+		return false;
+	}
+	stream.next_in = (Bytef*) head;
+	stream.avail_in = length;
+	stream.next_out = (Bytef*) magic;
+	stream.avail_out = sizeof(magic);
+	inflate(&stream, Z_SYNC_FLUSH);
+	inflateEnd(&stream);
+	return stream.avail_out == 0 && memcmp(magic, PACKED_CACHE_MAGIC, 8) == 0;
+}
+/*
+ * Whether counting reads the text of the sequence file out of order or more than once,
+ * which a stream cannot do: --per-record, --index, --window and --sample.
+ */
+bool sequence_needs_random_access() {
+	return config.command == COMMAND_COUNT && !config.jobsFile
+			&& (config.perRecordEnable > 0 || config.indexEnable > 0
+					|| config.windowSize > 0 || config.sampleFraction > 0);
+}
+/*
+ * Opens the sequence file. Plain text, gzip and BGZF files and stdin are streamed, the reader
+ * pipeline and pack read them front to back through a text source that inflates compressed
+ * text as it goes, so neither a compressed genome nor its text is ever held whole.
+ * A gzip file or stdin is first decompressed or copied into a memory file only when counting
+ * needs the text whole, see sequence_needs_random_access(), or it holds a packed cache,
+ * which is mapped. BGZF blocks are inflated in parallel either way.
+ */
+FILE *open_sequence_input() {
+	if (config.decompressedFd >= 0) {
+		return fopen(sequence_path(), "r"); //a job of --jobs, its group's input is already parsed.
+	}
+	int fd = config.stdinEnable > 0 ? STDIN_FILENO : open(config.sequence_file,
+	O_RDONLY);
+	if (fd < 0) {
+		return NULL;
 	}
-	fprintf(stdout, ".\n");
 
-	//if suppressOutputEnable is false and no command line arguments have been given:
-	if (config.suppressOutputEnable == 0 && argc < 2) {
-		fprintf(stdout, "Press enter to proceed with this configuration.");
-		getchar();
+	//the first block tells text, a packed cache, gzip and BGZF apart.
+	vector<unsigned char> head(BGZF_MAX_BLOCK_SIZE);
+	size_t length = 0;
+	ssize_t bytes = 1;
+	while (length < head.size() && bytes > 0) {
+		bytes = config.stdinEnable > 0 ?
+				read(fd, head.data() + length, head.size() - length) :
+				pread(fd, head.data() + length, head.size() - length, length);
+		if (bytes < 0) {
+			fprintf(stderr, "Unable to read sequence file %s\n",
+					config.sequence_file);
+			exit(EXIT_FAILURE);
+		}
+		length += bytes;
+	}
+	head.resize(length);
+	config.textFormat = text_format(head.data(), length);
+	const bool packed = config.textFormat == TEXT_PLAIN ?
+			length >= 8 && memcmp(head.data(), PACKED_CACHE_MAGIC, 8) == 0 :
+			gzip_holds_packed_cache(head.data(), length);
+
+	if (config.stdinEnable <= 0
+			&& (config.textFormat == TEXT_PLAIN
+					|| (!packed && !sequence_needs_random_access()))) {
+		close(fd);
+		return fopen(config.sequence_file, "r");
+	}
+	if (config.stdinEnable > 0 && !packed && !sequence_needs_random_access()) {
+		stdinHead.swap(head);
+		return fdopen(fd, "r");
 	}
 
-	/* Double check configuration */
-	if (config.k < 0 || config.k > 20) {
+	config.decompressedFd = memfd_create(config.sequence_file, 0);
+	if (config.decompressedFd < 0) {
 		fprintf(stderr,
-				"%d is not a valid value for k. Please select a number greater than zero\n",
-				config.k);
+				"Unable to create a memory file for the decompressed sequence.\n");
 		exit(EXIT_FAILURE);
 	}
+	const unsigned char *compressed = NULL;
+	vector<unsigned char> piped;
+	if (config.stdinEnable > 0) {
+		//plain text goes straight to the memory file, compressed text is gathered to inflate.
+		piped.swap(head);
+		while (bytes > 0) {
+			if (config.textFormat == TEXT_PLAIN) {
+				write_fd_or_die(config.decompressedFd,
+						(const char*) piped.data(), length);
+				length = 0;
+			}
+			piped.resize(length + INPUT_CHUNK_SIZE);
+			bytes = read(fd, piped.data() + length, INPUT_CHUNK_SIZE);
+			if (bytes < 0) {
+				fprintf(stderr, "Unable to read the sequence from stdin.\n");
+				exit(EXIT_FAILURE);
+			}
+			length += bytes;
+		}
+		compressed = piped.data();
+	} else {
+		struct stat fileStat;
+		fstat(fd, &fileStat);
+		length = fileStat.st_size;
+		compressed = (const unsigned char*) mmap(NULL, length, PROT_READ,
+				MAP_PRIVATE, fd, 0);
+		if (compressed == MAP_FAILED) {
+			fprintf(stderr, "Unable to map sequence file %s\n",
+					config.sequence_file);
+			exit(EXIT_FAILURE);
+		}
+		madvise((void*) compressed, length, MADV_SEQUENTIAL);
+	}
 
-	if ((config.sequence_file_pointer = fopen(config.sequence_file, "r"))
-			!= NULL) {
-		//fprintf(stdout, "Sequence file opened properly\n");
+	if (config.textFormat == TEXT_PLAIN) {
+		write_fd_or_die(config.decompressedFd, (const char*) compressed,
+				length);
+	} else if (!decompress_bgzf(compressed, length, config.decompressedFd)) {
+		decompress_gzip(compressed, length, config.decompressedFd);
+	}
+	config.textFormat = TEXT_PLAIN; //the memory file holds the text.
+
+	if (config.stdinEnable > 0) {
+		vector<unsigned char>().swap(piped);
 	} else {
+		munmap((void*) compressed, length);
+		close(fd);
+	}
+	return fopen(sequence_path(), "r");
+}
+/*
+ * Opens the sequence file to read its text front to back. With --direct-io a plain file
+ * is opened with O_DIRECT first, falling back to the page cache on file systems that refuse it.
+ */
+int open_sequence_file() {
+	int fd = -1;
+	if (config.directIoEnable > 0 && config.textFormat == TEXT_PLAIN) {
+		fd = open(sequence_path(), O_RDONLY | O_DIRECT);
+		if (fd < 0) {
+			fprintf(stdout,
+					"Direct I/O is not supported for %s, reading through the page cache.\n",
+					config.sequence_file);
+		}
+	}
+	if (fd < 0) {
+		fd = open(sequence_path(), O_RDONLY);
+	}
+	if (fd < 0) {
 		fprintf(stderr, "Sequence file failed to open\n\n");
 		exit(EXIT_FAILURE);
 	}
-
-	if ((config.out_file_pointer = fopen(config.out_file, "w")) != NULL) {
-		//fprintf(stdout, "Out file opened properly\n");
-		fprintf(config.out_file_pointer, OUT_FILE_COLUMN_HEADERS);
-	} else {
-		fprintf(stderr,
-				"Out file failed to open\nFile MUST be in current directory.\n");
+	//doubles the kernel readahead, the reader asks for the buffers after the next one as well.
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return fd;
+}
+/*
+ * The text of the sequence file read front to back, by the reader pipeline and by pack.
+ * Plain text is read as it is. Gzip is inflated as it is read, one member after another.
+ * BGZF is inflated a buffer at a time, the blocks of each buffer side by side with
+ * config.threads threads, until a member that is not a BGZF block turns it into gzip.
+ * Stdin starts with the bytes open_sequence_input() read to tell what it holds.
+ */
+struct text_source_t {
+	int fd;
+	int format; //TEXT_PLAIN, TEXT_GZIP or TEXT_BGZF.
+	bool fromStdin; //stdinHead comes first.
+	size_t headNext; //bytes of stdinHead already read.
+	unsigned char *compressed; //INPUT_CHUNK_SIZE bytes of the file read ahead, NULL for plain text.
+	size_t compressedStart; //first byte not yet inflated.
+	size_t compressedLength;
+	bool compressedEnd; //the file is read to its end.
+	z_stream stream; //TEXT_GZIP.
+	int status; //of the last inflate() of TEXT_GZIP.
+	unsigned long long textBytes;
+};
+void text_source_open(text_source_t * const source) {
+	memset(source, 0, sizeof(*source));
+	source->format = config.textFormat;
+	source->fromStdin = sequence_streams_stdin();
+	source->fd = source->fromStdin ? dup(STDIN_FILENO) : open_sequence_file();
+	source->status = Z_OK;
+	if (source->format != TEXT_PLAIN) {
+		source->compressed = (unsigned char*) allocate_array(INPUT_CHUNK_SIZE,
+				sizeof(unsigned char));
+		if (inflateInit2(&source->stream, 15 + 16) != Z_OK) { //gzip wrapper.
+			fprintf(stderr, "Unable to start the gzip decompressor.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+void text_source_close(text_source_t * const source) {
+	if (source->compressed) {
+		inflateEnd(&source->stream);
+		free(source->compressed);
+		fprintf(stdout, "Decompressed %s while reading it, %llu bytes.\n",
+				config.sequence_file, source->textBytes);
+	}
+	close(source->fd);
+}
+/* Reads up to capacity bytes of the file as it is stored, 0 at its end. */
+size_t text_source_raw(text_source_t * const source, char * const out,
+		const size_t capacity) {
+	size_t length = 0;
+	if (source->fromStdin && source->headNext < stdinHead.size()) {
+		length = min(capacity, stdinHead.size() - source->headNext);
+		memcpy(out, stdinHead.data() + source->headNext, length);
+		source->headNext += length;
+	}
+	//read() may return less than asked for before the end of the file.
+	ssize_t bytes = 1;
+	while (length < capacity
+			&& (bytes = read(source->fd, out + length, capacity - length)) > 0) {
+		length += bytes;
+		if (length % DIRECT_IO_ALIGNMENT) {
+			break; //O_DIRECT needs aligned reads, a short one is the end of the file.
+		}
+	}
+	if (bytes < 0) {
+		fprintf(stderr, "Unable to read sequence file %s\n",
+				config.sequence_file);
 		exit(EXIT_FAILURE);
 	}
-
-	fprintf(stdout, "Sequence file and out file opened properly\n");
-
-	fprintf(stdout, "\n");
+	return length;
+}
+/* Moves the compressed bytes not yet inflated to the front and reads more after them. */
+void text_source_refill(text_source_t * const source) {
+	const size_t kept = source->compressedLength - source->compressedStart;
+	memmove(source->compressed, source->compressed + source->compressedStart,
+			kept);
+	source->compressedStart = 0;
+	source->compressedLength = kept;
+	while (!source->compressedEnd && source->compressedLength < INPUT_CHUNK_SIZE) {
+		const size_t bytes = text_source_raw(source,
+				(char*) source->compressed + source->compressedLength,
+				INPUT_CHUNK_SIZE - source->compressedLength);
+		source->compressedEnd = bytes == 0;
+		source->compressedLength += bytes;
+	}
+}
+/* Inflates gzip text into out until it is full or the file ends. */
+size_t text_source_gzip(text_source_t * const source, char * const out,
+		const size_t capacity) {
+	z_stream &stream = source->stream;
+	stream.next_out = (Bytef*) out;
+	stream.avail_out = capacity;
+	while (stream.avail_out > 0) {
+		if (source->compressedStart == source->compressedLength) {
+			text_source_refill(source);
+			if (source->compressedLength == 0) {
+				if (source->status != Z_STREAM_END) {
+					fprintf(stderr, "%s is not a valid gzip file: truncated\n",
+							config.sequence_file);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+		}
+		if (source->status == Z_STREAM_END) {
+			inflateReset(&stream); //the next member of a concatenated file.
+		}
+		stream.next_in = source->compressed + source->compressedStart;
+		stream.avail_in = source->compressedLength - source->compressedStart;
+		source->status = inflate(&stream, Z_NO_FLUSH);
+		source->compressedStart = source->compressedLength - stream.avail_in;
+		if (source->status != Z_OK && source->status != Z_STREAM_END) {
+			fprintf(stderr, "%s is not a valid gzip file: %s\n",
+					config.sequence_file, stream.msg ? stream.msg : "truncated");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return capacity - stream.avail_out;
+}
+/*
+ * Inflates the next whole BGZF blocks whose text fits in out straight into it, with up to
+ * config.threads threads. Returns 0 at the end of the file, or once the next member is not
+ * a BGZF block, which turns the source into TEXT_GZIP.
+ */
+size_t text_source_bgzf(text_source_t * const source, char * const out,
+		const size_t capacity) {
+	while (true) {
+		//a block is at most BGZF_MAX_BLOCK_SIZE, so one that is cut off is read in whole.
+		if (source->compressedLength - source->compressedStart
+				< BGZF_MAX_BLOCK_SIZE) {
+			text_source_refill(source);
+		}
+		vector<bgzf_block_t> blocks;
+		size_t textLength = 0;
+		size_t start = source->compressedStart;
+		while (start < source->compressedLength) {
+			const size_t size = bgzf_block_size(source->compressed + start,
+					source->compressedLength - start);
+			if (size == 0) {
+				break;
+			}
+			const size_t blockText = read_le32(source->compressed + start + size - 4);
+			if (textLength + blockText > capacity) {
+				break;
+			}
+			bgzf_block_t block = { start, size, textLength };
+			blocks.push_back(block);
+			textLength += blockText;
+			start += size;
+		}
+		if (blocks.empty()) {
+			if (source->compressedStart < source->compressedLength) {
+				source->format = TEXT_GZIP;
+			}
+			return 0;
+		}
+
+		atomic<size_t> nextBlock(0);
+		const int threads = (int) min((size_t) config.threads, blocks.size());
+		if (threads <= 1) {
+			bgzf_worker(source->compressed, &blocks, out, &nextBlock);
+		} else {
+			vector<thread> workers;
+			for (int t = 0; t < threads; t++) {
+				workers.push_back(
+						thread(bgzf_worker, source->compressed, &blocks, out,
+								&nextBlock));
+			}
+			for (int t = 0; t < threads; t++) {
+				workers[t].join();
+			}
+		}
+		source->compressedStart = start;
+		if (textLength > 0) {
+			return textLength; //else only empty blocks, like the end of file marker of bgzip.
+		}
+	}
+}
+/* Reads up to capacity bytes of text into out, 0 at the end of the file. */
+size_t text_source_read(text_source_t * const source, char * const out,
+		const size_t capacity) {
+	size_t length = 0;
+	if (source->format == TEXT_BGZF) {
+		length = text_source_bgzf(source, out, capacity);
+	}
+	if (source->format == TEXT_PLAIN) {
+		length = text_source_raw(source, out, capacity);
+	} else if (source->format == TEXT_GZIP) {
+		length = text_source_gzip(source, out, capacity);
+	}
+	source->textBytes += length;
+	return length;
+}
+/* print the configuration */
+void print_conf(int argc) {
+	fprintf(stdout, "\nATTEMPTING CONFIGURATION: \n");
+	set_default_conf();
+	if (config.sequence_file)
+		fprintf(stdout, "- sequence_file file: %s\n", config.sequence_file);
+	if (config.out_file)
+		fprintf(stdout, "- export file: %s\n", config.out_file);
+	if (config.k)
+		fprintf(stdout, "- k size: %d\n", config.k);
+
+	fprintf(stdout, "- %s\n",
+			config.suppressOutputEnable > 0 ?
+					"Suppressing file read output and breaks." :
+					"Showing DNA Sequence identifier and allowing breaks.");
+
+	fprintf(stdout, "- Z score filtering is %s",
+			config.zThresholdEnable ? "enabled" : "disabled");
+
+	if (config.zThresholdEnable > 0) {
+		fprintf(stdout, "\n    with threshold of %LG", config.zThreshold);
+	}
+	fprintf(stdout, ".\n");
+
+	if (config.perRecordEnable > 0) {
+		fprintf(stdout,
+				"- Per record kmer profiles using %d threads.\n",
+				config.threads);
+	}
+
+	if (config.positionalBinSize > 0) {
+		fprintf(stdout, "- Positional histogram with bins of %d bases.\n",
+				config.positionalBinSize);
+	}
+
+	if (config.dedupEnable > 0) {
+		fprintf(stdout, "- Skipping duplicate records.\n");
+	}
+
+	if (config.canonicalEnable > 0) {
+		fprintf(stdout, "- Counting canonical kmers of both strands.\n");
+	}
+
+	if (config.directIoEnable > 0) {
+		fprintf(stdout, "- Reading the sequence file with direct I/O.\n");
+	}
+
+	if (config.indexEnable > 0) {
+		fprintf(stdout, "- Writing an index of kmer occurrences.\n");
+	}
+
+	if (config.mphfEnable > 0) {
+		fprintf(stdout,
+				"- Freezing the counts into a minimal perfect hash with %d bit fingerprints.\n",
+				config.fingerprintBits);
+	}
+
+	if (config.pattern) {
+		fprintf(stdout,
+				"- Counting the %d care positions of the spaced seed %s.\n",
+				config.k, config.pattern);
+	}
+
+	if (config.windowSize > 0) {
+		fprintf(stdout,
+				"- Scanning %d base windows every %d bases for kmers enriched over their genome-wide count at p %g.\n",
+				config.windowSize, config.windowStep, config.windowP);
+	}
+
+	if (config.dyadLeft) {
+		fprintf(stdout,
+				"- Counting dyads of a %d base and a %d base half-site %d to %d bases apart.\n",
+				config.dyadLeft, config.dyadRight, config.dyadGapMin,
+				config.dyadGapMax);
+	}
+
+	if (config.mismatches > 0) {
+		fprintf(stdout, "- Counting kmer neighborhoods of up to %d mismatches.\n",
+				config.mismatches);
+	}
+
+	if (config.command == COMMAND_PACK) {
+		fprintf(stdout, "- Packing the sequence file into a 2 bit cache.\n");
+	}
+
+	if (config.minEntropy > 0) {
+		fprintf(stdout, "- Masking kmers with less than %g bits of entropy per base.\n",
+				config.minEntropy);
+	}
+
+	if (config.dustThreshold > 0) {
+		fprintf(stdout, "- Masking kmers with a DUST score above %g.\n",
+				config.dustThreshold);
+	}
+
+	if (config.command == COMMAND_MERGE) {
+		fprintf(stdout, "- Merging %d shard files.\n", config.numMergeFiles);
+	} else if (config.shardCount > 0) {
+		fprintf(stdout, "- Counting shard %d of shards 0 to %d.\n",
+				config.shardIndex, config.shardCount - 1);
+	}
+
+	if (config.sampleFraction > 0) {
+		fprintf(stdout,
+				"- Estimating the run from random blocks of %g of the sequence file.\n",
+				config.sampleFraction);
+	}
+
+	if (config.maxMemory) {
+		fprintf(stdout, "- Memory budget of %0.1f mibibytes.\n",
+				config.maxMemory / (double) (1024 * 1024));
+	}
+
+	if (config.engine == ENGINE_AUTO && config.perRecordEnable <= 0) {
+		fprintf(stdout, "- Choosing the counting engine from the input size.\n");
+	} else if (config.k > MAX_CODE_K) {
+		fprintf(stdout,
+				"- Counting %d base kmers as two words in %s buckets of 64 bit counts with %d threads.\n",
+				config.k, engine_name(config.engine), config.threads);
+	} else if (config.engine != ENGINE_TREE && config.perRecordEnable <= 0) {
+		fprintf(stdout,
+				"- Counting in a shared %s table of %d bit counters with %d threads",
+				engine_name(config.engine), config.counterBits,
+				config.threads);
+		if (config.combineSize > 0) {
+			fprintf(stdout, " and write combining buffers of %d kmers",
+					config.combineSize);
+		}
+		fprintf(stdout, ".\n");
+	}
+
+	//if suppressOutputEnable is false and no command line arguments have been given:
+	if (config.suppressOutputEnable == 0 && argc < 2) {
+		fprintf(stdout, "Press enter to proceed with this configuration.");
+		getchar();
+	}
+
+	/* Double check configuration */
+	if (config.k < 0 || config.k > MAX_K) {
+		fprintf(stderr,
+				"%d is not a valid value for k. Please select a number greater than zero\n",
+				config.k);
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.engine == ENGINE_TREE && config.k > MAX_TREE_K) {
+		fprintf(stderr, "The tree engine is limited to k <= %d.\n", MAX_TREE_K);
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.k > MAX_CODE_K
+			&& ((config.engine != ENGINE_HASH && config.engine != ENGINE_SORT
+					&& config.engine != ENGINE_AUTO) || config.pattern
+					|| config.dyadLeft || config.positionalBinSize > 0
+					|| config.mismatches > 0 || config.indexEnable > 0
+					|| config.mphfEnable > 0 || config.shardCount > 0
+					|| config.windowSize > 0 || config.perRecordEnable > 0
+					|| config.sampleFraction > 0
+					|| config.command != COMMAND_COUNT)) {
+		fprintf(stderr,
+				"Kmers of more than %d bases are counted into a histogram by the hash or sort engine, not with --pattern, --dyad, --positional, --mismatches, --index, --mphf, --shard, --window, --per-record or --sample.\n",
+				MAX_CODE_K);
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.canonicalEnable > 0 && config.k <= MAX_CODE_K) {
+		fprintf(stderr,
+				"--canonical counts kmers of more than %d bases only.\n",
+				MAX_CODE_K);
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.engine == ENGINE_DENSE && count_table_k() > MAX_DENSE_K) {
+		fprintf(stderr, "The dense engine is limited to k <= %d.\n",
+				MAX_DENSE_K);
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.positionalBinSize > 0 && config.engine != ENGINE_TREE
+			&& config.engine != ENGINE_AUTO) {
+		fprintf(stderr,
+				"The positional histogram is counted by the tree engine only.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.shardCount > 0 && config.command == COMMAND_COUNT
+			&& (config.engine == ENGINE_TREE || config.positionalBinSize > 0
+					|| config.perRecordEnable > 0)) {
+		fprintf(stderr,
+				"--shard counts with the dense, hash, sort or disk engine and no positional or per record output.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.indexEnable > 0
+			&& (config.command != COMMAND_COUNT || config.shardCount > 0
+					|| config.perRecordEnable > 0)) {
+		fprintf(stderr,
+				"--index is written by a histogram run, not with --shard, --per-record, pack or merge.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.mphfEnable > 0
+			&& (config.engine == ENGINE_TREE || config.positionalBinSize > 0
+					|| config.command != COMMAND_COUNT
+					|| config.shardCount > 0 || config.perRecordEnable > 0
+					|| config.sampleFraction > 0)) {
+		fprintf(stderr,
+				"--mphf freezes the count table of a histogram run of --engine dense, hash, sort, disk or auto, not the tree engine or --positional.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.pattern
+			&& (config.engine == ENGINE_TREE || config.positionalBinSize > 0
+					|| config.shardCount > 0
+					|| config.command != COMMAND_COUNT)) {
+		fprintf(stderr,
+				"--pattern counts with the dense, hash, sort or disk engine and no positional or shard output.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.windowSize > 0
+			&& (config.engine == ENGINE_TREE || config.engine == ENGINE_SORT
+					|| config.engine == ENGINE_DISK || config.positionalBinSize > 0
+					|| config.shardCount > 0 || config.perRecordEnable > 0
+					|| config.sampleFraction > 0 || config.dyadLeft
+					|| config.command != COMMAND_COUNT)) {
+		fprintf(stderr,
+				"--window looks kmers up in the dense or hash engine table of a histogram run, not with --shard, --per-record, --positional, --sample or --dyad.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.windowSize > 0 && config.windowSize < config.span) {
+		fprintf(stderr, "A window of %d bases cannot hold a kmer of %d bases.\n",
+				config.windowSize, config.span);
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.dyadLeft
+			&& (config.engine == ENGINE_TREE || config.positionalBinSize > 0
+					|| config.shardCount > 0 || config.pattern
+					|| config.perRecordEnable > 0 || config.indexEnable > 0
+					|| config.mismatches > 0 || config.mphfEnable > 0
+					|| config.sampleFraction > 0 || config.minEntropy > 0
+					|| config.dustThreshold > 0
+					|| config.command != COMMAND_COUNT)) {
+		fprintf(stderr,
+				"--dyad counts a histogram with the dense, hash, sort or disk engine and no positional, shard, per record, index, mismatch, mphf, sample, masking or pattern output.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.mismatches > 0
+			&& (config.k > MAX_MISMATCH_K || config.shardCount > 0
+					|| config.perRecordEnable > 0
+					|| config.command == COMMAND_PACK)) {
+		fprintf(stderr,
+				"--mismatches is limited to k <= %d and a histogram or merge run.\n",
+				MAX_MISMATCH_K);
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.sampleFraction > 0
+			&& (config.command != COMMAND_COUNT || config.shardCount > 0
+					|| config.perRecordEnable > 0
+					|| config.positionalBinSize > 0 || config.indexEnable > 0
+					|| config.mismatches > 0)) {
+		fprintf(stderr,
+				"--sample estimates a histogram run, not --shard, --per-record, --positional, --index, --mismatches, pack or merge.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.dustThreshold > 0 && config.k < 4) {
+		fprintf(stderr, "--dust scores triplets and needs k >= 4.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.command == COMMAND_MERGE && config.numMergeFiles == 0) {
+		fprintf(stderr,
+				"No shard files to merge.\nUsage is \"findKmer merge 16mer_Shard_0_of_2_Of_genome.fa.bin 16mer_Shard_1_of_2_Of_genome.fa.bin\".\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.positionalBinSize > 0 && config.k > MAX_POSITIONAL_K) {
+		fprintf(stderr,
+				"The positional histogram is limited to k <= %d.\n",
+				MAX_POSITIONAL_K);
+		exit(EXIT_FAILURE);
+	}
+
+	//a merge only needs the name of the sequence file, the shards were counted elsewhere.
+	if (config.command == COMMAND_MERGE) {
+	} else if ((config.sequence_file_pointer = open_sequence_input()) != NULL) {
+		//fprintf(stdout, "Sequence file opened properly\n");
+	} else {
+		fprintf(stderr, "Sequence file failed to open\n\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((config.out_file_pointer = fopen(config.out_file, "wb")) != NULL) {
+		//fprintf(stdout, "Out file opened properly\n");
+		//the per record profiles and the packed cache are binary, only the histogram gets the csv header.
+		if (config.perRecordEnable <= 0 && config.sampleFraction <= 0
+				&& ((config.command == COMMAND_COUNT && config.shardCount == 0)
+						|| config.command == COMMAND_MERGE)) {
+			fprintf(config.out_file_pointer, OUT_FILE_COLUMN_HEADERS);
+		}
+	} else {
+		fprintf(stderr,
+				"Out file failed to open\nFile MUST be in current directory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(stdout, "Sequence file and out file opened properly\n");
+
+	fprintf(stdout, "\n");
 }
 /* usage */
 static void usage() {
 	fprintf(stdout, "\n");
 	fprintf(stdout, "Usage: findKmer [options]\n");
+	fprintf(stdout, "       findKmer pack [--parse|-p <sequence_file>] [--export|-e <cache_file>]\n"
+			"               Converts the sequence file to a 2 bit packed cache,\n"
+			"               named <sequence_file>%s by default.\n"
+			"               The cache can be given to --parse in place of\n"
+			"               the sequence file in every counting mode.\n\n",
+	PACKED_CACHE_EXTENSION);
+	fprintf(stdout, "       findKmer bench [--threads|-t <threads>] [--insert-batch <kmers>]\n"
+			"                      [--huge-pages <setting>] [--numa <policy>]\n"
+			"               Times the dense and hash engines adding random kmers\n"
+			"               one at a time and in prefetched batches, k = 12 to 20.\n\n");
+	fprintf(stdout, "       findKmer query <index_file> <kmer> [<kmer> ...]\n"
+			"               Prints the kmer, record identifier and offset of every\n"
+			"               hit of the kmers in an index written by --index.\n\n");
+	fprintf(stdout, "       findKmer lookup <mphf_file> <kmer> [<kmer> ...]\n"
+			"               Prints the kmer and its frequency in a frozen index\n"
+			"               written by --mphf, 0 for kmers it does not hold.\n\n");
+	fprintf(stdout, "       findKmer serve --db <shard_file> --socket <path> [--threads|-t <threads>]\n"
+			"               Keeps the counts of a --shard 0/1 run mapped and answers\n"
+			"               lookups on a UNIX domain socket until interrupted.\n"
+			"               Requests are lines, each answered by lines ending\n"
+			"               with an empty line:\n"
+			"                 GET <kmer> [<kmer> ...]\n"
+			"                 PREFIX <bases> [<limit>]\n"
+			"                 TOP <n> [frequency <min>] [entropy <min h>] [prefix <bases>]\n"
+			"                 STATS\n"
+			"               or binary batches of byte 1, a 32 bit count and\n"
+			"               64 bit kmer codes, answered by the count and a 64 bit\n"
+			"               frequency and double Z score for each.\n\n");
+	fprintf(stdout, "       findKmer --jobs <manifest> [options]\n"
+			"               Runs a job for each line of the manifest,\n"
+			"               \"<sequence_file> <k> [<z threshold>|-] [<out_file>|-]\",\n"
+			"               with the other options applying to every job.\n"
+			"               Each sequence file is parsed once for all its jobs,\n"
+			"               which run side by side within --threads cores and\n"
+			"               --max-memory, or the physical memory.\n"
+			"               A histogram only appears once its job succeeds.\n\n");
 	fprintf(stdout, "             [--parse|-p <sequence_file.txt>] \n"
 			"               File with DNA sequence data.\n"
 			"               File must be in current directory.\n"
 			"               Parser follows .fas and .fa formats\n"
+			"               and reads them gzip compressed as well,\n"
+			"               inflating BGZF blocks in parallel.\n"
+			"               - reads the sequence from stdin.\n"
 			"                Default is %s.\n\n",
 	DEFAULT_SEQUENCE_FILE_NAME);
 	fprintf(stdout, "             [--export|-e  <out_file.csv>] \n"
 			"               File to output histogram data to.\n"
 			"                Default output file name is dynamic.\n\n");
 	fprintf(stdout, "             [--ksize|-k  <k>] \n"
-			"               Size of sequence for histogram.\n"
+			"               Size of sequence for histogram, up to %d bases.\n"
+			"               The tree engine counts up to %d, more than %d are\n"
+			"               counted as two words by the hash or sort engine.\n"
 			"                Default is %d.\n\n",
-	DEFAULT_K_VALUE);
+	MAX_K, MAX_TREE_K, MAX_CODE_K, DEFAULT_K_VALUE);
 	fprintf(stdout, "             [--quiet|-q  < 0 for FALSE | 1 for TRUE >] \n"
 			"               Suppress file read output and breaks.\n"
 			"                Default is %s.\n\n",
@@ -389,6 +1829,158 @@ static void usage() {
 			"               Suppress sequences with Z scores < threshold.\n"
 			"                Default is %s with a value of %LG.\n\n",
 	DEFAULT_Z_THRESHOLD_ENABLE ? "enabled" : "disabled", tempzThreshold);
+	fprintf(stdout, "             [--per-record|-r] \n"
+			"               Write a sparse kmer count vector for every record\n"
+			"               in a binary CSR file instead of the histogram.\n"
+			"                Default is %s.\n\n",
+	DEFAULT_PER_RECORD_ENABLE ? "enabled" : "disabled");
+	fprintf(stdout, "             [--threads|-t  <number_of_threads>] \n"
+			"               Worker threads for the parallel modes.\n"
+			"                Default is one per core.\n\n");
+	fprintf(stdout, "             [--positional  <bin_size>] \n"
+			"               Also count kmers by their offset in each record,\n"
+			"               in bins of bin_size bases, and score how unevenly\n"
+			"               each kmer is spread over the bins. k <= %d.\n"
+			"                Default is disabled.\n\n", MAX_POSITIONAL_K);
+	fprintf(stdout, "             [--engine  < tree | dense | hash | sort | disk | auto >] \n"
+			"               How kmers are counted. tree, dense (k <= %d)\n"
+			"               and hash are one tree or table shared by all\n"
+			"               threads using atomic increments.\n"
+			"               sort and disk bucket kmers by their leading bases\n"
+			"               in memory or in temporary files and sort each bucket.\n"
+			"               auto picks the fastest that fits --max-memory.\n"
+			"                Default is tree, or auto with --max-memory, --mphf\n"
+			"                or k > %d.\n\n",
+			MAX_DENSE_K, MAX_TREE_K);
+	fprintf(stdout, "             [--max-memory  <bytes>[K|M|G]] \n"
+			"               Plan the run to stay within this much memory and\n"
+			"               stop before counting if the engine cannot.\n"
+			"               Input of unknown size, like stdin, is counted\n"
+			"               by the dense or disk engine, and a hash table\n"
+			"               stops the run before it grows past the budget.\n"
+			"                Default is no limit.\n\n");
+	fprintf(stdout, "             [--sample  <fraction>] \n"
+			"               Count random blocks of this fraction of the sequence\n"
+			"               file, 0.01 for 1%%, and report the distinct kmers, the\n"
+			"               most frequent kmers, the base composition, the runtime\n"
+			"               and the memory plan a full run is expected to have.\n"
+			"               Nothing else is counted.\n"
+			"                Default is disabled.\n\n");
+	fprintf(stdout, "             [--plan-sample  <fraction>] \n"
+			"               Before counting, count random blocks of this\n"
+			"               fraction of the sequence file, up to %d blocks,\n"
+			"               and plan the engine, memory and table size for\n"
+			"               the distinct kmers they predict. 0 plans for\n"
+			"               min(4^k, input). gzip files and stdin are not\n"
+			"               sampled, the hash table grows as it fills.\n"
+			"                Default is %g.\n\n", PLAN_SAMPLE_MAX_BLOCKS,
+			DEFAULT_PLAN_SAMPLE_FRACTION);
+	fprintf(stdout, "             [--combine  <kmers>] \n"
+			"               Buffer this many kmers per thread and add them\n"
+			"               to the shared table in batches, which helps with\n"
+			"               very frequent kmers like poly A.\n"
+			"                Default is %d (disabled).\n\n", DEFAULT_COMBINE_SIZE);
+	fprintf(stdout, "             [--insert-batch  <kmers>] \n"
+			"               Prefetch the table slots of this many kmers before\n"
+			"               adding them, so large dense and hash tables have\n"
+			"               many memory reads in flight. 0 adds one at a time.\n"
+			"                Default is %d.\n\n", DEFAULT_INSERT_BATCH);
+	fprintf(stdout, "             [--huge-pages  < transparent | explicit | off >] \n"
+			"               Map the dense and hash tables in 2 MiB pages so\n"
+			"               random adds miss the TLB less. explicit uses the\n"
+			"               pages reserved in /proc/sys/vm/nr_hugepages.\n"
+			"               Either falls back to plain pages when none are\n"
+			"               available.\n"
+			"                Default is transparent.\n\n");
+	fprintf(stdout, "             [--numa  < interleave | off >] \n"
+			"               Spread the pages of the dense and hash tables over\n"
+			"               all NUMA nodes instead of the node that zeroes them.\n"
+			"                Default is interleave.\n\n");
+	fprintf(stdout, "             [--counter-bits  < 8 | 16 | 32 >] \n"
+			"               Width of the dense and hash engine counters.\n"
+			"               Counts that do not fit spill to an overflow map.\n"
+			"               8 bits make the dense table a quarter of 32.\n"
+			"               A hash slot also holds an 8 byte kmer, so the\n"
+			"               hash table shrinks by a quarter at most.\n"
+			"                Default is %d.\n\n", DEFAULT_COUNTER_BITS);
+	fprintf(stdout, "             [--dedup] \n"
+			"               Skip records whose bases are identical to a record\n"
+			"               already counted, like transcripts sharing a promoter.\n"
+			"                Default is %s.\n\n",
+	DEFAULT_DEDUP_ENABLE ? "enabled" : "disabled");
+	fprintf(stdout, "             [--canonical] \n"
+			"               Count a kmer and its reverse complement as one,\n"
+			"               written as the smaller of the two, with the\n"
+			"               expected count of both strands. k > %d.\n"
+			"                Default is %s.\n\n", MAX_CODE_K,
+	DEFAULT_CANONICAL_ENABLE ? "enabled" : "disabled");
+	fprintf(stdout, "             [--shard  <i>/<N>] \n"
+			"               Count only the kmers that hash to shard i of N and write\n"
+			"               them to a sorted binary shard file. Combine the N files with\n"
+			"               \"findKmer merge <shard files>\" into the usual histogram.\n"
+			"                Default is disabled.\n\n");
+	fprintf(stdout, "             [--min-entropy  <bits>] \n"
+			"               Do not count kmers whose Shannon entropy per base,\n"
+			"               the h column, is below bits (0 to 2).\n"
+			"                Default is disabled.\n\n");
+	fprintf(stdout, "             [--dust  <score>] \n"
+			"               Do not count kmers whose DUST score, repeated base\n"
+			"               triplets per triplet, is above score. k >= 4.\n"
+			"                Default is disabled.\n\n");
+	fprintf(stdout, "             [--window  <bases>[,<step>]] \n"
+			"               After counting, slide a window of this many bases\n"
+			"               over every record, step bases at a time, and write\n"
+			"               the stretches where a kmer is enriched over its\n"
+			"               genome-wide count to a BED file. Needs the dense or\n"
+			"               hash engine.\n"
+			"                Default is disabled, the step defaults to the window.\n\n");
+	fprintf(stdout, "             [--window-p  <p>] \n"
+			"               Chance of a window count at least as high in any\n"
+			"               window of the file below which a kmer is enriched.\n"
+			"                Default is %g.\n\n", DEFAULT_WINDOW_P);
+	fprintf(stdout, "             [--dyad  <k1>,<k2>,<min gap>-<max gap>] \n"
+			"               Count pairs of a k1 base and a k2 base half-site with\n"
+			"               a spacer of min to max bases, written like ACG....TTA and\n"
+			"               scored against the pairs of the same spacer. k is k1 + k2.\n"
+			"               All spacers are counted in one pass of the file.\n"
+			"                Default is disabled.\n\n");
+	fprintf(stdout, "             [--pattern  <spaced_seed>] \n"
+			"               Count only the care positions of a spaced seed\n"
+			"               like 1110011, which writes kmers like ACG..CA.\n"
+			"               It starts and ends with a 1, spans up to %d bases\n"
+			"               and k is its number of 1s.\n"
+			"                Default is disabled.\n\n", MAX_PATTERN_SPAN);
+	fprintf(stdout, "             [--mismatches  < 1 | 2 >] \n"
+			"               Also write the total count of the kmers within 1 or 2\n"
+			"               substitutions of every kmer, with its expected count\n"
+			"               and Z score. k <= %d.\n"
+			"                Default is disabled.\n\n", MAX_MISMATCH_K);
+	fprintf(stdout, "             [--index] \n"
+			"               Also write an index of the records and offsets of\n"
+			"               every kmer of the histogram, or with -z of every\n"
+			"               kmer that passed. List the hits of kmers with\n"
+			"               \"findKmer query <index_file> <kmer> ...\".\n"
+			"                Default is disabled.\n\n");
+	fprintf(stdout, "             [--mphf] \n"
+			"               Also freeze the counts into a minimal perfect hash\n"
+			"               index of a few bits per kmer plus its count, read with\n"
+			"               \"findKmer lookup <mphf_file> <kmer> ...\".\n"
+			"               Needs --engine dense, hash, sort, disk or auto,\n"
+			"               which is the default with --mphf.\n"
+			"                Default is disabled.\n\n");
+	fprintf(stdout, "             [--fingerprint-bits  <bits>] \n"
+			"               Bits of every kmer the frozen index keeps to tell\n"
+			"               kmers it does not hold, 0 to 32. With 0 those get\n"
+			"               the count of some kmer it holds.\n"
+			"                Default is %d.\n\n", DEFAULT_FINGERPRINT_BITS);
+	fprintf(stdout, "             [--simd  < auto | avx512 | avx2 | sse4.2 | scalar >] \n"
+			"               Kernel that classifies the FASTA text.\n"
+			"                Default is auto, the widest this CPU supports.\n\n");
+	fprintf(stdout, "             [--direct-io] \n"
+			"               Read the sequence file with O_DIRECT so a genome read\n"
+			"               once does not push everything else out of the page cache.\n"
+			"                Default is %s.\n\n",
+	DEFAULT_DIRECT_IO_ENABLE ? "enabled" : "disabled");
 	fprintf(stdout, "\n");
 }
 int parse_arguments(int argc, char **argv) {
@@ -399,7 +1991,14 @@ int parse_arguments(int argc, char **argv) {
 	} else {
 
 		while (i < argc) {
-			if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+			if (i == 1 && strcmp(argv[i], "pack") == 0) {
+				config.command = COMMAND_PACK;
+			} else if (i == 1 && strcmp(argv[i], "bench") == 0) {
+				config.command = COMMAND_BENCH;
+			} else if (i == 1 && strcmp(argv[i], "merge") == 0) {
+				config.command = COMMAND_MERGE;
+				config.mergeFiles = (char**) allocate_array(argc, sizeof(char*));
+			} else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
 				exit(1);
 			} else if (strcmp(argv[i], "-e") == 0
 					|| strcmp(argv[i], "--export") == 0) {
@@ -412,7 +2011,7 @@ int parse_arguments(int argc, char **argv) {
 				if (argv[i] != NULL) {
 					check_file(argv[i], "w");
 				}
-				config.out_file = argv[i];
+				config.out_file = strdup(argv[i]); //main frees it.
 			} else if (strcmp(argv[i], "-p") == 0
 					|| strcmp(argv[i], "--parse") == 0) {
 				i++;
@@ -421,11 +2020,14 @@ int parse_arguments(int argc, char **argv) {
 					return 0;
 				}
 
-				if (argv[i] != NULL) {
+				if (strcmp(argv[i], "-") == 0) {
+					config.stdinEnable = 1;
+					config.sequence_file = strdup(STDIN_SEQUENCE_NAME);
+				} else {
 					check_file(argv[i], "r");
+					config.stdinEnable = 0;
+					config.sequence_file = strdup(argv[i]); //main frees it.
 				}
-
-				config.sequence_file = argv[i];
 			} else if (strcmp(argv[i], "-k") == 0
 					|| strcmp(argv[i], "--ksize") == 0) {
 				i++;
@@ -435,10 +2037,10 @@ int parse_arguments(int argc, char **argv) {
 				} else {
 
 					int k = atoi(argv[i]);
-					if (k < 0 || k > 20) {
+					if (k < 0 || k > MAX_K) {
 						fprintf(stderr,
-								"%d is not a valid value for k.\nPlease select a number greater than zero and less than 21\n",
-								k);
+								"%d is not a valid value for k.\nPlease select a number greater than zero and at most %d\n",
+								k, MAX_K);
 						exit(EXIT_FAILURE);
 					}
 					config.k = k;
@@ -475,77 +2077,490 @@ int parse_arguments(int argc, char **argv) {
 					config.zThresholdEnable = 1;
 					config.zThreshold = atoi(argv[i]);
 				}
-			} else {
-				fprintf(stderr, "Ignoring invalid option %s\n", argv[i]);
-				if (config.suppressOutputEnable == 0) {
-					fprintf(stderr, "Press enter to continue.\n");
-					getchar();
+			} else if (strcmp(argv[i], "-r") == 0
+					|| strcmp(argv[i], "--per-record") == 0) {
+				config.perRecordEnable = 1;
+			} else if (strcmp(argv[i], "-t") == 0
+					|| strcmp(argv[i], "--threads") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Number of threads is missing\nUsage is \"-t 8\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					int threads = atoi(argv[i]);
+					if (threads < 1) {
+						fprintf(stderr,
+								"%d is not a valid number of threads.\nPlease select a number greater than zero\n",
+								threads);
+						exit(EXIT_FAILURE);
+					}
+					config.threads = threads;
 				}
-			}
-			i++;
-		}
-	}
-
-	return 1;
-}
-void statistics(unsigned long long * const baseCounter,
-		statistics_t * const baseStatistics,
-		unsigned long long * const TotalNumSequencesN,
-		unsigned long int * const maxNumberOfNodes) {
-	const char* nameOfFile = "mer_Base_Stats_Of_";
-	const char* outFileExension = ".txt";
-
-	char* stats_out_file_name = (char*) allocate_array(
-			strlen("999") + strlen(nameOfFile) + strlen(config.sequence_file)
-					+ strlen(outFileExension), sizeof(char));
-
-	sprintf(stats_out_file_name, "%d%s%s%s", config.k, nameOfFile,
-			config.sequence_file, outFileExension);
-
-	FILE * stats_out_file_pointer = NULL;
-	if ((stats_out_file_pointer = fopen(stats_out_file_name, "w")) == NULL) {
-		fprintf(stderr,
-				"Out file failed to open\nFile MUST be in current directory.\n");
-		exit(EXIT_FAILURE);
-	}
-
-	fprintf(stdout,
-			"Statistics of occurrences and probability of A, C, G and T respectively: \n");
-	for (int i = 0; i < 4; i++) {
-		DEBUG_STATISTICS(
-				fprintf(stdout, "%u count / %llu baseCounter\n",baseStatistics[i].Count , *baseCounter));
-
-		fprintf(stdout, "%u", baseStatistics[i].Count);
-
-		baseStatistics[i].Probability = (double) baseStatistics[i].Count
-				/ *baseCounter;
-		if (baseStatistics[i].Probability == 0.0) {
-			fprintf(stdout, "Division overflow detected in statistics.\n");
-			exit(EXIT_FAILURE);
-		}
-
-		fprintf(stdout, ", %Lf\n", baseStatistics[i].Probability);
-		fprintf(stats_out_file_pointer, "%Lf\n", baseStatistics[i].Probability);
-	}
-
-	fprintf(stdout, "Found %llu valid bases total INSIDE sequences >= k.\n",
-			*baseCounter);
-
-	DEBUG(
-			cout << (*TotalNumSequencesN) << " sequences of length k were found."<<endl<<" This is NOT the number of combinations found." << endl;
-
-			cout << nodeCounter << " Nodes created " << endl;
-
-			cout << (*maxNumberOfNodes) << " Max possible Nodes expected " << endl;);
+			} else if (strcmp(argv[i], "--positional") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Bin size is missing\nUsage is \"--positional 100\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					int binSize = atoi(argv[i]);
+					if (binSize < 1) {
+						fprintf(stderr,
+								"%d is not a valid bin size.\nPlease select a number greater than zero\n",
+								binSize);
+						exit(EXIT_FAILURE);
+					}
+					config.positionalBinSize = binSize;
+				}
+			} else if (strcmp(argv[i], "--dedup") == 0) {
+				config.dedupEnable = 1;
+			} else if (strcmp(argv[i], "--canonical") == 0) {
+				config.canonicalEnable = 1;
+			} else if (strcmp(argv[i], "--direct-io") == 0) {
+				config.directIoEnable = 1;
+			} else if (strcmp(argv[i], "--simd") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"SIMD kernel is missing\nUsage is \"--simd avx2\".\n");
+					exit(EXIT_FAILURE);
+				} else if (strcmp(argv[i], "auto") == 0) {
+					config.simd = SIMD_AUTO;
+				} else if (strcmp(argv[i], "avx512") == 0) {
+					config.simd = SIMD_AVX512;
+				} else if (strcmp(argv[i], "avx2") == 0) {
+					config.simd = SIMD_AVX2;
+				} else if (strcmp(argv[i], "sse4.2") == 0) {
+					config.simd = SIMD_SSE42;
+				} else if (strcmp(argv[i], "scalar") == 0) {
+					config.simd = SIMD_SCALAR;
+				} else {
+					fprintf(stderr,
+							"%s is not a valid SIMD kernel.\nPlease select auto, avx512, avx2, sse4.2 or scalar\n",
+							argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if (strcmp(argv[i], "--engine") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Engine is missing\nUsage is \"--engine dense\".\n");
+					exit(EXIT_FAILURE);
+				} else if (strcmp(argv[i], "tree") == 0) {
+					config.engine = ENGINE_TREE;
+				} else if (strcmp(argv[i], "dense") == 0) {
+					config.engine = ENGINE_DENSE;
+				} else if (strcmp(argv[i], "hash") == 0) {
+					config.engine = ENGINE_HASH;
+				} else if (strcmp(argv[i], "sort") == 0) {
+					config.engine = ENGINE_SORT;
+				} else if (strcmp(argv[i], "disk") == 0) {
+					config.engine = ENGINE_DISK;
+				} else if (strcmp(argv[i], "auto") == 0) {
+					config.engine = ENGINE_AUTO;
+				} else {
+					fprintf(stderr,
+							"%s is not a valid engine.\nPlease select tree, dense, hash, sort, disk or auto\n",
+							argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if (strcmp(argv[i], "--max-memory") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Memory budget is missing\nUsage is \"--max-memory 4G\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					char *unit = NULL;
+					double maxMemory = strtod(argv[i], &unit);
+					if (*unit == 'K' || *unit == 'k') {
+						maxMemory *= 1024;
+						unit++;
+					} else if (*unit == 'M' || *unit == 'm') {
+						maxMemory *= 1024 * 1024;
+						unit++;
+					} else if (*unit == 'G' || *unit == 'g') {
+						maxMemory *= 1024 * 1024 * 1024;
+						unit++;
+					}
+					if (maxMemory < 1 || *unit != '\0') {
+						fprintf(stderr,
+								"%s is not a valid memory budget.\nUsage is \"--max-memory 4G\".\n",
+								argv[i]);
+						exit(EXIT_FAILURE);
+					}
+					config.maxMemory = (unsigned long long) maxMemory;
+				}
+			} else if (strcmp(argv[i], "--combine") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Combine buffer size is missing\nUsage is \"--combine 256\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					int combineSize = atoi(argv[i]);
+					if (combineSize < 0) {
+						fprintf(stderr,
+								"%d is not a valid combine buffer size.\n",
+								combineSize);
+						exit(EXIT_FAILURE);
+					}
+					config.combineSize = combineSize;
+				}
+			} else if (strcmp(argv[i], "--insert-batch") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Insert batch size is missing\nUsage is \"--insert-batch 64\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					int insertBatch = atoi(argv[i]);
+					if (insertBatch < 0 || insertBatch > MAX_INSERT_BATCH) {
+						fprintf(stderr,
+								"%d is not a valid insert batch size.\nPlease select 0 to %d\n",
+								insertBatch, MAX_INSERT_BATCH);
+						exit(EXIT_FAILURE);
+					}
+					config.insertBatch = insertBatch;
+				}
+			} else if (strcmp(argv[i], "--jobs") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Job manifest is missing\nUsage is \"--jobs manifest.txt\".\n");
+					exit(EXIT_FAILURE);
+				}
+				check_file(argv[i], "r");
+				config.jobsFile = argv[i];
+			} else if (strcmp(argv[i], "--sample") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Sample fraction is missing\nUsage is \"--sample 0.01\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					double sampleFraction = atof(argv[i]);
+					if (sampleFraction <= 0 || sampleFraction > 1) {
+						fprintf(stderr,
+								"%s is not a valid sample fraction.\nPlease select a number above 0 and up to 1\n",
+								argv[i]);
+						exit(EXIT_FAILURE);
+					}
+					config.sampleFraction = sampleFraction;
+				}
+			} else if (strcmp(argv[i], "--plan-sample") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Plan sample fraction is missing\nUsage is \"--plan-sample 0.001\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					double planSampleFraction = atof(argv[i]);
+					if (planSampleFraction < 0 || planSampleFraction > 1) {
+						fprintf(stderr,
+								"%s is not a valid plan sample fraction.\nPlease select a number from 0 to 1\n",
+								argv[i]);
+						exit(EXIT_FAILURE);
+					}
+					config.planSampleFraction = planSampleFraction;
+				}
+			} else if (strcmp(argv[i], "--huge-pages") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Huge pages are missing\nUsage is \"--huge-pages explicit\".\n");
+					exit(EXIT_FAILURE);
+				} else if (strcmp(argv[i], "transparent") == 0) {
+					config.hugePages = HUGE_PAGES_TRANSPARENT;
+				} else if (strcmp(argv[i], "explicit") == 0) {
+					config.hugePages = HUGE_PAGES_EXPLICIT;
+				} else if (strcmp(argv[i], "off") == 0) {
+					config.hugePages = HUGE_PAGES_OFF;
+				} else {
+					fprintf(stderr,
+							"%s is not a valid huge page setting.\nPlease select transparent, explicit or off\n",
+							argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if (strcmp(argv[i], "--numa") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"NUMA policy is missing\nUsage is \"--numa off\".\n");
+					exit(EXIT_FAILURE);
+				} else if (strcmp(argv[i], "interleave") == 0) {
+					config.numa = NUMA_INTERLEAVE;
+				} else if (strcmp(argv[i], "off") == 0) {
+					config.numa = NUMA_OFF;
+				} else {
+					fprintf(stderr,
+							"%s is not a valid NUMA policy.\nPlease select interleave or off\n",
+							argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if (strcmp(argv[i], "--counter-bits") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Counter bits are missing\nUsage is \"--counter-bits 16\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					int counterBits = atoi(argv[i]);
+					if (counterBits != 8 && counterBits != 16
+							&& counterBits != 32) {
+						fprintf(stderr,
+								"%d is not a valid counter width.\nPlease select 8, 16 or 32\n",
+								counterBits);
+						exit(EXIT_FAILURE);
+					}
+					config.counterBits = counterBits;
+				}
+			} else if (strcmp(argv[i], "--shard") == 0) {
+				i++;
+				int shardIndex, shardCount;
+				char end;
+				if (i == argc
+						|| sscanf(argv[i], "%d/%d%c", &shardIndex, &shardCount,
+								&end) != 2 || shardCount < 1 || shardIndex < 0
+						|| shardIndex >= shardCount) {
+					fprintf(stderr,
+							"Shard is missing or invalid\nUsage is \"--shard 0/4\" for the first of 4 shards.\n");
+					exit(EXIT_FAILURE);
+				}
+				config.shardIndex = shardIndex;
+				config.shardCount = shardCount;
+			} else if (strcmp(argv[i], "--pattern") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Spaced seed pattern is missing\nUsage is \"--pattern 1110011\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					const char *pattern = argv[i];
+					const size_t span = strlen(pattern);
+					const int weight = count(pattern, pattern + span, '1');
+					if (span < 1 || span > MAX_PATTERN_SPAN
+							|| strspn(pattern, "01") != span
+							|| pattern[0] != '1' || pattern[span - 1] != '1'
+							|| weight > 20) {
+						fprintf(stderr,
+								"%s is not a valid pattern.\nPlease use 1s and 0s that start and end with a 1, up to %d long with at most 20 1s\n",
+								pattern, MAX_PATTERN_SPAN);
+						exit(EXIT_FAILURE);
+					}
+					config.pattern = pattern;
+				}
+			} else if (strcmp(argv[i], "--window") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Window is missing\nUsage is \"--window 1000,100\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					int windowSize = 0, windowStep = 0;
+					const int fields = sscanf(argv[i], "%d,%d", &windowSize,
+							&windowStep);
+					if (fields == 1) {
+						windowStep = windowSize;
+					}
+					if (fields < 1 || windowSize < 1 || windowStep < 1) {
+						fprintf(stderr,
+								"%s is not a valid window.\nPlease give the bases of a window and optionally of its step, like 1000,100\n",
+								argv[i]);
+						exit(EXIT_FAILURE);
+					}
+					config.windowSize = windowSize;
+					config.windowStep = windowStep;
+				}
+			} else if (strcmp(argv[i], "--window-p") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Window p value is missing\nUsage is \"--window-p 0.01\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					double windowP = atof(argv[i]);
+					if (windowP <= 0 || windowP >= 1) {
+						fprintf(stderr,
+								"%s is not a valid window p value.\nPlease select a number above 0 and below 1\n",
+								argv[i]);
+						exit(EXIT_FAILURE);
+					}
+					config.windowP = windowP;
+				}
+			} else if (strcmp(argv[i], "--dyad") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Dyad is missing\nUsage is \"--dyad 3,3,4-12\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					int left = 0, right = 0, gapMin = -1, gapMax = -1;
+					const int fields = sscanf(argv[i], "%d,%d,%d-%d", &left,
+							&right, &gapMin, &gapMax);
+					if (fields == 3) {
+						gapMax = gapMin;
+					}
+					if (fields < 3 || left < 1 || right < 1
+							|| left + right > 20 || gapMin < 0
+							|| gapMax < gapMin
+							|| gapMax - gapMin + 1 > MAX_DYAD_GAPS) {
+						fprintf(stderr,
+								"%s is not a valid dyad.\nPlease give half-sites of k1 + k2 <= 20 bases and up to %d gap lengths, like 3,3,4-12\n",
+								argv[i], MAX_DYAD_GAPS);
+						exit(EXIT_FAILURE);
+					}
+					config.dyadLeft = left;
+					config.dyadRight = right;
+					config.dyadGapMin = gapMin;
+					config.dyadGapMax = gapMax;
+				}
+			} else if (strcmp(argv[i], "--mismatches") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Number of mismatches is missing\nUsage is \"--mismatches 1\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					int mismatches = atoi(argv[i]);
+					if (mismatches < 1 || mismatches > MAX_MISMATCHES) {
+						fprintf(stderr,
+								"%s is not a valid number of mismatches.\nPlease select 1 or 2\n",
+								argv[i]);
+						exit(EXIT_FAILURE);
+					}
+					config.mismatches = mismatches;
+				}
+			} else if (strcmp(argv[i], "--index") == 0) {
+				config.indexEnable = 1;
+			} else if (strcmp(argv[i], "--mphf") == 0) {
+				config.mphfEnable = 1;
+			} else if (strcmp(argv[i], "--fingerprint-bits") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Fingerprint bits are missing\nUsage is \"--fingerprint-bits 8\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					int fingerprintBits = atoi(argv[i]);
+					if (fingerprintBits < 0 || fingerprintBits > 32) {
+						fprintf(stderr,
+								"%d is not a valid number of fingerprint bits.\nPlease select 0 to 32\n",
+								fingerprintBits);
+						exit(EXIT_FAILURE);
+					}
+					config.fingerprintBits = fingerprintBits;
+				}
+			} else if (strcmp(argv[i], "--min-entropy") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"Minimum entropy is missing\nUsage is \"--min-entropy 1.5\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					double minEntropy = atof(argv[i]);
+					if (minEntropy <= 0 || minEntropy > 2) {
+						fprintf(stderr,
+								"%s is not a valid minimum entropy.\nPlease select a number of bits above 0 and up to 2\n",
+								argv[i]);
+						exit(EXIT_FAILURE);
+					}
+					config.minEntropy = minEntropy;
+				}
+			} else if (strcmp(argv[i], "--dust") == 0) {
+				i++;
+				if (i == argc) {
+					fprintf(stderr,
+							"DUST score is missing\nUsage is \"--dust 2\".\n");
+					exit(EXIT_FAILURE);
+				} else {
+					double dustThreshold = atof(argv[i]);
+					if (dustThreshold <= 0) {
+						fprintf(stderr,
+								"%s is not a valid DUST score.\nPlease select a number greater than zero\n",
+								argv[i]);
+						exit(EXIT_FAILURE);
+					}
+					config.dustThreshold = dustThreshold;
+				}
+			} else if (config.command == COMMAND_MERGE && argv[i][0] != '-') {
+				check_file(argv[i], "r");
+				config.mergeFiles[config.numMergeFiles++] = argv[i];
+			} else {
+				fprintf(stderr, "Ignoring invalid option %s\n", argv[i]);
+				if (config.suppressOutputEnable == 0) {
+					fprintf(stderr, "Press enter to continue.\n");
+					getchar();
+				}
+			}
+			i++;
+		}
+	}
+
+	return 1;
+}
+void statistics(unsigned long long * const baseCounter,
+		statistics_t * const baseStatistics,
+		unsigned long long * const TotalNumSequencesN,
+		const unsigned long long foundCount,
+		const unsigned long long possibleCount,
+		const scan_summary_t * const summary) {
+	const char* nameOfFile = "mer_Base_Stats_Of_";
+	const char* outFileExension = ".txt";
+
+	char* stats_out_file_name = (char*) allocate_array(
+			strlen(kmer_label()) + 1 + strlen(nameOfFile) + strlen(config.sequence_file)
+					+ strlen(outFileExension), sizeof(char));
+
+	sprintf(stats_out_file_name, "%s%s%s%s", kmer_label(), nameOfFile,
+			config.sequence_file, outFileExension);
+
+	FILE * stats_out_file_pointer = NULL;
+	if ((stats_out_file_pointer = fopen(stats_out_file_name, "w")) == NULL) {
+		fprintf(stderr,
+				"Out file failed to open\nFile MUST be in current directory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(stdout,
+			"Statistics of occurrences and probability of A, C, G and T respectively: \n");
+	for (int i = 0; i < 4; i++) {
+		DEBUG_STATISTICS(
+				fprintf(stdout, "%u count / %llu baseCounter\n",baseStatistics[i].Count , *baseCounter));
+
+		fprintf(stdout, "%u", baseStatistics[i].Count);
+
+		baseStatistics[i].Probability = (double) baseStatistics[i].Count
+				/ *baseCounter;
+		if (baseStatistics[i].Probability == 0.0) {
+			fprintf(stdout, "Division overflow detected in statistics.\n");
+			exit(EXIT_FAILURE);
+		}
 
-	fprintf(stdout, "%0.0f%% tree density.\n",
-			((double) (nodeCounter) / (double) (*maxNumberOfNodes)) * 100);
+		fprintf(stdout, ", %Lf\n", baseStatistics[i].Probability);
+		fprintf(stats_out_file_pointer, "%Lf\n", baseStatistics[i].Probability);
+	}
+
+	fprintf(stdout, "Found %llu valid bases total INSIDE sequences >= k.\n",
+			*baseCounter);
+
+	DEBUG(
+			cout << (*TotalNumSequencesN) << " sequences of length k were found."<<endl<<" This is NOT the number of combinations found." << endl;
+
+			cout << foundCount << " Nodes created " << endl;
+
+			cout << possibleCount << " Max possible Nodes expected " << endl;);
+
+	fprintf(stdout, "%0.0f%% %s density.\n",
+			((double) (foundCount) / (double) (possibleCount)) * 100,
+			config.engine == ENGINE_TREE ? "tree" : "table");
 
-	if (nodeCounter == (*maxNumberOfNodes)) {
+	if (foundCount == possibleCount) {
 		fprintf(stats_out_file_pointer,
 				"All possible %dmers combinations were found.\n", config.k);
 		fprintf(stdout, "All possible kmer combinations were found.\n");
-	} else if (nodeCounter > (*maxNumberOfNodes)) {
+	} else if (foundCount > possibleCount) {
 		fprintf(stderr,
 				"Error! too many nodes were created!\nThere may be a corruption of data!\n");
 		fprintf(stats_out_file_pointer,
@@ -557,6 +2572,45 @@ void statistics(unsigned long long * const baseCounter,
 				"did not find all possible %dmers combinations.\n", config.k);
 	};
 
+	if (config.dedupEnable > 0) {
+		fprintf(stdout, "Skipped %llu duplicate records out of %llu.\n",
+				summary->duplicateRecords, summary->records);
+		fprintf(stats_out_file_pointer,
+				"Skipped %llu duplicate records out of %llu.\n",
+				summary->duplicateRecords, summary->records);
+	}
+
+	if (config.minEntropy > 0 || config.dustThreshold > 0 || summary->maskedKmers > 0) {
+		fprintf(stdout, "Masked %llu low complexity kmers out of %llu.\n",
+				summary->maskedKmers,
+				summary->maskedKmers + *TotalNumSequencesN);
+		fprintf(stats_out_file_pointer,
+				"Masked %llu low complexity kmers out of %llu.\n",
+				summary->maskedKmers,
+				summary->maskedKmers + *TotalNumSequencesN);
+	}
+
+	const double tableMebibytes = (tableMemory.explicitBytes
+			+ tableMemory.transparentBytes + tableMemory.fallbackBytes)
+			/ (double) (1024 * 1024);
+	if (tableMebibytes > 0) {
+		FILE * const files[] = { stdout, stats_out_file_pointer };
+		for (int f = 0; f < 2; f++) {
+			fprintf(files[f],
+					"Count tables of %0.1f mibibytes: %0.1f on explicit huge pages, %0.1f on transparent huge pages, %0.1f on 4 KiB pages.\n",
+					tableMebibytes,
+					tableMemory.explicitBytes / (double) (1024 * 1024),
+					tableMemory.transparentBytes / (double) (1024 * 1024),
+					tableMemory.fallbackBytes / (double) (1024 * 1024));
+			if (tableMemory.interleavedBytes) {
+				fprintf(files[f],
+						"%0.1f mibibytes interleaved over %d NUMA nodes.\n",
+						tableMemory.interleavedBytes / (double) (1024 * 1024),
+						tableMemory.numaNodes);
+			}
+		}
+	}
+
 	free(stats_out_file_name);
 	fclose(stats_out_file_pointer);
 
@@ -605,52 +2659,979 @@ char int2base(int integer) {
 	return base;
 }
 /*
- * Creates a tree node.
- * Brings in the base of the node to create
- *
+ * Packed kmer code, 2 bits per base using the base2int() values (A = 0, C = 1, G = 2, T = 3).
+ * The first base of the kmer is the most significant, so sorting the codes sorts the kmers
+ * in the same order that histo_tree() prints them.
  */
-node_t* node_create(int base) {
-	node_t* node = (node_t*) malloc(sizeof(node_t));
-	node->base = base;
-	node->frequency = 1;
-	node->nextNodePtr[0] = NULL;
-	node->nextNodePtr[1] = NULL;
-	node->nextNodePtr[2] = NULL;
+typedef unsigned long long kmer_code_t;
+
+/*
+ * Lookup table from a character in the file to its coded base.
+ * 0-3 are valid bases, newlines are skipped and everything else breaks the sequence,
+ * which is the same rule findKmer() follows.
+ */
+#define BREAK_CODE -2
+#define SKIP_CODE -3
+static signed char baseCodeTable[256];
+
+void init_base_code_table() {
+	for (int i = 0; i < 256; i++) {
+		baseCodeTable[i] = BREAK_CODE;
+	}
+	baseCodeTable['A'] = 0;
+	baseCodeTable['C'] = 1;
+	baseCodeTable['G'] = 2;
+	baseCodeTable['T'] = 3;
+	baseCodeTable['\n'] = SKIP_CODE;
+	baseCodeTable['\r'] = SKIP_CODE; //the carriage return of a Windows line ending.
+}
+/*
+ * 64 characters of FASTA text, classified. Bit i of a mask, or bits 2i of bases, is character i.
+ * bases holds the 2 bit code of every A, C, G or T, other positions hold garbage.
+ * newlineMask holds both '\n' and '\r', breakMask is every character that is neither a base
+ * nor a newline, '>' included.
+ */
+struct fasta_chunk_t {
+	unsigned long long bases[2]; //characters 0-31, then 32-63.
+	unsigned long long newlineMask;
+	unsigned long long headerMask; //'>'
+	unsigned long long breakMask;
+};
+/*
+ * All kernels take the code of a base from its ASCII bits: ((c >> 1) & 3) ^ ((c >> 2) & 1)
+ * is 0, 1, 2, 3 for A, C, G, T.
+ */
+void classify_chunk_scalar(const char * const text, fasta_chunk_t * const chunk) {
+	memset(chunk, 0, sizeof(fasta_chunk_t));
+	for (int i = 0; i < 64; i++) {
+		const unsigned char c = text[i];
+		const int codedBase = baseCodeTable[c];
+		if (codedBase == SKIP_CODE) {
+			chunk->newlineMask |= 1ULL << i;
+		} else if (codedBase < 0) {
+			chunk->breakMask |= 1ULL << i;
+			if (c == '>') {
+				chunk->headerMask |= 1ULL << i;
+			}
+		} else {
+			chunk->bases[i >> 5] |= ((unsigned long long) codedBase)
+					<< (2 * (i & 31));
+		}
+	}
+}
+__attribute__((target("sse4.2")))
+void classify_chunk_sse42(const char * const text, fasta_chunk_t * const chunk) {
+	unsigned long long newline = 0, header = 0, acgt = 0;
+	unsigned long long packed[4];
+	for (int j = 0; j < 4; j++) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) (text + 16 * j));
+		const __m128i isBase = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('A')),
+						_mm_cmpeq_epi8(v, _mm_set1_epi8('C'))),
+				_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('G')),
+						_mm_cmpeq_epi8(v, _mm_set1_epi8('T'))));
+		newline |= (unsigned long long) (unsigned int) _mm_movemask_epi8(
+				_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+						_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')))) << (16 * j);
+		header |= (unsigned long long) (unsigned int) _mm_movemask_epi8(
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('>'))) << (16 * j);
+		acgt |= (unsigned long long) (unsigned int) _mm_movemask_epi8(isBase)
+				<< (16 * j);
+
+		const __m128i code = _mm_xor_si128(
+				_mm_and_si128(_mm_srli_epi16(v, 1), _mm_set1_epi8(3)),
+				_mm_and_si128(_mm_srli_epi16(v, 2), _mm_set1_epi8(1)));
+		//4 codes to a byte: pairs into 16 bits, pairs of pairs into 32 bits, then the low byte of each.
+		const __m128i pairs = _mm_maddubs_epi16(code, _mm_set1_epi16(0x0401));
+		const __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00100001));
+		const __m128i bytes = _mm_shuffle_epi8(quads,
+				_mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+						-1, -1, -1));
+		packed[j] = (unsigned int) _mm_cvtsi128_si32(bytes);
+	}
+	chunk->bases[0] = packed[0] | packed[1] << 32;
+	chunk->bases[1] = packed[2] | packed[3] << 32;
+	chunk->newlineMask = newline;
+	chunk->headerMask = header;
+	chunk->breakMask = ~(acgt | newline);
+}
+__attribute__((target("avx2")))
+void classify_chunk_avx2(const char * const text, fasta_chunk_t * const chunk) {
+	unsigned long long newline = 0, header = 0, acgt = 0;
+	for (int j = 0; j < 2; j++) {
+		const __m256i v = _mm256_loadu_si256((const __m256i*) (text + 32 * j));
+		const __m256i isBase = _mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('A')),
+						_mm256_cmpeq_epi8(v, _mm256_set1_epi8('C'))),
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('G')),
+						_mm256_cmpeq_epi8(v, _mm256_set1_epi8('T'))));
+		newline |= (unsigned long long) (unsigned int) _mm256_movemask_epi8(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+						_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))))
+				<< (32 * j);
+		header |= (unsigned long long) (unsigned int) _mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('>'))) << (32 * j);
+		acgt |= (unsigned long long) (unsigned int) _mm256_movemask_epi8(
+				isBase) << (32 * j);
+
+		const __m256i code = _mm256_xor_si256(
+				_mm256_and_si256(_mm256_srli_epi16(v, 1), _mm256_set1_epi8(3)),
+				_mm256_and_si256(_mm256_srli_epi16(v, 2), _mm256_set1_epi8(1)));
+		const __m256i pairs = _mm256_maddubs_epi16(code,
+				_mm256_set1_epi16(0x0401));
+		const __m256i quads = _mm256_madd_epi16(pairs,
+				_mm256_set1_epi32(0x00100001));
+		//the shuffle stays within each 128 bit lane, so each lane packs its own 16 characters.
+		const __m256i bytes = _mm256_shuffle_epi8(quads,
+				_mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1,
+						-1, -1, -1, -1, 0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1,
+						-1, -1, -1, -1, -1));
+		chunk->bases[j] = (unsigned long long) (unsigned int) _mm256_extract_epi32(
+				bytes, 0)
+				| (unsigned long long) (unsigned int) _mm256_extract_epi32(bytes,
+						4) << 32;
+	}
+	chunk->newlineMask = newline;
+	chunk->headerMask = header;
+	chunk->breakMask = ~(acgt | newline);
+}
+__attribute__((target("avx512f,avx512bw")))
+void classify_chunk_avx512(const char * const text, fasta_chunk_t * const chunk) {
+	const __m512i v = _mm512_loadu_si512((const void*) text);
+	const unsigned long long acgt = _mm512_cmpeq_epi8_mask(v,
+			_mm512_set1_epi8('A')) | _mm512_cmpeq_epi8_mask(v,
+			_mm512_set1_epi8('C')) | _mm512_cmpeq_epi8_mask(v,
+			_mm512_set1_epi8('G')) | _mm512_cmpeq_epi8_mask(v,
+			_mm512_set1_epi8('T'));
+	chunk->newlineMask = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\n'))
+			| _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\r'));
+	chunk->headerMask = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('>'));
+	chunk->breakMask = ~(acgt | chunk->newlineMask);
+
+	const __m512i code = _mm512_xor_si512(
+			_mm512_and_si512(_mm512_srli_epi16(v, 1), _mm512_set1_epi8(3)),
+			_mm512_and_si512(_mm512_srli_epi16(v, 2), _mm512_set1_epi8(1)));
+	const __m512i pairs = _mm512_maddubs_epi16(code, _mm512_set1_epi16(0x0401));
+	const __m512i quads = _mm512_madd_epi16(pairs,
+			_mm512_set1_epi32(0x00100001));
+	//the zero masked form, the plain one passes an undefined vector that -Wall reports as uninitialized.
+	_mm_storeu_si128((__m128i*) chunk->bases,
+			_mm512_maskz_cvtepi32_epi8(0xffff, quads));
+}
+typedef void (*classify_kernel_t)(const char*, fasta_chunk_t*);
+static classify_kernel_t classifyChunk = classify_chunk_scalar;
+
+const char *simd_name(const int simd) {
+	static const char * const names[] = { "scalar", "sse4.2", "avx2", "avx512",
+			"auto" };
+	return names[simd];
+}
+/*
+ * Picks the FASTA kernel for config.simd. Call after the configuration is final.
+ */
+void init_classify_kernel() {
+	__builtin_cpu_init();
+	const bool supported[] = { true, (bool) __builtin_cpu_supports("sse4.2"),
+			(bool) __builtin_cpu_supports("avx2"),
+			__builtin_cpu_supports("avx512f")
+					&& __builtin_cpu_supports("avx512bw") };
+	const classify_kernel_t kernels[] = { classify_chunk_scalar,
+			classify_chunk_sse42, classify_chunk_avx2, classify_chunk_avx512 };
+
+	if (config.simd == SIMD_AUTO) {
+		config.simd = SIMD_AVX512;
+		while (!supported[config.simd]) {
+			config.simd--;
+		}
+	} else if (!supported[config.simd]) {
+		fprintf(stderr, "This CPU does not support the %s kernel.\n",
+				simd_name(config.simd));
+		exit(EXIT_FAILURE);
+	}
+	classifyChunk = kernels[config.simd];
+	fprintf(stdout, "Classifying FASTA text with the %s kernel.\n",
+			simd_name(config.simd));
+}
+/*
+ * Calls base(codedBase) for every character of text that is not a newline, 0-3 for a base
+ * and BREAK_CODE for anything else. Stops at the first '>' and returns its offset, or length if there is none.
+ * Runs of plain bases are decoded from the packed codes without looking at any single character.
+ * If unknownCharacters is not NULL, the first break character other than N of each kind gets the
+ * warning findKmer() always printed, and is marked in it.
+ */
+template<typename callback_t>
+size_t for_each_text_base(const char * const text, const size_t length,
+		callback_t base, unsigned char * const unknownCharacters = NULL) {
+	fasta_chunk_t chunk;
+	char padded[64];
+	size_t position = 0;
+
+	while (position < length) {
+		const size_t available = min(length - position, (size_t) 64);
+		const char *characters = text + position;
+		if (available < 64) {
+			//pad the tail with newlines, which are skipped.
+			memcpy(padded, characters, available);
+			memset(padded + available, '\n', 64 - available);
+			characters = padded;
+		}
+		classifyChunk(characters, &chunk);
+
+		const int limit = chunk.headerMask ?
+				__builtin_ctzll(chunk.headerMask) : 64;
+		unsigned long long live = ~chunk.newlineMask
+				& (limit == 64 ? ~0ULL : (1ULL << limit) - 1);
+		if (live == ~0ULL && !chunk.breakMask) {
+			for (int i = 0; i < 64; i++) {
+				base((int) ((chunk.bases[i >> 5] >> (2 * (i & 31))) & 3));
+			}
+		} else {
+			while (live) {
+				const int i = __builtin_ctzll(live);
+				live &= live - 1;
+				if (!((chunk.breakMask >> i) & 1)) {
+					base((int) ((chunk.bases[i >> 5] >> (2 * (i & 31))) & 3));
+					continue;
+				}
+				const unsigned char c = characters[i];
+				if (unknownCharacters && c != 'N' && !unknownCharacters[c]) {
+					unknownCharacters[c] = 1;
+					fprintf(stderr,
+							"Unknown character %c processed! File may be corrupted.\n",
+							c);
+				}
+				base(BREAK_CODE);
+			}
+		}
+
+		if (limit < 64) {
+			return position + limit;
+		}
+		position += available;
+	}
+	return length;
+}
+/*
+ * 2 bit packed cache written by "findKmer pack". Layout:
+ *   packed_header_t
+ *   bases, 4 to a byte with the first base in the high bits. Positions inside an N run hold A.
+ *   packed_record_t records[numRecords]     at recordsOffset
+ *   packed_n_run_t nRuns[numNRuns]          at nRunsOffset, ascending
+ *   char ids[idBytes]                       at idsOffset
+ * An N run is any run of characters other than newlines, A, C, G or T, which all break kmers the same way.
+ */
+struct packed_header_t {
+	char magic[8];
+	unsigned long long numRecords;
+	unsigned long long numBases; //bases of all records, N runs included.
+	unsigned long long numNRuns;
+	unsigned long long idBytes;
+	unsigned long long recordsOffset;
+	unsigned long long nRunsOffset;
+	unsigned long long idsOffset;
+};
+#define PACKED_NO_ID (~0ULL)
+struct packed_record_t {
+	unsigned long long baseStart; //index of the first base.
+	unsigned long long numBases;
+	unsigned long long firstNRun;
+	unsigned long long numNRuns;
+	unsigned long long idOffset; //PACKED_NO_ID for the data before the first '>'.
+	unsigned long long idLength;
+};
+struct packed_n_run_t {
+	unsigned long long start; //index of the first base of the run.
+	unsigned long long length;
+};
+struct packed_cache_t {
+	void *map;
+	size_t size;
+	const packed_header_t *header;
+	const unsigned char *bases;
+	const packed_record_t *records;
+	const packed_n_run_t *nRuns;
+	const char *ids;
+};
+/*
+ * A record is a '>' identifier line and all of the sequence lines that follow it up to the next '>'.
+ * The pointers point into the in memory copy of the sequence file, or into the mapped
+ * packed cache, and are not null terminated.
+ */
+struct record_t {
+	const char *id; //identifier text following the '>', NULL for data before the first '>'.
+	size_t idLength;
+	const char *sequence; //raw sequence data including newlines. NULL for a packed record.
+	size_t sequenceLength; //bytes of raw sequence data, or bases of a packed record.
+	const unsigned char *packedBases; //bases of the whole packed cache, 4 to a byte.
+	unsigned long long baseStart; //index of the first base of a packed record.
+	const packed_n_run_t *nRuns; //runs of non ACGT characters in a packed record.
+	unsigned long long numNRuns;
+};
+/*
+ * Reads the whole sequence file into memory.
+ * The caller must free the returned buffer.
+ */
+char *load_sequence_file(size_t * const length) {
+	if (fseek(config.sequence_file_pointer, 0, SEEK_END) != 0) {
+		fprintf(stderr, "Unable to seek in sequence file %s\n",
+				config.sequence_file);
+		exit(EXIT_FAILURE);
+	}
+	*length = ftell(config.sequence_file_pointer);
+	rewind(config.sequence_file_pointer);
+
+	if (*length == 0) {
+		fprintf(stderr, "Sequence File Is Empty, Ending Program");
+		exit(EXIT_FAILURE);
+	}
+
+	char *buffer = (char*) malloc(*length);
+	if (!buffer) {
+		fprintf(stderr, "load_sequence_file():: memory allocation failed\n");
+		exit(EXIT_FAILURE);
+	}
+	if (fread(buffer, 1, *length, config.sequence_file_pointer) != *length) {
+		fprintf(stderr, "Unable to read sequence file %s\n",
+				config.sequence_file);
+		exit(EXIT_FAILURE);
+	}
+	return buffer;
+}
+/*
+ * Splits an in memory sequence file into records.
+ * Like findKmer(), any '>' starts an identifier that runs to the end of its line.
+ * Sequence data before the first '>' is kept as a record with an empty identifier.
+ */
+void index_records(const char * const buffer, const size_t length,
+		vector<record_t> &records) {
+	const char *end = buffer + length;
+	const char *position = buffer;
+
+	while (position < end) {
+		record_t record = { };
+		record.id = NULL;
+		record.idLength = 0;
+
+		if (*position == '>') {
+			record.id = position + 1;
+			const char *idEnd = (const char*) memchr(record.id, '\n',
+					end - record.id);
+			if (!idEnd) {
+				idEnd = end;
+			}
+			record.idLength = idEnd - record.id;
+			if (record.idLength > 0 && record.id[record.idLength - 1] == '\r') {
+				record.idLength--;
+			}
+			position = idEnd < end ? idEnd + 1 : end;
+		}
+
+		record.sequence = position;
+		const char *nextRecord = (const char*) memchr(position, '>',
+				end - position);
+		if (!nextRecord) {
+			nextRecord = end;
+		}
+		record.sequenceLength = nextRecord - position;
+		position = nextRecord;
+
+		records.push_back(record);
+	}
+}
+/*
+ * Calls base(codedBase) for the bases [first, last) of a packed cache.
+ * Bases are 4 to a byte with the first base in the high bits, so whole bytes are decoded at a time.
+ */
+template<typename callback_t>
+static inline void for_each_packed_base(const unsigned char * const bases,
+		unsigned long long first, const unsigned long long last,
+		callback_t base) {
+	while (first < last && (first & 3)) {
+		base((bases[first >> 2] >> (6 - 2 * (first & 3))) & 3);
+		first++;
+	}
+	while (first + 4 <= last) {
+		const unsigned char byte = bases[first >> 2];
+		base(byte >> 6);
+		base((byte >> 4) & 3);
+		base((byte >> 2) & 3);
+		base(byte & 3);
+		first += 4;
+	}
+	while (first < last) {
+		base((bases[first >> 2] >> (6 - 2 * (first & 3))) & 3);
+		first++;
+	}
+}
+/*
+ * Calls base(codedBase) for every base of a record, newlines excluded.
+ * 0-3 are valid bases, BREAK_CODE is anything else that breaks a kmer.
+ */
+template<typename callback_t>
+void for_each_record_base(const record_t &record, callback_t base) {
+	if (record.packedBases) {
+		//a segment may start or end inside an N run, only its part of the run is a break.
+		const unsigned long long last = record.baseStart + record.sequenceLength;
+		unsigned long long position = record.baseStart;
+		for (unsigned long long n = 0; n < record.numNRuns; n++) {
+			const unsigned long long runStart = max(record.nRuns[n].start,
+					position);
+			const unsigned long long runEnd = min(
+					record.nRuns[n].start + record.nRuns[n].length, last);
+			for_each_packed_base(record.packedBases, position, runStart, base);
+			for (unsigned long long j = runStart; j < runEnd; j++) {
+				base(BREAK_CODE);
+			}
+			position = max(position, runEnd);
+		}
+		for_each_packed_base(record.packedBases, position, last, base);
+	} else {
+		for_each_text_base(record.sequence, record.sequenceLength, base);
+	}
+}
+/*
+ * Base and triplet composition of the kmer a scan is on, for --min-entropy and --dust.
+ * Each base shifted in adds its base and triplet and removes the ones that fell off the front,
+ * so keeping it up to date is O(1) per base whatever k is.
+ */
+struct complexity_t {
+	int counts[4];
+	int triplets[64];
+	int tripletPairs; //sum of count * (count - 1) / 2 over the triplets, the DUST numerator.
+};
+static double entropyTerm[MAX_COMPLEXITY_K + 1]; //c * log2(c)
+
+void init_complexity_table() {
+	entropyTerm[0] = 0;
+	for (int c = 1; c <= MAX_COMPLEXITY_K; c++) {
+		entropyTerm[c] = c * log2((double) c);
+	}
+}
+static inline bool masking_enabled() {
+	return config.minEntropy > 0 || config.dustThreshold > 0;
+}
+static inline void complexity_reset(complexity_t * const complexity) {
+	memset(complexity, 0, sizeof(complexity_t));
+}
+/*
+ * Adds the last base of code. previousCode is the kmer before that base was shifted in
+ * and seqSize the run length including the new base.
+ */
+static inline void complexity_add(complexity_t * const complexity,
+		const kmer_code_t code, const kmer_code_t previousCode,
+		const int seqSize, const int k) {
+	complexity->counts[code & 3]++;
+	if (seqSize >= 3) {
+		complexity->tripletPairs += complexity->triplets[code & 63]++;
+	}
+	if (seqSize > k) {
+		complexity->counts[(previousCode >> (2 * (k - 1))) & 3]--;
+		if (k >= 3) {
+			complexity->tripletPairs -=
+					--complexity->triplets[(previousCode >> (2 * (k - 3))) & 63];
+		}
+	}
+}
+/*
+ * True if the complete kmer the composition describes is low complexity.
+ * h is the same per base entropy as the h column, log2(k) - sum(c * log2(c)) / k.
+ * The DUST score is tripletPairs / (triplets - 1), as in DUST over a window of k bases.
+ */
+static inline bool complexity_masked(const complexity_t * const complexity,
+		const int k) {
+	if (config.minEntropy > 0) {
+		const double h = log2((double) k)
+				- (entropyTerm[complexity->counts[0]]
+						+ entropyTerm[complexity->counts[1]]
+						+ entropyTerm[complexity->counts[2]]
+						+ entropyTerm[complexity->counts[3]]) / k;
+		if (h < config.minEntropy - 1e-9) {
+			return true;
+		}
+	}
+	return config.dustThreshold > 0
+			&& complexity->tripletPairs > config.dustThreshold * (k - 3);
+}
+/*
+ * --pattern. The care positions of the spaced seed as bits of the 2 bit window of config.span bases,
+ * and the same positions as runs of adjacent care bases for CPUs without BMI2.
+ */
+static kmer_code_t patternMask;
+static int patternRuns;
+static int patternRunShift[MAX_PATTERN_SPAN];
+static int patternRunBits[MAX_PATTERN_SPAN];
+static bool patternPext;
+
+void init_pattern() {
+	patternMask = 0;
+	patternRuns = 0;
+	for (int i = 0; config.pattern && i < config.span; i++) {
+		if (config.pattern[i] != '1') {
+			continue;
+		}
+		const int shift = 2 * (config.span - 1 - i);
+		patternMask |= ((kmer_code_t) 3) << shift;
+		if (patternRuns && i > 0 && config.pattern[i - 1] == '1') {
+			patternRunShift[patternRuns - 1] = shift;
+			patternRunBits[patternRuns - 1] += 2;
+		} else {
+			patternRunShift[patternRuns] = shift;
+			patternRunBits[patternRuns] = 2;
+			patternRuns++;
+		}
+	}
+	__builtin_cpu_init();
+	patternPext = __builtin_cpu_supports("bmi2");
+}
+__attribute__((target("bmi2")))
+static kmer_code_t extract_care_bases_bmi2(const kmer_code_t window) {
+	return _pext_u64(window, patternMask);
+}
+/* Packs the care bases of a window into a kmer code of config.k bases, first base most significant. */
+static inline kmer_code_t extract_care_bases(const kmer_code_t window) {
+	if (patternPext) {
+		return extract_care_bases_bmi2(window);
+	}
+	kmer_code_t code = 0;
+	for (int r = 0; r < patternRuns; r++) {
+		code = (code << patternRunBits[r])
+				| ((window >> patternRunShift[r])
+						& ((((kmer_code_t) 1) << patternRunBits[r]) - 1));
+	}
+	return code;
+}
+/*
+ * Rolls a packed kmer code across a record and calls count(code, offset, masked, window) for every complete kmer.
+ * The offset is the position of the first base of the kmer within the record, newlines excluded.
+ * masked is true for the kmers --min-entropy or --dust do not count.
+ * With a --pattern the window holds all config.span bases and code only the k care bases of it,
+ * otherwise both are the same k bases.
+ */
+template<typename callback_t>
+void scan_record_kmers(const record_t &record, const int k, callback_t count) {
+	const int span = config.pattern ? config.span : k;
+	const kmer_code_t mask =
+			span < 32 ? (((kmer_code_t) 1) << (2 * span)) - 1 : ~(kmer_code_t) 0;
+	kmer_code_t window = 0;
+	int seqSize = 0; //same meaning as in findKmer(), reset by every break.
+	size_t offset = 0; //number of bases since the start of the record.
+	const bool masking = masking_enabled();
+	complexity_t complexity;
+	complexity_reset(&complexity);
+
+	for_each_record_base(record, [&](int codedBase) {
+		offset++;
+		if (codedBase < 0) {
+			seqSize = 0;
+			if (masking) {
+				complexity_reset(&complexity);
+			}
+		} else {
+			const kmer_code_t previousWindow = window;
+			window = ((window << 2) | codedBase) & mask;
+			++seqSize;
+			if (masking) {
+				complexity_add(&complexity, window, previousWindow, seqSize,
+						span);
+			}
+			if (seqSize >= span) {
+				count(config.pattern ? extract_care_bases(window) : window,
+						offset - span,
+						masking && complexity_masked(&complexity, span),
+						window);
+			}
+		}
+	});
+}
+/*
+ * Checks that the regions named by the header of a mapped packed cache follow each other
+ * in the order "findKmer pack" writes them and fit in the file, and that every record and
+ * N run lies inside them, so nothing read later can run past the end of the mapping.
+ */
+bool packed_cache_valid(const packed_cache_t * const cache) {
+	const packed_header_t &header = *cache->header;
+	const unsigned long long size = cache->size;
+	const unsigned long long basesEnd = sizeof(packed_header_t)
+			+ header.numBases / 4 + ((header.numBases & 3) != 0);
+	if (header.numBases > 4 * size || header.recordsOffset < basesEnd
+			|| header.recordsOffset % 8 != 0 || header.recordsOffset > size
+			|| header.numRecords
+					> (size - header.recordsOffset) / sizeof(packed_record_t)
+			|| header.nRunsOffset
+					!= header.recordsOffset
+							+ header.numRecords * sizeof(packed_record_t)
+			|| header.numNRuns
+					> (size - header.nRunsOffset) / sizeof(packed_n_run_t)
+			|| header.idsOffset
+					!= header.nRunsOffset
+							+ header.numNRuns * sizeof(packed_n_run_t)
+			|| header.idBytes > size - header.idsOffset) {
+		return false;
+	}
+
+	for (unsigned long long r = 0; r < header.numRecords; r++) {
+		const packed_record_t &record = cache->records[r];
+		if (record.baseStart > header.numBases
+				|| record.numBases > header.numBases - record.baseStart
+				|| record.firstNRun > header.numNRuns
+				|| record.numNRuns > header.numNRuns - record.firstNRun
+				|| (record.idOffset != PACKED_NO_ID
+						&& (record.idOffset > header.idBytes
+								|| record.idLength
+										> header.idBytes - record.idOffset))) {
+			return false;
+		}
+	}
+	for (unsigned long long n = 0; n < header.numNRuns; n++) {
+		const packed_n_run_t &run = cache->nRuns[n];
+		if (run.start > header.numBases
+				|| run.length > header.numBases - run.start) {
+			return false;
+		}
+	}
+	return true;
+}
+/*
+ * Maps a 2 bit packed cache. Returns NULL if the file is not one, exits if it is one
+ * that is truncated or corrupt.
+ */
+const packed_cache_t *map_packed_cache(const char * const filename) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat fileStat;
+	packed_header_t header;
+	if (fstat(fd, &fileStat) != 0 || (size_t) fileStat.st_size < sizeof(header)
+			|| read(fd, &header, sizeof(header)) != sizeof(header)
+			|| memcmp(header.magic, PACKED_CACHE_MAGIC, 8) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	packed_cache_t *cache = new packed_cache_t;
+	cache->size = fileStat.st_size;
+	cache->map = mmap(NULL, cache->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache->map == MAP_FAILED) {
+		fprintf(stderr, "Unable to map packed cache %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	madvise(cache->map, cache->size, MADV_SEQUENTIAL);
+
+	const char *base = (const char*) cache->map;
+	cache->header = (const packed_header_t*) base;
+	cache->bases = (const unsigned char*) (base + sizeof(packed_header_t));
+	cache->records = (const packed_record_t*) (base + header.recordsOffset);
+	cache->nRuns = (const packed_n_run_t*) (base + header.nRunsOffset);
+	cache->ids = base + header.idsOffset;
+	if (!packed_cache_valid(cache)) {
+		fprintf(stderr, "Packed cache %s is truncated or corrupt\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	return cache;
+}
+/* Lists the records of a packed cache the same way index_records() lists the records of a text file. */
+void index_packed_records(const packed_cache_t * const cache,
+		vector<record_t> &records) {
+	for (unsigned long long r = 0; r < cache->header->numRecords; r++) {
+		const packed_record_t &packed = cache->records[r];
+		record_t record = { };
+		if (packed.idOffset != PACKED_NO_ID) {
+			record.id = cache->ids + packed.idOffset;
+			record.idLength = packed.idLength;
+		}
+		record.sequenceLength = packed.numBases;
+		record.packedBases = cache->bases;
+		record.baseStart = packed.baseStart;
+		record.nRuns = cache->nRuns + packed.firstNRun;
+		record.numNRuns = packed.numNRuns;
+		records.push_back(record);
+	}
+}
+/*
+ * A piece of a record counted by one worker. Only kmers that end at or after
+ * preroll bases into the segment are counted, the bases before that are the
+ * end of the previous segment and only prime the rolling kmer.
+ */
+struct segment_t {
+	record_t record;
+	unsigned long long preroll;
+	unsigned long long offset; //bases of the record before the segment, preroll included. 0 for text.
+};
+/*
+ * "findKmer pack". Streams the sequence file into a 2 bit packed cache.
+ * The bases are written as they are read, the small record, N run and identifier
+ * tables are kept in memory and appended at the end.
+ */
+void pack_sequence_file() {
+	const size_t bufferSize = 1 << 20;
+	char *in;
+	if (posix_memalign((void**) &in, DIRECT_IO_ALIGNMENT, bufferSize) != 0) {
+		fprintf(stderr, "pack_sequence_file():: memory allocation failed\n");
+		exit(EXIT_FAILURE);
+	}
+	vector<unsigned char> out;
+	out.reserve(bufferSize);
+
+	vector<packed_record_t> records;
+	vector<packed_n_run_t> nRuns;
+	vector<char> ids;
+	unsigned long long numBases = 0;
+	unsigned char byte = 0; //bases not yet written out.
+	bool inIdentifier = false;
+
+	packed_header_t header;
+	memset(&header, 0, sizeof(header));
+	write_or_die(&header, sizeof(header), 1, config.out_file_pointer);
+
+	text_source_t source;
+	text_source_open(&source);
+	size_t length;
+	while ((length = text_source_read(&source, in, bufferSize)) > 0) {
+		for (size_t i = 0; i < length; i++) {
+			const char c = in[i];
+
+			if (inIdentifier) {
+				if (c == '\n') {
+					inIdentifier = false;
+				} else if (c != '\r') {
+					ids.push_back(c);
+					records.back().idLength++;
+				}
+				continue;
+			}
+
+			if (c == '>' || records.empty()) {
+				packed_record_t record;
+				record.baseStart = numBases;
+				record.numBases = 0;
+				record.firstNRun = nRuns.size();
+				record.numNRuns = 0;
+				record.idOffset = PACKED_NO_ID;
+				record.idLength = 0;
+				if (c == '>') {
+					record.idOffset = ids.size();
+					inIdentifier = true;
+				}
+				records.push_back(record);
+				if (c == '>') {
+					continue;
+				}
+			}
+
+			int codedBase = baseCodeTable[(unsigned char) c];
+			if (codedBase == SKIP_CODE) {
+				continue;
+			}
+			if (codedBase < 0) {
+				packed_record_t &record = records.back();
+				if (record.numNRuns
+						&& nRuns.back().start + nRuns.back().length == numBases) {
+					nRuns.back().length++;
+				} else {
+					packed_n_run_t run = { numBases, 1 };
+					nRuns.push_back(run);
+					record.numNRuns++;
+				}
+				codedBase = 0;
+			}
+
+			byte = (byte << 2) | codedBase;
+			records.back().numBases++;
+			if ((++numBases & 3) == 0) {
+				out.push_back(byte);
+				byte = 0;
+				if (out.size() == bufferSize) {
+					write_or_die(out.data(), 1, out.size(),
+							config.out_file_pointer);
+					out.clear();
+				}
+			}
+		}
+	}
+	if (numBases & 3) {
+		out.push_back(byte << (2 * (4 - (numBases & 3))));
+	}
+	write_or_die(out.data(), 1, out.size(), config.out_file_pointer);
+	//keep the tables 8 byte aligned for the mapping.
+	while (ftell(config.out_file_pointer) % 8) {
+		fputc(0, config.out_file_pointer);
+	}
+
+	memcpy(header.magic, PACKED_CACHE_MAGIC, 8);
+	header.numRecords = records.size();
+	header.numBases = numBases;
+	header.numNRuns = nRuns.size();
+	header.idBytes = ids.size();
+	header.recordsOffset = ftell(config.out_file_pointer);
+	header.nRunsOffset = header.recordsOffset
+			+ records.size() * sizeof(packed_record_t);
+	header.idsOffset = header.nRunsOffset + nRuns.size() * sizeof(packed_n_run_t);
+	write_or_die(records.data(), sizeof(packed_record_t), records.size(),
+			config.out_file_pointer);
+	write_or_die(nRuns.data(), sizeof(packed_n_run_t), nRuns.size(),
+			config.out_file_pointer);
+	write_or_die(ids.data(), sizeof(char), ids.size(), config.out_file_pointer);
+	fseek(config.out_file_pointer, 0, SEEK_SET);
+	write_or_die(&header, sizeof(header), 1, config.out_file_pointer);
+
+	fprintf(stdout,
+			"Packed %llu records, %llu bases and %llu N runs into %llu bytes.\n",
+			header.numRecords, numBases, header.numNRuns,
+			header.idsOffset + header.idBytes);
+	text_source_close(&source);
+	free(in);
+}
+/*
+ * Streaming 128 bit hash of the bases of a record for --dedup.
+ * Bases are normalized first: newlines are dropped and anything that is not A, C, G or T
+ * becomes N. Two records with the same hash are therefore counted identically no matter
+ * how their lines were wrapped, or whether they came from text or a packed cache.
+ * Mixing is MurmurHash3 x64 128 over 16 normalized bases at a time.
+ */
+struct record_hash_t {
+	unsigned long long h1, h2; //the two halves of the hash.
+	unsigned char block[16]; //normalized bases not yet mixed in.
+	int blockSize;
+	unsigned long long length; //number of normalized bases.
+};
+typedef pair<unsigned long long, unsigned long long> hash128_t;
+struct hash128_hasher_t {
+	size_t operator()(const hash128_t &hash) const {
+		return hash.first ^ hash.second;
+	}
+};
+typedef unordered_set<hash128_t, hash128_hasher_t> record_hash_set_t;
+
+static inline unsigned long long rotl64(unsigned long long x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+static inline unsigned long long fmix64(unsigned long long k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+void record_hash_init(record_hash_t * const hash) {
+	hash->h1 = 0x9368e53c2f6af274ULL;
+	hash->h2 = 0x586dcd208f7cd3fdULL;
+	hash->blockSize = 0;
+	hash->length = 0;
+}
+/* Mixes k1 and k2 into the hash, the body and tail of MurmurHash3 x64 128. */
+static inline void record_hash_mix(record_hash_t * const hash,
+		unsigned long long k1, unsigned long long k2, const bool tail) {
+	const unsigned long long c1 = 0x87c37b91114253d5ULL;
+	const unsigned long long c2 = 0x4cf5ad432745937fULL;
+
+	k1 *= c1;
+	k1 = rotl64(k1, 31);
+	k1 *= c2;
+	hash->h1 ^= k1;
+	k2 *= c2;
+	k2 = rotl64(k2, 33);
+	k2 *= c1;
+	hash->h2 ^= k2;
+	if (!tail) {
+		hash->h1 = rotl64(hash->h1, 27);
+		hash->h1 += hash->h2;
+		hash->h1 = hash->h1 * 5 + 0x52dce729;
+		hash->h2 = rotl64(hash->h2, 31);
+		hash->h2 += hash->h1;
+		hash->h2 = hash->h2 * 5 + 0x38495ab5;
+	}
+}
+/* Adds one normalized base, A, C, G, T or N. */
+static inline void record_hash_add(record_hash_t * const hash, const char c) {
+	hash->block[hash->blockSize++] = c;
+	hash->length++;
+	if (hash->blockSize == 16) {
+		unsigned long long k1, k2;
+		memcpy(&k1, hash->block, 8);
+		memcpy(&k2, hash->block + 8, 8);
+		record_hash_mix(hash, k1, k2, false);
+		hash->blockSize = 0;
+	}
+}
+hash128_t record_hash_finish(record_hash_t * const hash) {
+	unsigned char tail[16] = { 0 };
+	memcpy(tail, hash->block, hash->blockSize);
+	unsigned long long k1, k2;
+	memcpy(&k1, tail, 8);
+	memcpy(&k2, tail + 8, 8);
+	record_hash_mix(hash, k1, k2, true);
+
+	hash->h1 ^= hash->length;
+	hash->h2 ^= hash->length;
+	hash->h1 += hash->h2;
+	hash->h2 += hash->h1;
+	hash->h1 = fmix64(hash->h1);
+	hash->h2 = fmix64(hash->h2);
+	hash->h1 += hash->h2;
+	hash->h2 += hash->h1;
+	return hash128_t(hash->h1, hash->h2);
+}
+hash128_t hash_record(const record_t &record) {
+	record_hash_t hash;
+	record_hash_init(&hash);
+	for_each_record_base(record, [&hash](int codedBase) {
+		record_hash_add(&hash, codedBase < 0 ? 'N' : int2base(codedBase));
+	});
+	return record_hash_finish(&hash);
+}
+/*
+ * Creates a tree node.
+ * Brings in the base of the node to create
+ *
+ */
+node_t* node_create(int base) {
+	node_t* node = (node_t*) malloc(sizeof(node_t));
+	node->base = base;
+	node->frequency = 1;
+	node->nextNodePtr[0] = NULL;
+	node->nextNodePtr[1] = NULL;
+	node->nextNodePtr[2] = NULL;
 	node->nextNodePtr[3] = NULL;
-	nodeCounter++;
+	__atomic_add_fetch(&nodeCounter, 1, __ATOMIC_RELAXED);
 	return node;
 }
 /*
  * Adds a branch if one doesn't already exist.
  * Increments the counter for the node we are going to step into.
  * Returns the pointer to the next node.
+ * Safe to call from any number of threads at once: a branch is linked in with a compare and swap,
+ * the thread that loses the race frees its node and counts into the winner's.
  */
 node_t* node_branch_enter_and_create(node_t* node, int base) {
 	DEBUG_TREE_CREATE(
 			fprintf(stdout, "..node_branch_enter_and_create for base %c\n", int2base(base)));
+	node_t *next = __atomic_load_n(&node->nextNodePtr[base], __ATOMIC_ACQUIRE);
 	//if node doe
-	if (node->nextNodePtr[base] == NULL) {
+	if (next == NULL) {
 
 		DEBUG_TREE_CREATE(fprintf(stdout, "***Creating Node.\n"));
 
-		node->nextNodePtr[base] = node_create(base);
-
-	} else {
-
-		node->nextNodePtr[base]->frequency++;
-
-		if (node->nextNodePtr[base]->frequency == 0) {
-			fprintf(stderr,
-					"\n\n!!! COUNTER ROLLOVER DETECTED! \nIncrease the number of bits used for the counter variable if you have the source code, else use a smaller sequence file.\n\n");
-			fprintf(stdout,
-					"\n\n!!! COUNTER ROLLOVER DETECTED! \nIncrease the number of bits used for the counter variable if you have the source code, else use a smaller sequence file.\n\n");
-			exit(EXIT_FAILURE);
+		node_t *created = node_create(base);
+		if (__atomic_compare_exchange_n(&node->nextNodePtr[base], &next,
+				created, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			return created;
+		}
+		free(created);
+		__atomic_sub_fetch(&nodeCounter, 1, __ATOMIC_RELAXED);
+	}
 
-		}DEBUG_TREE_CREATE(
-				fprintf(stdout, "+++Incrementing counter to %d.\n", node->nextNodePtr[base]->frequency));
+	//spill the rolled over count rather than losing it.
+	if (__atomic_add_fetch(&next->frequency, 1, __ATOMIC_RELAXED) == 0) {
+		lock_guard<mutex> guard(nodeOverflowLock);
+		nodeOverflow[next] += 1ULL << 32;
+	}DEBUG_TREE_CREATE(
+			fprintf(stdout, "+++Incrementing counter to %d.\n", next->frequency));
 
-	}DEBUG_TREE_CREATE(fprintf(stdout, "..returning next base pointer.\n"));
-	return node->nextNodePtr[base];
+	DEBUG_TREE_CREATE(fprintf(stdout, "..returning next base pointer.\n"));
+	return next;
 }
 /*
  * Brings in a pointer to head of the tree, an integer array and the size k of the array
@@ -661,7 +3642,7 @@ node_t* node_branch_enter_and_create(node_t* node, int base) {
  *
  */
 node_t* tree_create(node_t* head, int* const array, int k,
-		statistics_t *baseStatistics) {
+		statistics_t *) {
 	if (array != NULL) {
 		if (head == NULL) {
 			DEBUG_TREE_CREATE(
@@ -689,257 +3670,586 @@ node_t* tree_create(node_t* head, int* const array, int k,
 	return head;
 }
 /*
- * Histogram can be recursive for low numbers of K.
- * If K becomes too high then we may run out of stack/heap memory.
- * It will traverse the tree starting at the head and work its way to the depth provided by k.
- * When it reaches the depth k, it will print out the sequence it saw from the root to this point.
- * It will then work its way back
- * The implementation of freeing the tree is not implemented here.
+ * Writes the bases of a kmer. With a --pattern the gap positions are written as '.', like ACG..TCA.
+ * A --dyad has its gap after the k bases, array[k], and is written the same way.
  */
-void histo_recursive(node_t* const head, int * const array, const int depth,
-		const int k, unsigned long long * const baseCounter,
-		statistics_t * const baseStatistics,
-		unsigned long long * const TotalNumSequencesN) {
-	DEBUG_HISTO_AND_FREE_RECURSIVE(
-			fprintf(stdout, "histo&free @ depth %d of %d has %d\n",depth,k,head != NULL?head->base:-1 ));
-
-	if (head == NULL) {
-		DEBUG_HISTO_AND_FREE_RECURSIVE(
-				fprintf(stdout, "histo_and_free::Head == NULL. Leaf found.\n"));
-	} else {
-		if (head->base == 'H') {
-			DEBUG_HISTO_AND_FREE_RECURSIVE(fprintf(stdout, "Head found.\n\n"));
-		} else {
-			array[depth - 1] = head->base;
-			DEBUG_HISTO_AND_FREE_RECURSIVE(
-					for(int z =0; z < depth; z++) {fprintf(stdout, " ");}fprintf(stdout, "writing %c to array\n", int2base(head->base)));
+void write_kmer_bases(const int * const array, const int k, FILE * const file) {
+	if (config.dyadLeft) {
+		for (int i = 0; i < k; i++) {
+			if (i == config.dyadLeft) {
+				for (int g = 0; g < array[k]; g++) {
+					fputc('.', file);
+				}
+			}
+			fputc(int2base(array[i]), file);
 		}
-
-		//check each branch in this node even if we "think" its the leaf, to be safe
-		for (int i = 0; i < 4; i++) {
-			DEBUG_HISTO_AND_FREE_RECURSIVE(
-					fprintf(stdout, "histo&free @ depth %d of %d has %d checking branch %d\n",depth,k,head != NULL?head->base:-1,i ));
-			histo_recursive(head->nextNodePtr[i], array, depth + 1, k,
-					baseCounter, baseStatistics, TotalNumSequencesN);
+		return;
+	}
+	if (!config.pattern) {
+		for (int i = 0; i < k; i++) {
+			fputc(int2base(array[i]), file);
+		}
+		return;
+	}
+	for (int i = 0, care = 0; i < config.span; i++) {
+		fputc(config.pattern[i] == '1' ? int2base(array[care++]) : '.', file);
+	}
+}
+//--dyad pairs found of each gap index, what the z score of a dyad of that gap is taken against.
+vector<unsigned long long> dyadsByGap;
+//kmers of the histogram that passed -z, in code order. Filled while the histogram is written for --index.
+vector<kmer_code_t> indexKmers;
+//exact count of every possible kmer by code for --mismatches. Filled by histo_write_kmer().
+unsigned long long *mismatchCounts = NULL;
+/*
+ * Computes the statistics of a single kmer of the histogram and writes its row to out.
+ * array holds the coded bases of the kmer and frequency the number of times it was found.
+ * Returns false if Z filtering left the row out.
+ */
+bool histo_write_kmer(const int * const array, const int k,
+		const unsigned long long frequency,
+		const statistics_t * const baseStatistics,
+		const unsigned long long TotalNumSequencesN, FILE * const out) {
+		statistics_t kmerBaseStatistics[4] = { }; //This will hold data that is only for this single Kmer and not for the entire file.
+
+		//the neighborhoods need every kmer, whether or not -z writes it.
+		if (mismatchCounts) {
+			kmer_code_t code = 0;
+			for (int i = 0; i < k; i++) {
+				code = (code << 2) | array[i];
+			}
+			mismatchCounts[code] = frequency;
 		}
 
-		//once we have exhausted all branches, we check for depth of k.
-		if (depth == (k)) {
-			statistics_t kmerBaseStatistics[4] = { 0 }; //This will hold data that is only for this single Kmer and not for the entire file.
+		DEBUG_STATISTICS(
+				for (int i = 0; i < 4; i++) {
+					cout << kmerBaseStatistics[i].Count << " = count and "
+					<< kmerBaseStatistics[i].Probability
+					<< " = probability initially" << endl
+					;
+				});
 
+		/*
+		 * count the number of times each base occurs. GATTACA,
+		 * kmerBaseStatistics[base2int('A')].Count = 3,kmerBaseStatistics[base2int('C')].Count = 1,
+		 * kmerBaseStatistics[base2int('G')].Count = 1, kmerBaseStatistics[base2int('T')].Count = 2,
+		 */
+		DEBUG_STATISTICS(cout << "pre traversing kmer" << endl);
+		for (int location = 0; location < k; location++) {
 			DEBUG_STATISTICS(
-					for (int i = 0; i < 4; i++) {
-						cout << kmerBaseStatistics[i].Count << " = count and "
-						<< kmerBaseStatistics[i].Probability
-						<< " = probability initially" << endl
-						;
-					});
+					cout << "location == " << location << endl; cout << "array[location] == "
+					<< array[location] << endl; cout << "kmerBaseStatistics[array[location]].Count == "
+					<< kmerBaseStatistics[array[location]].Count << endl;);
 
-			/*
-			 * count the number of times each base occurs. GATTACA,
-			 * kmerBaseStatistics[base2int('A')].Count = 3,kmerBaseStatistics[base2int('C')].Count = 1,
-			 * kmerBaseStatistics[base2int('G')].Count = 1, kmerBaseStatistics[base2int('T')].Count = 2,
-			 */
-			DEBUG_STATISTICS(cout << "pre traversing kmer" << endl);
-			for (int location = 0; location < k; location++) {
-				DEBUG_STATISTICS(
-						cout << "location == " << location << endl; cout << "array[location] == "
-						<< array[location] << endl; cout << "kmerBaseStatistics[array[location]].Count == "
-						<< kmerBaseStatistics[array[location]].Count << endl;);
-
-				kmerBaseStatistics[array[location]].Count++; //increment the counter for this letter
-
-				DEBUG(fprintf(stdout, "%c", int2base(array[location])));
-			}
-			DEBUG(fprintf(stdout, ", %d\n", head->frequency));
-
-			/*
-			 * Calculate Shannon Entropy to determine if a sequence contains information. it could be estimated
-			 * # of different bases in the sequence, # of bits estimated
-			 * 1, 0
-			 * 2, 1
-			 * 3, 2
-			 * 4, 2
-			 * Then multiply by the number of letters in the sequence.
-			 * AAAAAAAAA has zero bits of information.
-			 * GATTACA has 14 bits of information to encode the entire sequence and still be able to decode it.
-			 * H(X) = (over x) Σ P(x) * log2(1/P(x)) in bits
-			 * Where P(x) is the probability of the current letter occurring in the current KMER sequence.
-			 * TODO create a dynamic shannon entropy limit filter. H > 0 for sure but H > k would be ok, is H > k*2 ok? or k*4
-			 */
-			//calculate the probability
-			for (int i = 0; i < 4; i++) {
-				kmerBaseStatistics[i].Probability =
-						(double) kmerBaseStatistics[i].Count
-								/ (double) config.k;
-				DEBUG_STATISTICS(
-						cout << kmerBaseStatistics[i].Probability << " = "
-						<< kmerBaseStatistics[i].Count << " / "
-						<< config.k << endl);
-			}
+			kmerBaseStatistics[array[location]].Count++; //increment the counter for this letter
+
+			DEBUG(fprintf(stdout, "%c", int2base(array[location])));
+		}
+		DEBUG(fprintf(stdout, ", %llu\n", frequency));
 
+		/*
+		 * Calculate Shannon Entropy to determine if a sequence contains information. it could be estimated
+		 * # of different bases in the sequence, # of bits estimated
+		 * 1, 0
+		 * 2, 1
+		 * 3, 2
+		 * 4, 2
+		 * Then multiply by the number of letters in the sequence.
+		 * AAAAAAAAA has zero bits of information.
+		 * GATTACA has 14 bits of information to encode the entire sequence and still be able to decode it.
+		 * H(X) = (over x) Σ P(x) * log2(1/P(x)) in bits
+		 * Where P(x) is the probability of the current letter occurring in the current KMER sequence.
+		 * TODO create a dynamic shannon entropy limit filter. H > 0 for sure but H > k would be ok, is H > k*2 ok? or k*4
+		 */
+		//calculate the probability
+		for (int i = 0; i < 4; i++) {
+			kmerBaseStatistics[i].Probability =
+					(double) kmerBaseStatistics[i].Count
+							/ (double) config.k;
 			DEBUG_STATISTICS(
-					for (int i = 0; i < 4; i++) {
-						cout << kmerBaseStatistics[i].Count << " = count and "
-						<< kmerBaseStatistics[i].Probability
-						<< " = probability calculate the probability"
-						<< endl
-						;
-					}
+					cout << kmerBaseStatistics[i].Probability << " = "
+					<< kmerBaseStatistics[i].Count << " / "
+					<< config.k << endl);
+		}
 
-			);
-
-			//calculate the number of bits to encode a single symbol
-			long double h = 0;
-			for (int i = 0; i < 4; i++) {
-				if (kmerBaseStatistics[i].Probability != 0)
-					h +=
-							(double) kmerBaseStatistics[i].Probability
-									* log2(
-											1
-													/ (double) kmerBaseStatistics[i].Probability);
-			}
-
-			DEBUG_STATISTICS(cout << h << " = h" << endl
-					; );
-
-			//calculate the number of bits to encode the entire sequence.
-			long double H = h * config.k;
-
-			DEBUG_STATISTICS(cout << H << " = H" << endl
-					; );
-
-			/*
-			 * Find the likely hood that this base occurred this many times randomly
-			 * based on the proportion of times that we found it in the file.
-			 * I.e. we found A 50% of the time, and we found it 3 times,
-			 * Run this on all possible bases A,C,G, and T
-			 * Thus creating a cumulative probability of finding this kmer based on occurrences of letters in kmer vs letters in entire file
-			 */
-			double estimatedProportion = 1; //proportion of finding this base in this kmer.
-			for (int i = 0; i < 4; i++) {
-				estimatedProportion *= pow(
-						(double) baseStatistics[i].Probability,
-						(double) kmerBaseStatistics[i].Count);
+		DEBUG_STATISTICS(
+				for (int i = 0; i < 4; i++) {
+					cout << kmerBaseStatistics[i].Count << " = count and "
+					<< kmerBaseStatistics[i].Probability
+					<< " = probability calculate the probability"
+					<< endl
+					;
+				}
 
-				DEBUG_STATISTICS(
-						cout << "baseStatistics[i].Probability == " << baseStatistics[i].Probability << " raised to the " << kmerBaseStatistics[i].Count << "  == kmerBaseStatistics[i]" << endl;
+		);
 
-						cout << "estimatedProportion so far == " << estimatedProportion << endl;);
+		//calculate the number of bits to encode a single symbol
+		long double h = 0;
+		for (int i = 0; i < 4; i++) {
+			if (kmerBaseStatistics[i].Probability != 0)
+				h +=
+						(double) kmerBaseStatistics[i].Probability
+								* log2(
+										1
+												/ (double) kmerBaseStatistics[i].Probability);
+		}
 
-			}
+		DEBUG_STATISTICS(cout << h << " = h" << endl
+				; );
 
-			//Find the Z score which is the normal binomial distribution from previously calculated values.
-			unsigned long long n = *TotalNumSequencesN; //total number of bases in the file.
-			unsigned long long x = head->frequency; // x = number of successes that I have had given the number of trials (x <= N)
-			long double p = estimatedProportion; // probability of success based on occurrences of letters in kmer vs letters in entire file
-			long double q = 1 - p; // probability of failure.
-			long double standardDev = sqrt(n * p * q);	//standard deviation
-			long double mean = n * p; //average (population mean)
-			long double z = (x - mean) / standardDev; //calculate the z score
+		//calculate the number of bits to encode the entire sequence.
+		long double H = h * config.k;
 
-			DEBUG_STATISTICS(
-					cout << n << " = n, " << x << " = x, " << p << " = p, " << q
-					<< " = q, " << standardDev << " = standardDev, "
-					<< mean << " = mean, " << z << " = z" << endl; );
-
-			/*
-			 * If there is no z filtering
-			 * Or if z filtering is enabled and the z score of this sequence is above it
-			 * Then we can print the data to the file
-			 *
-			 */
-			if (config.zThresholdEnable == 0
-					|| ((config.zThresholdEnable > 0)
-							&& (abs(z) >= config.zThreshold))) {
-
-				//write the information to the file.
-				//start a new line.
-				fputc('\n', config.out_file_pointer);
-
-				//print out the sequence that we found.
-				for (int i = 0; i < k; i++) {
-					fputc(int2base(array[i]), config.out_file_pointer);
-				}
-
-				// print out the number of bits to encode a single symbol in the sequence.
-				fprintf(config.out_file_pointer, ", %LE", h);
-
-				// print out the number of bits to encode the entire sequence.
-				fprintf(config.out_file_pointer, ", %LE", H);
-
-				//print out the number of times that we saw the sequence.
-				fprintf(config.out_file_pointer, ", %d", head->frequency);
-
-				//There is a test to see if we can do the normal approximation test or not.
-				bool canDoNormalApprox = normal_approx_check(n, p, 1 - p);
-				if (canDoNormalApprox == true) {
-					//http://www.cplusplus.com/reference/cstdio/printf/ was using %Le
-					//if the threshold is not enabled OR (if the threshold is enabled and our z score is a minimum the Z threshold.)
-					DEBUG_STATISTICS(
-							cout << config.zThresholdEnable
-							<< " config.zThresholdEnable, " << z << " = z, "
-							<< config.zThreshold << " = config.zThreshold"
-							<< endl);
-					//print out the Z score value if it is greater than or equal to the threshold.
-					fprintf(config.out_file_pointer, ", %LE", z);
-				}DEBUG_STATISTICS( else {fprintf(stdout,
-									"The sequence did not pass the normal approximation test and was not written to the file.\n");});
-
-				// print higher precision, but the length of long double is undefined and in our experiments, we don't have any duplicate Z scores.
-				//fprintf(config.out_file_pointer, ", %.10LE", z);
-			}
-
-			//OLD STUFF to verify that our procedure is working step by step.
-			//			float_n_choose_k(n, x) * pow((double) 1 - p, (double) n - x) * pow((double) p, (double) x)
-			DEBUG_STATISTICS(
-					cout << float_n_choose_k(n, x) << "   " << pow((double) 1 - p, (double) n - x) << "   " << pow((double) p, (double) x) << endl; cout << float_n_choose_k(n, x) * pow((double) 1 - p, (double) n - x) * pow((double) p, (double) x) << endl;);
+		DEBUG_STATISTICS(cout << H << " = H" << endl
+				; );
+
+		/*
+		 * Find the likely hood that this base occurred this many times randomly
+		 * based on the proportion of times that we found it in the file.
+		 * I.e. we found A 50% of the time, and we found it 3 times,
+		 * Run this on all possible bases A,C,G, and T
+		 * Thus creating a cumulative probability of finding this kmer based on occurrences of letters in kmer vs letters in entire file
+		 */
+		double estimatedProportion = 1; //proportion of finding this base in this kmer.
+		for (int i = 0; i < 4; i++) {
+			estimatedProportion *= pow(
+					(double) baseStatistics[i].Probability,
+					(double) kmerBaseStatistics[i].Count);
 
 			DEBUG_STATISTICS(
-					{
-						long double answer = float_n_choose_k(
-								*TotalNumSequencesN, head->frequency);
-						long double binomialDistribution = answer
-						* pow((double ) 1 - estimatedProportion,
-								(double ) (*TotalNumSequencesN)
-								- head->frequency)
-						* pow((double ) estimatedProportion,
-								(double ) head->frequency);
-						fprintf(config.out_file_pointer, ", %Le",
-								binomialDistribution)
-						;
-
-						cout
-						<< "float_n_choose_k(TotalNumSequencesN, head->frequency) == float_n_choose_k( "
-						<< (*TotalNumSequencesN) << ", "
-						<< head->frequency << endl
-						;
-
-						cout
-						<< float_n_choose_k((*TotalNumSequencesN),
-								head->frequency) << "   "
-						<< pow((double ) 1 - estimatedProportion,
-								(double ) (*TotalNumSequencesN)
-								- head->frequency) << "   "
-						<< pow((double ) estimatedProportion,
-								(double ) head->frequency) << endl
-						;
-
-						cout
-						<< float_n_choose_k((*TotalNumSequencesN),
-								head->frequency)
-						* pow((double ) 1 - estimatedProportion,
-								(double ) (*TotalNumSequencesN)
-								- head->frequency)
-						* pow((double ) estimatedProportion,
-								(double ) head->frequency)
-						<< endl
-						;
-					});
+					cout << "baseStatistics[i].Probability == " << baseStatistics[i].Probability << " raised to the " << kmerBaseStatistics[i].Count << "  == kmerBaseStatistics[i]" << endl;
+
+					cout << "estimatedProportion so far == " << estimatedProportion << endl;);
+
+		}
+
+		//a canonical kmer also counts its reverse complement, unless it is its own.
+		if (config.canonicalEnable > 0) {
+			bool palindrome = true;
+			for (int i = 0; i < k && palindrome; i++) {
+				palindrome = array[i] == 3 - array[k - 1 - i];
+			}
+			if (!palindrome) {
+				double reverseProportion = 1;
+				for (int i = 0; i < 4; i++) {
+					reverseProportion *= pow(
+							(double) baseStatistics[3 - i].Probability,
+							(double) kmerBaseStatistics[i].Count);
+				}
+				estimatedProportion += reverseProportion;
+			}
+		}
+
+		//Find the Z score which is the normal binomial distribution from previously calculated values.
+		unsigned long long n = TotalNumSequencesN; //total number of bases in the file.
+		unsigned long long x = frequency; // x = number of successes that I have had given the number of trials (x <= N)
+		long double p = estimatedProportion; // probability of success based on occurrences of letters in kmer vs letters in entire file
+		long double q = 1 - p; // probability of failure.
+		long double standardDev = sqrt(n * p * q);	//standard deviation
+		long double mean = n * p; //average (population mean)
+		long double z = (x - mean) / standardDev; //calculate the z score
+
+		DEBUG_STATISTICS(
+				cout << n << " = n, " << x << " = x, " << p << " = p, " << q
+				<< " = q, " << standardDev << " = standardDev, "
+				<< mean << " = mean, " << z << " = z" << endl; );
+
+		/*
+		 * If there is no z filtering
+		 * Or if z filtering is enabled and the z score of this sequence is above it
+		 * Then we can print the data to the file
+		 *
+		 */
+		const bool written = config.zThresholdEnable == 0
+				|| ((config.zThresholdEnable > 0)
+						&& (abs(z) >= config.zThreshold));
+		if (written) {
+
+			//write the information to the file.
+			//start a new line.
+			fputc('\n', out);
+
+			//print out the sequence that we found.
+			write_kmer_bases(array, k, out);
+
+			// print out the number of bits to encode a single symbol in the sequence.
+			fprintf(out, ", %LE", h);
+
+			// print out the number of bits to encode the entire sequence.
+			fprintf(out, ", %LE", H);
+
+			//print out the number of times that we saw the sequence.
+			fprintf(out, ", %llu", frequency);
+
+			//There is a test to see if we can do the normal approximation test or not.
+			bool canDoNormalApprox = normal_approx_check(n, p, 1 - p);
+			if (canDoNormalApprox == true) {
+				//http://www.cplusplus.com/reference/cstdio/printf/ was using %Le
+				//if the threshold is not enabled OR (if the threshold is enabled and our z score is a minimum the Z threshold.)
+				DEBUG_STATISTICS(
+						cout << config.zThresholdEnable
+						<< " config.zThresholdEnable, " << z << " = z, "
+						<< config.zThreshold << " = config.zThreshold"
+						<< endl);
+				//print out the Z score value if it is greater than or equal to the threshold.
+				fprintf(out, ", %LE", z);
+			}DEBUG_STATISTICS( else {fprintf(stdout,
+								"The sequence did not pass the normal approximation test and was not written to the file.\n");});
+
+			// print higher precision, but the length of long double is undefined and in our experiments, we don't have any duplicate Z scores.
+			//fprintf(out, ", %.10LE", z);
+		}
+
+		//OLD STUFF to verify that our procedure is working step by step.
+		//			float_n_choose_k(n, x) * pow((double) 1 - p, (double) n - x) * pow((double) p, (double) x)
+		DEBUG_STATISTICS(
+				cout << float_n_choose_k(n, x) << "   " << pow((double) 1 - p, (double) n - x) << "   " << pow((double) p, (double) x) << endl; cout << float_n_choose_k(n, x) * pow((double) 1 - p, (double) n - x) * pow((double) p, (double) x) << endl;);
+
+		DEBUG_STATISTICS(
+				{
+					long double answer = float_n_choose_k(
+							TotalNumSequencesN, frequency);
+					long double binomialDistribution = answer
+					* pow((double ) 1 - estimatedProportion,
+							(double ) TotalNumSequencesN
+							- frequency)
+					* pow((double ) estimatedProportion,
+							(double ) frequency);
+					fprintf(out, ", %Le",
+							binomialDistribution)
+					;
+
+					cout
+					<< "float_n_choose_k(TotalNumSequencesN, frequency) == float_n_choose_k( "
+					<< TotalNumSequencesN << ", "
+					<< frequency << endl
+					;
+
+					cout
+					<< float_n_choose_k(TotalNumSequencesN,
+							frequency) << "   "
+					<< pow((double ) 1 - estimatedProportion,
+							(double ) TotalNumSequencesN
+							- frequency) << "   "
+					<< pow((double ) estimatedProportion,
+							(double ) frequency) << endl
+					;
+
+					cout
+					<< float_n_choose_k(TotalNumSequencesN,
+							frequency)
+					* pow((double ) 1 - estimatedProportion,
+							(double ) TotalNumSequencesN
+							- frequency)
+					* pow((double ) estimatedProportion,
+							(double ) frequency)
+					<< endl
+					;
+				});
+
+		return written;
+}
+/*
+ * histo_write_kmer() for a packed kmer code. array is scratch space of k ints.
+ */
+bool histo_write_code(int * const array, const int k, const kmer_code_t code,
+		const unsigned long long frequency,
+		const statistics_t * const baseStatistics,
+		const unsigned long long TotalNumSequencesN, FILE * const out) {
+	if (config.dyadLeft) {
+		//the gap index is above the config.k bases and a dyad is scored against the dyads of its gap.
+		const int g = code >> (2 * config.k);
+		for (int i = 0; i < config.k; i++) {
+			array[i] = (code >> (2 * (config.k - 1 - i))) & 3;
+		}
+		array[config.k] = config.dyadGapMin + g;
+		return histo_write_kmer(array, config.k, frequency, baseStatistics,
+				dyadsByGap[g], out);
+	}
+	for (int i = 0; i < k; i++) {
+		array[i] = (code >> (2 * (k - 1 - i))) & 3;
+	}
+	return histo_write_kmer(array, k, frequency, baseStatistics,
+			TotalNumSequencesN, out);
+}
+//The rows of one range of the histogram, written by a worker and waiting for the ranges before it.
+struct histo_range_t {
+	char *text;
+	size_t size;
+	vector<kmer_code_t> passed; //kmers of the range that passed -z, for --index.
+	bool done;
+};
+/*
+ * Writes the histogram as numRanges ranges of kmers in ascending code order on config.threads threads.
+ * writeRange(r, out, array, passed) writes the rows of range r to out, array is k ints of scratch space
+ * and passed collects the kmers -z let through. Every range is written to its own memory stream and the
+ * streams are copied to the out file, or to file if one is given, in range order, so the file is the same
+ * as one thread would write.
+ * Workers stay at most HISTO_RANGES_AHEAD ranges per thread ahead of the copy to bound the memory.
+ */
+template<typename callback_t>
+void write_histogram_ranges(const size_t numRanges, callback_t writeRange,
+		FILE * const file = NULL) {
+	vector<histo_range_t> ranges(numRanges);
+	size_t nextRange = 0;
+	size_t copied = 0;
+	mutex lock;
+	condition_variable rangeDone;
+	condition_variable rangeCopied;
+	const size_t ahead = (size_t) config.threads * HISTO_RANGES_AHEAD;
+
+	vector<thread> workers;
+	for (int t = 0; t < config.threads; t++) {
+		workers.push_back(thread([&]() {
+			int *array = (int*) allocate_array(config.k + 1, sizeof(int)); //a dyad keeps its gap at array[k].
+			unique_lock<mutex> guard(lock);
+			while (nextRange < numRanges) {
+				const size_t r = nextRange++;
+				rangeCopied.wait(guard, [&]() {return r < copied + ahead;});
+				guard.unlock();
+
+				histo_range_t &range = ranges[r];
+				FILE *out = open_memstream(&range.text, &range.size);
+				if (!out) {
+					fprintf(stderr, "write_histogram_ranges():: memory stream failed\n");
+					exit(EXIT_FAILURE);
+				}
+				writeRange(r, out, array, range.passed);
+				fclose(out);
+
+				guard.lock();
+				range.done = true;
+				rangeDone.notify_all();
+			}
+			free(array);
+		}));
+	}
+
+	for (size_t r = 0; r < numRanges; r++) {
+		histo_range_t &range = ranges[r];
+		{
+			unique_lock<mutex> guard(lock);
+			rangeDone.wait(guard, [&]() {return range.done;});
+		}
+		write_or_die(range.text, sizeof(char), range.size,
+				file ? file : config.out_file_pointer);
+		indexKmers.insert(indexKmers.end(), range.passed.begin(),
+				range.passed.end());
+		free(range.text);
+		vector<kmer_code_t>().swap(range.passed);
+		{
+			lock_guard<mutex> guard(lock);
+			copied = r + 1;
+		}
+		rangeCopied.notify_all();
+	}
+	for (size_t t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+}
+/*
+ * Writes the row of one kmer for write_histogram_ranges() and keeps it for --index if -z let it through.
+ */
+static inline void histo_range_kmer(int * const array, const int k,
+		const kmer_code_t code, const unsigned long long frequency,
+		const statistics_t * const baseStatistics,
+		const unsigned long long TotalNumSequencesN, FILE * const out,
+		vector<kmer_code_t> &passed) {
+	if (histo_write_code(array, k, code, frequency, baseStatistics,
+			TotalNumSequencesN, out) && config.indexEnable > 0
+			&& config.zThresholdEnable > 0) {
+		passed.push_back(code);
+	}
+}
+/*
+ * The histogram of the tree. Each range is the subtree of one prefix of the first HISTO_TREE_PREFIX bases,
+ * walked depth first with an explicit stack so k is not limited by the call stack. Branches are visited
+ * A, C, G, T, so the kmers come out in ascending code order like the count tables.
+ */
+void histo_tree(node_t * const head, const statistics_t * const baseStatistics,
+		const unsigned long long TotalNumSequencesN) {
+	const int k = config.k;
+	const int prefix = min(k, HISTO_TREE_PREFIX);
+
+	write_histogram_ranges(((size_t) 1) << (2 * prefix),
+			[&](size_t r, FILE *out, int *array, vector<kmer_code_t> &passed) {
+				node_t *node = head;
+				for (int depth = 0; node && depth < prefix; depth++) {
+					node = node->nextNodePtr[(r >> (2 * (prefix - 1 - depth))) & 3];
+				}
+				if (!node) {
+					return;
+				}
+
+				typedef pair<node_t*, int> visit_t; //node and its depth.
+				vector<visit_t> stack(1, visit_t(node, prefix));
+				kmer_code_t code = r;
+				while (!stack.empty()) {
+					const visit_t visit = stack.back();
+					stack.pop_back();
+					const int depth = visit.second;
+					if (depth > prefix) {
+						//drop the bases below this node's parent and add this node's base.
+						code = ((code >> (2 * (k - depth + 1))) << 2) | visit.first->base;
+						code <<= 2 * (k - depth);
+					} else {
+						code = ((kmer_code_t) r) << (2 * (k - prefix));
+					}
+					if (depth == k) {
+						unsigned long long frequency = visit.first->frequency;
+						if (!nodeOverflow.empty()) {
+							unordered_map<node_t*, unsigned long long>::const_iterator overflow =
+									nodeOverflow.find(visit.first);
+							if (overflow != nodeOverflow.end()) {
+								frequency += overflow->second;
+							}
+						}
+						histo_range_kmer(array, k, code, frequency, baseStatistics,
+								TotalNumSequencesN, out, passed);
+						continue;
+					}
+					for (int i = 3; i >= 0; i--) {
+						if (visit.first->nextNodePtr[i]) {
+							stack.push_back(visit_t(visit.first->nextNodePtr[i], depth + 1));
+						}
+					}
+				}
+			});
+}
+/*
+ * Worker for write_mismatch_histogram(). Moves one base position of the neighborhood sums forward.
+ * levels[j] holds, for every kmer, the count of the kmers that differ from it in exactly j of the
+ * positions done so far. A kmer gains the level j - 1 counts of the 3 kmers that differ from it only
+ * at this position, so the 4 kmers that differ only here are done together as a group.
+ */
+void mismatch_position_worker(unsigned long long ** const levels,
+		const int mismatches, const unsigned long long stride,
+		const unsigned long long firstGroup, const unsigned long long lastGroup) {
+	for (unsigned long long g = firstGroup; g < lastGroup; g++) {
+		//the group of kmers whose base at this position is A, C, G and T, the rest the same.
+		const unsigned long long first = (g / stride) * stride * 4 + g % stride;
+		for (int j = mismatches; j > 0; j--) {
+			unsigned long long * const lower = levels[j - 1];
+			const unsigned long long total = lower[first]
+					+ lower[first + stride] + lower[first + 2 * stride]
+					+ lower[first + 3 * stride];
+			for (int b = 0; b < 4; b++) {
+				levels[j][first + b * stride] += total
+						- lower[first + b * stride];
+			}
+		}
+	}
+}
+/*
+ * --mismatches. Writes a csv of the neighborhood of every kmer: the total count of all kmers within
+ * config.mismatches substitutions of it, the count expected from the base probabilities and its Z score.
+ * The sums are built from the exact counts histo_write_kmer() stored in mismatchCounts, one base
+ * position at a time in parallel, instead of visiting every neighbor of every kmer.
+ * Z filtering applies to the neighborhood Z score.
+ */
+void write_mismatch_histogram(const statistics_t * const baseStatistics,
+		const unsigned long long TotalNumSequencesN) {
+	const int k = config.k;
+	const int d = config.mismatches;
+	const unsigned long long numKmers = ((unsigned long long) 1) << (2 * k);
+
+	unsigned long long *levels[MAX_MISMATCHES + 1];
+	levels[0] = mismatchCounts;
+	for (int j = 1; j <= d; j++) {
+		levels[j] = (unsigned long long*) calloc(numKmers,
+				sizeof(unsigned long long));
+		if (!levels[j]) {
+			fprintf(stderr,
+					"write_mismatch_histogram():: memory allocation failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	//each position depends on the last, the groups of one position are split over the threads.
+	const unsigned long long numGroups = numKmers / 4;
+	for (int position = 0; position < k; position++) {
+		const unsigned long long stride = ((unsigned long long) 1)
+				<< (2 * (k - 1 - position));
+		vector<thread> workers;
+		for (int t = 0; t < config.threads; t++) {
+			workers.push_back(
+					thread(mismatch_position_worker, levels, d, stride,
+							numGroups * t / config.threads,
+							numGroups * (t + 1) / config.threads));
+		}
+		for (size_t t = 0; t < workers.size(); t++) {
+			workers[t].join();
+		}
+	}
+
+	char *mismatch_file_name = build_out_file_name(
+			d == 1 ? "mer_Mismatch_1_Of_" : "mer_Mismatch_2_Of_", ".csv");
+	FILE *mismatch_file_pointer = fopen(mismatch_file_name, "w");
+	if (!mismatch_file_pointer) {
+		fprintf(stderr,
+				"Mismatch out file failed to open\nFile MUST be in current directory.\n");
+		exit(EXIT_FAILURE);
+	}
+	fprintf(mismatch_file_pointer, MISMATCH_FILE_COLUMN_HEADERS);
+
+	const unsigned long long n = TotalNumSequencesN;
+	unsigned long long written = 0;
+	int array[MAX_MISMATCH_K];
+	for (kmer_code_t code = 0; code < numKmers; code++) {
+		unsigned long long frequency = 0;
+		for (int j = 0; j <= d; j++) {
+			frequency += levels[j][code];
+		}
+		if (!frequency) {
+			continue;
+		}
+
+		//probability of a kmer within d substitutions, exactly[j] for exactly j of the positions so far.
+		long double exactly[MAX_MISMATCHES + 1] = { 1 };
+		for (int i = 0; i < k; i++) {
+			const long double p = baseStatistics[(code >> (2 * (k - 1 - i)))
+					& 3].Probability;
+			for (int j = d; j > 0; j--) {
+				exactly[j] = exactly[j] * p + exactly[j - 1] * (1 - p);
+			}
+			exactly[0] *= p;
+		}
+		long double p = 0;
+		for (int j = 0; j <= d; j++) {
+			p += exactly[j];
+		}
+		const long double mean = n * p;
+		const long double z = (frequency - mean) / sqrtl(n * p * (1 - p));
+
+		if (config.zThresholdEnable > 0 && fabsl(z) < config.zThreshold) {
+			continue;
+		}
+		fputc('\n', mismatch_file_pointer);
+		for (int i = 0; i < k; i++) {
+			array[i] = (code >> (2 * (k - 1 - i))) & 3;
+		}
+		write_kmer_bases(array, k, mismatch_file_pointer);
+		fprintf(mismatch_file_pointer, ", %llu, %llu, %LE", mismatchCounts[code],
+				frequency, mean);
+		if (normal_approx_check(n, p, 1 - p)) {
+			fprintf(mismatch_file_pointer, ", %LE", z);
+		}
+		written++;
+	}
+
+	if (fclose(mismatch_file_pointer) == EOF) {
+		fprintf(stderr, "Mismatch out file close error!\n");
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stdout,
+			"Wrote the %d mismatch neighborhoods of %llu kmers to: \n    %s\n",
+			d, written, mismatch_file_name);
 
-		}			//end if for reaching depth of k
-	}			//end else if for head == NULL
-}			//end histogram function.
+	for (int j = 1; j <= d; j++) {
+		free(levels[j]);
+	}
+	free(mismatch_file_name);
+}
 /*
  * This function brings in a pointer to an integer array and shifts its contents left.
  * It also brings in an integer to insert into the array at the right most location.
@@ -957,115 +4267,4136 @@ void shift_left_and_insert(int * const array, const int integer_to_insert) {
 			printf("shift_left_and_insert:: ending with array :                "); for (int i = 0; i < config.k; i++) {printf("%c", int2base(*(array + i)));}printf("\n"););
 }
 /*
- * This function conforms to the description of this program above by reading a text file and creating a histogram of sequences of length k.
+ * Dense (kmer x position bin) count table for the positional histogram.
+ * Stored bin major so a record longer than any seen before only appends bins.
  */
-node_t * findKmer(node_t * headNode, unsigned long long * const baseCounter,
-		statistics_t * const baseStatistics,
-		unsigned long long * const TotalNumSequencesN) {
-
+struct positional_table_t {
+	int binSize; //bases per bin.
+	unsigned long long numKmers; //4^k rows.
+	unsigned long long numBins; //bins seen so far, grows with the longest record.
+	vector<unsigned int> counts; //counts[bin * numKmers + code]
+};
+void positional_count(positional_table_t * const table, const kmer_code_t code,
+		const unsigned long long offset) {
+	unsigned long long bin = offset / table->binSize;
+	if (bin >= table->numBins) {
+		table->numBins = bin + 1;
+		table->counts.resize(table->numBins * table->numKmers, 0);
+	}
+	table->counts[bin * table->numKmers + code]++;
+}
+/*
+ * State of the scan findKmer() performs one base at a time.
+ * Keeping it together lets the text reader and the packed cache reader share scan_base().
+ */
+struct kmer_scan_t {
+	node_t *headNode; //root of the tree.
 	// Array to hold the kmer of size k. This ensures that we can hold each sequence, but requires the shifting of data in the array.
-	int *kmer = (int*) allocate_array(config.k, sizeof(int));
-	int i = 0;
-
-	//fill array by inserting a negative one and testing the functionality of the shift function.
-	while (i++ < config.k)
-		shift_left_and_insert(kmer, -1);
-
-	//stores the character read in from the file.
-	char c = 'A';
+	int *kmer;
 	//holds the size of the current sequence. NATTAN would have seqSize 4 before the N was encountered to reset it.
-	int seqSize = 0;
-	//stores the coded value of the character read from the file. 0-3 are valid, else invalid base.
-	int codedBase = 0;
+	int seqSize;
+	//number of bases, valid or not, since the last identifier. Unlike seqSize only a '>' resets it.
+	unsigned long long recordOffset;
+	//the kmer array packed 2 bits per base for the dense tables.
+	kmer_code_t packedKmer;
+	kmer_code_t packedMask;
+	unsigned long long *baseCounter;
+	statistics_t *baseStatistics;
+	unsigned long long *TotalNumSequencesN;
+	positional_table_t *positionalTable;
+	bool masking; //--min-entropy or --dust.
+	complexity_t complexity; //of the kmer ending at the last base.
+	unsigned long long *maskedKmers;
+};
+/*
+ * Called for every '>'.
+ * This is very important! This means that a > in the file will break a sequence and it will treat the line as a comment.
+ */
+static inline void scan_new_record(kmer_scan_t * const scan) {
+	scan->seqSize = 0;
+	scan->recordOffset = 0;
+	if (scan->masking) {
+		complexity_reset(&scan->complexity);
+	}
+}
+/*
+ * Moves the scan over one coded base without counting it, which is all the preroll of a segment does.
+ * 0-3 are valid bases, anything negative breaks the sequence. Returns false for a break.
+ */
+static inline bool scan_shift(kmer_scan_t * const scan, const int codedBase) {
+	scan->recordOffset++;
+
+	/* If the below is true then we have found an invalid base value thus we must break the sequence apart.
+	 * else we have found a valid base value
+	 */
+	if (codedBase < 0) {
+		//any character in the file that is not a newline or a > or preceded by a > will break the sequence
+		scan->seqSize = 0;
+		for (int i = 0; i < config.k; i++) {
+			scan->kmer[i] = -2;
+		}
+		if (scan->masking) {
+			complexity_reset(&scan->complexity);
+		}
+		return false;
+	}
 
-	//check for empty sequence file.
-	if (fgetc(config.sequence_file_pointer) == EOF) {
-		fprintf(stderr, "Sequence File Is Empty, Ending Program");
-		exit(EXIT_FAILURE);
+	/* Store the coded base into the kmer to be read later. */
+	shift_left_and_insert(scan->kmer, codedBase);
+	const kmer_code_t previousKmer = scan->packedKmer;
+	scan->packedKmer = ((scan->packedKmer << 2) | codedBase) & scan->packedMask;
+	scan->seqSize++;
+	if (scan->masking) {
+		complexity_add(&scan->complexity, scan->packedKmer, previousKmer,
+				scan->seqSize, config.k);
 	}
-	rewind(config.sequence_file_pointer);
+	return true;
+}
+/*
+ * Adds one coded base to the scan. 0-3 are valid bases, anything negative breaks the sequence.
+ */
+static inline void scan_base(kmer_scan_t * const scan, const int codedBase) {
+	if (scan_shift(scan, codedBase)) {
+
+		//a low complexity kmer still adds its bases to the statistics, but is not counted.
+		bool masked = false;
+		if (scan->masking && scan->seqSize >= config.k
+				&& complexity_masked(&scan->complexity, config.k)) {
+			masked = true;
+			(*scan->maskedKmers)++;
+		}
 
-	while ((c = fgetc(config.sequence_file_pointer)) != EOF) {
+		if (scan->positionalTable && scan->seqSize >= config.k && !masked) {
+			positional_count(scan->positionalTable, scan->packedKmer,
+					scan->recordOffset - config.k);
+		}
 
-		/* if the below is true then we have found an identifier which has an entire line of non sequence data */
-		if (c == '>') {
+		/* If the below is true then that means we have found a valid sequence that is either of k size or greater.
+		 * Create a tree data structure where each node is a base encountered.
+		 * We also keep track of the total number of bases and the number of each base encountered.
+		 */
+		if (scan->seqSize > config.k) {
 
-			//This line is very important! This means that a > in the file will break a sequence and it will treat the line as a comment.
-			seqSize = 0;
+			if (!masked) {
+				scan->headNode = tree_create(scan->headNode, scan->kmer,
+						config.k, scan->baseStatistics);
+				(*scan->TotalNumSequencesN)++;
+			}
 
-			if (config.suppressOutputEnable == 0) {
-				fprintf(stdout, "Read %llu bases\n%c", *baseCounter, c);
+			(*scan->baseCounter)++;
+			scan->baseStatistics[codedBase].Count++;
+
+		} else if (scan->seqSize == config.k) {
+
+			//this case will occur less often than seqSize > config.k
+			if (!masked) {
+				scan->headNode = tree_create(scan->headNode, scan->kmer,
+						config.k, scan->baseStatistics);
+				(*scan->TotalNumSequencesN)++;
+			}
+
+			for (int i = 0; i < config.k; i++) {
+				scan->baseStatistics[scan->kmer[i]].Count++;
+				DEBUG_STATISTICS(
+						fprintf(stdout,"i == %d, int2base(kmer[i]) == %c, baseStatistics[kmer[i]].Count == %d.\n",i, int2base(scan->kmer[i]),scan->baseStatistics[scan->kmer[i]].Count));
+
+			}DEBUG_STATISTICS(fprintf(stdout,"\n"));
+			(*scan->baseCounter) += scan->seqSize;
+		} //end detection of a kmer of length k or greater.
+		else //This section will catch cases where seqSize are explicitly less than k.
+		{
+			scan->headNode = tree_create(scan->headNode,
+					scan->kmer + (config.k - scan->seqSize), scan->seqSize,
+					scan->baseStatistics);
+		}
 
-				while ((c = fgetc(config.sequence_file_pointer)) != '\n') {
-					fprintf(stdout, "%c", c);
+	} //end end of sequence detection.
+}
+/*
+ * Queue between two stages of the tree engine's pipeline. push() waits while the queue is full,
+ * which is what keeps a fast reader from running ahead of the counter.
+ */
+template<typename item_t>
+struct bounded_queue_t {
+	mutex lock;
+	condition_variable notEmpty;
+	condition_variable notFull;
+	deque<item_t> items;
+	size_t capacity;
+	bool closed; //no more items will be pushed.
+};
+template<typename item_t>
+void queue_init(bounded_queue_t<item_t> * const queue, const size_t capacity) {
+	queue->capacity = capacity;
+	queue->closed = false;
+}
+template<typename item_t>
+void queue_push(bounded_queue_t<item_t> * const queue, const item_t item) {
+	unique_lock<mutex> guard(queue->lock);
+	while (queue->items.size() >= queue->capacity) {
+		queue->notFull.wait(guard);
+	}
+	queue->items.push_back(item);
+	queue->notEmpty.notify_one();
+}
+/* Returns false once the queue is closed and empty. */
+template<typename item_t>
+bool queue_pop(bounded_queue_t<item_t> * const queue, item_t * const item) {
+	unique_lock<mutex> guard(queue->lock);
+	while (queue->items.empty() && !queue->closed) {
+		queue->notEmpty.wait(guard);
+	}
+	if (queue->items.empty()) {
+		return false;
+	}
+	*item = queue->items.front();
+	queue->items.pop_front();
+	queue->notFull.notify_one();
+	return true;
+}
+template<typename item_t>
+void queue_close(bounded_queue_t<item_t> * const queue) {
+	lock_guard<mutex> guard(queue->lock);
+	queue->closed = true;
+	queue->notEmpty.notify_all();
+}
+/*
+ * Cuts records into segments of about targetLength bases so a few chromosomes
+ * can still be spread over many threads.
+ */
+void split_records(const vector<record_t> &records, const int k,
+		const unsigned long long targetLength, vector<segment_t> &segments) {
+	for (size_t r = 0; r < records.size(); r++) {
+		const record_t &record = records[r];
+		for (unsigned long long start = 0; start < record.sequenceLength || start == 0;
+				start += targetLength) {
+			segment_t segment;
+			segment.record = record;
+			unsigned long long end = min(start + targetLength,
+					(unsigned long long) record.sequenceLength);
+			//step back over the k bases that prime the first counted kmer and tell whether it continues a run.
+			unsigned long long primed = start;
+			segment.preroll = 0;
+			segment.offset = 0;
+
+			if (record.packedBases) {
+				primed = start > (unsigned long long) k ? start - k : 0;
+				segment.preroll = start - primed;
+				segment.offset = primed;
+				segment.record.baseStart = record.baseStart + primed;
+
+				//skip the N runs that end before the segment starts.
+				const packed_n_run_t *firstRun = record.nRuns;
+				const packed_n_run_t *lastRun = record.nRuns + record.numNRuns;
+				while (firstRun < lastRun
+						&& firstRun->start + firstRun->length
+								<= segment.record.baseStart) {
+					firstRun++;
+				}
+				const packed_n_run_t *endRun = firstRun;
+				while (endRun < lastRun
+						&& endRun->start < record.baseStart + end) {
+					endRun++;
 				}
-				fprintf(stdout, "\n");
+				segment.record.nRuns = firstRun;
+				segment.record.numNRuns = endRun - firstRun;
 			} else {
-				//dump the current line.
-				while ((c = fgetc(config.sequence_file_pointer)) != '\n')
-					;
+				while (primed > 0 && segment.preroll < (unsigned long long) k) {
+					primed--;
+					if (baseCodeTable[(unsigned char) record.sequence[primed]]
+							!= SKIP_CODE) {
+						segment.preroll++;
+					}
+				}
+				segment.record.sequence = record.sequence + primed;
+			}
+			segment.record.sequenceLength = end - primed;
+			segments.push_back(segment);
+		}
+	}
+}
+/*
+ * Indexes the records of the packed cache and drops the --dedup duplicates. length is set to
+ * the bases of the cache. Text is never held whole, it is counted through the reader pipeline.
+ */
+void load_counted_records(vector<record_t> &records, size_t * const length,
+		scan_summary_t * const summary) {
+	index_packed_records(config.packedCache, records);
+	*length = config.packedCache->header->numBases;
+
+	record_hash_set_t recordHashes;
+	size_t kept = 0;
+	for (size_t r = 0; r < records.size(); r++) {
+		if (records[r].id) {
+			summary->records++;
+			if (config.suppressOutputEnable == 0) {
+				fprintf(stdout, "Read %llu bases\n>%.*s\n", records[r].baseStart,
+						(int) records[r].idLength, records[r].id);
 			}
+			if (config.dedupEnable > 0
+					&& !recordHashes.insert(hash_record(records[r])).second) {
+				summary->duplicateRecords++;
+				continue;
+			}
+		}
+		records[kept++] = records[r];
+	}
+	records.resize(kept);
+}
+//A buffer of the sequence file as read, aligned for O_DIRECT.
+struct io_buffer_t {
+	char *data;
+	size_t length;
+};
+/*
+ * Bases 2 bit packed with their breaks as N runs, the way the parser of the reader pipeline
+ * builds its blocks and holds back the records of --dedup. Positions inside an N run hold A,
+ * the same layout as the bases of a packed cache.
+ */
+struct packed_bases_t {
+	vector<unsigned char> bases;
+	vector<packed_n_run_t> nRuns;
+	unsigned long long numBases;
+};
+/*
+ * Appends a coded base. A break extends the last N run if that run ends here and starts
+ * at or after runFloor, the first base of the record piece being built.
+ */
+static inline void packed_bases_add(packed_bases_t * const packed,
+		const int codedBase, const unsigned long long runFloor) {
+	const unsigned long long position = packed->numBases++;
+	if ((position & 3) == 0) {
+		packed->bases.push_back(0);
+	}
+	if (codedBase >= 0) {
+		packed->bases.back() |= codedBase << (6 - 2 * (position & 3));
+	} else if (!packed->nRuns.empty() && packed->nRuns.back().start >= runFloor
+			&& packed->nRuns.back().start + packed->nRuns.back().length
+					== position) {
+		packed->nRuns.back().length++;
+	} else {
+		packed_n_run_t run = { position, 1 };
+		packed->nRuns.push_back(run);
+	}
+}
+void packed_bases_clear(packed_bases_t * const packed) {
+	packed->bases.clear();
+	packed->nRuns.clear();
+	packed->numBases = 0;
+}
+/* The bases from first on as a packed record, whose N runs are the runs from firstRun on. */
+record_t packed_bases_record(const packed_bases_t * const packed,
+		const unsigned long long first, const size_t firstRun) {
+	record_t record;
+	memset(&record, 0, sizeof(record));
+	record.sequenceLength = packed->numBases - first;
+	record.packedBases = packed->bases.data();
+	record.baseStart = first;
+	record.nRuns = packed->nRuns.data() + firstRun;
+	record.numNRuns = packed->nRuns.size() - firstRun;
+	return record;
+}
+/*
+ * Bases of the sequence file as the counters consume them, packed, and cut into segments that
+ * each hold a piece of one record. A piece that continues a record of the previous block starts
+ * with the last config.span bases before it as its preroll, so any counter can take any block.
+ */
+struct parsed_block_t {
+	packed_bases_t packed;
+	vector<segment_t> segments;
+};
+/*
+ * The stages of counting a text file. The reader thread fills io buffers, the parser thread
+ * turns them into parsed blocks and config.threads counter threads count the blocks.
+ * Each pair of stages passes buffers through a full queue and returns them through a free one,
+ * so no more than PIPELINE_DEPTH buffers and config.threads + PIPELINE_DEPTH blocks ever exist.
+ */
+struct read_pipeline_t {
+	text_source_t source;
+	bounded_queue_t<io_buffer_t*> freeBuffers;
+	bounded_queue_t<io_buffer_t*> fullBuffers;
+	bounded_queue_t<parsed_block_t*> freeBlocks;
+	bounded_queue_t<parsed_block_t*> fullBlocks;
+	scan_summary_t *summary; //the parser counts the records and the duplicate records.
+	io_buffer_t buffers[PIPELINE_DEPTH];
+	vector<parsed_block_t> blocks;
+	thread reader;
+	thread parser;
+	unsigned long long bytesRead;
+};
+void pipeline_reader(read_pipeline_t * const pipeline) {
+	off_t offset = 0;
+	io_buffer_t *buffer;
+	while (queue_pop(&pipeline->freeBuffers, &buffer)) {
+		if (pipeline->source.format == TEXT_PLAIN) {
+			posix_fadvise(pipeline->source.fd, offset + PIPELINE_BUFFER_SIZE,
+					(off_t) PIPELINE_BUFFER_SIZE * PIPELINE_DEPTH,
+					POSIX_FADV_WILLNEED);
 		}
 
-		//ignore newlines, but other invalid base data may be necessary to break the sequence, like > or numbers.
-		if (c != '\n') {
-			codedBase = base2int(c);
-			DEBUG(
-					cout << "Reading from file. \n"; cout << "The Base we found is " << c; cout << " which when coded is " << codedBase << "\n";);
+		buffer->length = text_source_read(&pipeline->source, buffer->data,
+				PIPELINE_BUFFER_SIZE);
+		if (buffer->length == 0) {
+			break;
+		}
+		offset += buffer->length;
+		queue_push(&pipeline->fullBuffers, buffer);
+	}
+	pipeline->bytesRead = offset;
+	queue_close(&pipeline->fullBuffers);
+}
+/*
+ * Parser stage. Follows the rules of the original character loop: a '>' starts an identifier
+ * that runs to the end of its line, newlines are skipped and the identifier's newline is never counted.
+ * With --dedup the bases of a record are held back until the next '>' so the record can be hashed first.
+ */
+void pipeline_parser(read_pipeline_t * const pipeline) {
+	const int span = config.span;
+	parsed_block_t *block;
+	queue_pop(&pipeline->freeBlocks, &block);
+	vector<size_t> firstRuns; //N run each segment of the block starts at.
+	bool segmentOpen = false;
+	unsigned long long recordBases = 0; //bases of the current record so far.
+	vector<signed char> tail(span); //the last bases of the record, the preroll of its next piece.
+	int tailLength = 0;
+	bool inIdentifier = false;
+	string id;
+	bool holdRecord = false; //dedup only, true after the first identifier.
+	packed_bases_t held = { vector<unsigned char>(), vector<packed_n_run_t>(), 0 };
+	record_hash_set_t recordHashes;
+	unsigned long long parsedBases = 0;
+	unsigned char unknownCharacters[256] = { 0 }; //characters already warned about.
+
+	//ends the record piece at the end of the block.
+	auto close_segment = [&]() {
+		if (segmentOpen) {
+			segment_t &segment = block->segments.back();
+			segment.record.sequenceLength = block->packed.numBases
+					- segment.record.baseStart;
+			segmentOpen = false;
+		}
+	};
+	//moves a finished block to the counters once its segments point into its final buffers.
+	auto push_block = [&]() {
+		close_segment();
+		for (size_t i = 0; i < block->segments.size(); i++) {
+			record_t &record = block->segments[i].record;
+			const size_t lastRun =
+					i + 1 < firstRuns.size() ?
+							firstRuns[i + 1] : block->packed.nRuns.size();
+			record.packedBases = block->packed.bases.data();
+			record.nRuns = block->packed.nRuns.data() + firstRuns[i];
+			record.numNRuns = lastRun - firstRuns[i];
+		}
+		firstRuns.clear();
+		queue_push(&pipeline->fullBlocks, block);
+		queue_pop(&pipeline->freeBlocks, &block);
+	};
+	//starts a piece of the current record, after the preroll its last piece left.
+	auto open_segment = [&]() {
+		segment_t segment;
+		memset(&segment, 0, sizeof(segment));
+		segment.record.baseStart = block->packed.numBases;
+		segment.preroll = tailLength;
+		segment.offset = recordBases - tailLength;
+		firstRuns.push_back(block->packed.nRuns.size());
+		block->segments.push_back(segment);
+		segmentOpen = true;
+		for (int i = 0; i < tailLength; i++) {
+			packed_bases_add(&block->packed, tail[i], segment.record.baseStart);
+		}
+	};
+	auto emit = [&](const int code) {
+		if (!segmentOpen) {
+			open_segment();
+		}
+		packed_bases_add(&block->packed, code,
+				block->segments.back().record.baseStart);
+		recordBases++;
+		parsedBases += code >= 0;
+		if (block->packed.numBases >= PIPELINE_BLOCK_BASES) {
+			//the record goes on in the next block, keep its last bases to prime that piece.
+			tailLength = (int) min((unsigned long long) span, recordBases);
+			int t = 0;
+			for_each_record_base(
+					packed_bases_record(&block->packed,
+							block->packed.numBases - tailLength,
+							firstRuns.back()), [&](int codedBase) {
+						tail[t++] = codedBase;
+					});
+			push_block();
+		}
+	};
+	//starts the record of the identifier just read.
+	auto start_record = [&]() {
+		close_segment();
+		recordBases = 0;
+		tailLength = 0;
+		pipeline->summary->records++;
+		if (config.suppressOutputEnable == 0) {
+			fprintf(stdout, "Read %llu bases\n>%s\n", parsedBases, id.c_str());
+		}
+	};
+	//releases the held back bases of a record unless the same bases were released before.
+	auto end_record = [&]() {
+		if (!holdRecord) {
+			return;
+		}
+		const record_t record = packed_bases_record(&held, 0, 0);
+		if (recordHashes.insert(hash_record(record)).second) {
+			for_each_record_base(record, emit);
+		} else {
+			pipeline->summary->duplicateRecords++;
+		}
+		packed_bases_clear(&held);
+	};
 
-			/* If the below is true then we have found an invalid base value thus we must break the sequence apart.
-			 * else we have found a valid base value
-			 */
-			if (codedBase < 0) {
-				//any character in the file that is not a newline or a > or preceded by a > will break the sequence
-				seqSize = 0;
-				for (i = 0; i < config.k; i++) {
-					kmer[i] = -2;
+	io_buffer_t *buffer;
+	while (queue_pop(&pipeline->fullBuffers, &buffer)) {
+		const char *c = buffer->data;
+		const char * const end = buffer->data + buffer->length;
+		while (c < end) {
+			if (inIdentifier) {
+				const char *lineEnd = (const char*) memchr(c, '\n', end - c);
+				id.append(c, (lineEnd ? lineEnd : end) - c);
+				if (!lineEnd) {
+					break;
 				}
-			} else {
+				c = lineEnd + 1;
+				inIdentifier = false;
+				if (!id.empty() && id[id.size() - 1] == '\r') {
+					id.erase(id.size() - 1);
+				}
+				start_record();
+				holdRecord = config.dedupEnable > 0;
+				continue;
+			}
 
-				/* Store the coded base into the kmer to be read later. */
-				shift_left_and_insert(kmer, codedBase);
-				seqSize++;
+			c += for_each_text_base(c, end - c, [&](const int code) {
+				if (holdRecord) {
+					packed_bases_add(&held, code, 0);
+				} else {
+					emit(code);
+				}
+			}, unknownCharacters);
+			if (c < end) {
+				//stopped at a '>'.
+				end_record();
+				inIdentifier = true;
+				id.clear();
+				c++;
+			}
+		}
+		queue_push(&pipeline->freeBuffers, buffer);
+	}
 
-				/* If the below is true then that means we have found a valid sequence that is either of k size or greater.
-				 * Create a tree data structure where each node is a base encountered.
-				 * We also keep track of the total number of bases and the number of each base encountered.
-				 */
-				if (seqSize > config.k) {
+	//an identifier cut off by the end of the file still starts a record.
+	if (inIdentifier) {
+		start_record();
+	} else {
+		end_record();
+	}
+	push_block();
+	queue_push(&pipeline->freeBlocks, block);
+	queue_close(&pipeline->fullBlocks);
+}
+/* Starts the reader and parser threads of a pipeline over the sequence file. */
+void pipeline_start(read_pipeline_t * const pipeline,
+		scan_summary_t * const summary) {
+	const int numBlocks = config.threads + PIPELINE_DEPTH;
+	text_source_open(&pipeline->source);
+	pipeline->summary = summary;
+	pipeline->bytesRead = 0;
+	queue_init(&pipeline->freeBuffers, PIPELINE_DEPTH);
+	queue_init(&pipeline->fullBuffers, PIPELINE_DEPTH);
+	queue_init(&pipeline->freeBlocks, numBlocks);
+	queue_init(&pipeline->fullBlocks, numBlocks);
+
+	pipeline->blocks.resize(numBlocks);
+	for (int i = 0; i < PIPELINE_DEPTH; i++) {
+		if (posix_memalign((void**) &pipeline->buffers[i].data,
+				DIRECT_IO_ALIGNMENT, PIPELINE_BUFFER_SIZE) != 0) {
+			fprintf(stderr, "pipeline_start():: memory allocation failed\n");
+			exit(EXIT_FAILURE);
+		}
+		queue_push(&pipeline->freeBuffers, &pipeline->buffers[i]);
+	}
+	for (int i = 0; i < numBlocks; i++) {
+		parsed_block_t &block = pipeline->blocks[i];
+		block.packed.bases.reserve(PIPELINE_BLOCK_BASES / 4 + 1);
+		block.packed.numBases = 0;
+		queue_push(&pipeline->freeBlocks, &block);
+	}
 
-					headNode = tree_create(headNode, kmer, config.k,
-							baseStatistics);
+	pipeline->reader = thread(pipeline_reader, pipeline);
+	pipeline->parser = thread(pipeline_parser, pipeline);
+}
+/* Waits for the reader and parser once the counters have taken every block. */
+void pipeline_stop(read_pipeline_t * const pipeline) {
+	//the reader may still be waiting for a buffer if the parser stopped early.
+	queue_close(&pipeline->freeBuffers);
+	pipeline->reader.join();
+	pipeline->parser.join();
+	text_source_close(&pipeline->source);
+	for (int i = 0; i < PIPELINE_DEPTH; i++) {
+		free(pipeline->buffers[i].data);
+	}
+}
+/*
+ * Where the counter threads of every engine get their segments: split in memory from the
+ * records of a packed cache, or from the blocks of a reader pipeline over a text file.
+ */
+struct segment_source_t {
+	vector<record_t> records;
+	vector<segment_t> segments;
+	atomic<size_t> nextSegment;
+	read_pipeline_t *pipeline; //NULL when the segments are in memory.
+};
+//The block of a reader pipeline a counter thread is working through.
+struct segment_cursor_t {
+	parsed_block_t *block;
+	size_t next; //next segment of the block.
+};
+/*
+ * Opens the sequence file as a segment source. A packed cache is split into about
+ * 16 segments per thread, a text file is parsed into blocks as the counters go.
+ */
+void segment_source_open(segment_source_t * const source,
+		scan_summary_t * const summary) {
+	source->nextSegment = 0;
+	source->pipeline = NULL;
+	if (config.packedCache) {
+		size_t length = 0;
+		load_counted_records(source->records, &length, summary);
+		split_records(source->records, config.span,
+				length / (config.threads * 16) + 4096, source->segments);
+		return;
+	}
+	source->pipeline = new read_pipeline_t;
+	pipeline_start(source->pipeline, summary);
+}
+/*
+ * Sets segment to the next segment to count, which stays valid until the next call.
+ * Returns false once there are none left.
+ */
+bool next_segment(segment_source_t * const source,
+		segment_cursor_t * const cursor, const segment_t ** const segment) {
+	if (!source->pipeline) {
+		const size_t s = source->nextSegment++;
+		if (s >= source->segments.size()) {
+			return false;
+		}
+		*segment = &source->segments[s];
+		return true;
+	}
+	while (!cursor->block || cursor->next == cursor->block->segments.size()) {
+		if (cursor->block) {
+			packed_bases_clear(&cursor->block->packed);
+			cursor->block->segments.clear();
+			queue_push(&source->pipeline->freeBlocks, cursor->block);
+			cursor->block = NULL;
+		}
+		if (!queue_pop(&source->pipeline->fullBlocks, &cursor->block)) {
+			cursor->block = NULL;
+			return false;
+		}
+		cursor->next = 0;
+	}
+	*segment = &cursor->block->segments[cursor->next++];
+	return true;
+}
+/* Closes a source once every counter thread is done with it. */
+void segment_source_close(segment_source_t * const source) {
+	if (!source->pipeline) {
+		return;
+	}
+	pipeline_stop(source->pipeline);
+	const bool empty = source->pipeline->bytesRead == 0;
+	delete source->pipeline;
+	source->pipeline = NULL;
+	if (empty) {
+		fprintf(stderr, "Sequence File Is Empty, Ending Program");
+		exit(EXIT_FAILURE);
+	}
+}
+/*
+ * Counter thread of the tree engine. Every segment starts a fresh scan that its preroll primes
+ * without counting, so segments can be counted in any order by any thread. The tree ends up
+ * with the same counts whatever order its kmers are inserted in.
+ */
+void tree_count_worker(segment_source_t * const source,
+		kmer_scan_t * const scan) {
+	segment_cursor_t cursor = { NULL, 0 };
+	const segment_t *segment;
+	while (next_segment(source, &cursor, &segment)) {
+		scan_new_record(scan);
+		scan->recordOffset = segment->offset;
+		unsigned long long base = 0;
+		const unsigned long long preroll = segment->preroll;
+		for_each_record_base(segment->record, [&](int codedBase) {
+			if (base++ < preroll) {
+				scan_shift(scan, codedBase);
+			} else {
+				scan_base(scan, codedBase);
+			}
+		});
+	}
+}
+/*
+ * This function conforms to the description of this program above by reading a text file and creating a histogram of sequences of length k.
+ * config.threads threads insert into the one tree, or a single one if positionalTable is not NULL,
+ * in which case every kmer is also counted by its offset from the start of its record.
+ */
+node_t * findKmer(node_t * headNode, unsigned long long * const baseCounter,
+		statistics_t * const baseStatistics,
+		unsigned long long * const TotalNumSequencesN,
+		positional_table_t * const positionalTable,
+		scan_summary_t * const summary) {
+
+	const int threads = positionalTable ? 1 : config.threads;
+	//the head is made before the threads start so they never race to make it.
+	if (!headNode) {
+		headNode = node_create('H');
+	}
+
+	//what each thread counted, summed once all of them are done.
+	vector<kmer_scan_t> scans(threads);
+	vector<statistics_t> threadStatistics(4 * threads);
+	vector<unsigned long long> threadCounters(3 * threads, 0);
+	for (int t = 0; t < threads; t++) {
+		kmer_scan_t &scan = scans[t];
+		scan.headNode = headNode;
+		scan.kmer = (int*) allocate_array(config.k, sizeof(int));
+		scan.seqSize = 0;
+		scan.recordOffset = 0;
+		scan.packedKmer = 0;
+		scan.packedMask = (((kmer_code_t) 1) << (2 * config.k)) - 1;
+		scan.baseCounter = &threadCounters[3 * t];
+		scan.TotalNumSequencesN = &threadCounters[3 * t + 1];
+		scan.maskedKmers = &threadCounters[3 * t + 2];
+		scan.baseStatistics = &threadStatistics[4 * t];
+		memset(scan.baseStatistics, 0, 4 * sizeof(statistics_t));
+		scan.positionalTable = positionalTable;
+		scan.masking = masking_enabled();
+		complexity_reset(&scan.complexity);
+
+		//fill array by inserting a negative one and testing the functionality of the shift function.
+		for (int i = 0; i < config.k; i++) {
+			shift_left_and_insert(scan.kmer, -1);
+		}
+	}
+
+	segment_source_t source;
+	segment_source_open(&source, summary);
+	vector<thread> workers;
+	for (int t = 0; t < threads; t++) {
+		workers.push_back(thread(tree_count_worker, &source, &scans[t]));
+	}
+	for (int t = 0; t < threads; t++) {
+		workers[t].join();
+		*baseCounter += threadCounters[3 * t];
+		*TotalNumSequencesN += threadCounters[3 * t + 1];
+		summary->maskedKmers += threadCounters[3 * t + 2];
+		for (int b = 0; b < 4; b++) {
+			baseStatistics[b].Count += scans[t].baseStatistics[b].Count;
+		}
+		free(scans[t].kmer);
+	}
+	segment_source_close(&source);
+
+	//a file without a single base never had a head, like the single threaded scan.
+	if (!headNode->nextNodePtr[0] && !headNode->nextNodePtr[1]
+			&& !headNode->nextNodePtr[2] && !headNode->nextNodePtr[3]) {
+		free(headNode);
+		nodeCounter--;
+		headNode = NULL;
+	}
+	return headNode;
+}
+/*
+ * Writes the positional histogram as a binary matrix, one row of bin counts per kmer:
+ *   char magic[8]                      "FKPOS01"
+ *   uint32 k, uint32 binSize
+ *   uint64 numKmers, uint64 numBins
+ *   uint32 counts[numKmers][numBins]
+ * and a csv of positional enrichment for every kmer that was found.
+ * The enrichment compares the bins of a kmer against the bins of all kmers together:
+ * a chi square over all bins, and the bin with the highest binomial Z score.
+ * Z filtering applies to that peak Z score.
+ */
+void write_positional_histogram(const positional_table_t * const table) {
+	char *matrix_file_name = build_out_file_name("mer_Positional_Of_", ".bin");
+	char *enrichment_file_name = build_out_file_name(
+			"mer_Positional_Enrichment_Of_", ".csv");
+	FILE *matrix_file_pointer = fopen(matrix_file_name, "wb");
+	FILE *enrichment_file_pointer = fopen(enrichment_file_name, "w");
+	if (!matrix_file_pointer || !enrichment_file_pointer) {
+		fprintf(stderr,
+				"Positional out file failed to open\nFile MUST be in current directory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	const char magic[8] = "FKPOS01";
+	unsigned int header[2] = { (unsigned int) config.k,
+			(unsigned int) table->binSize };
+	unsigned long long sizes[2] = { table->numKmers, table->numBins };
+	write_or_die(magic, sizeof(char), 8, matrix_file_pointer);
+	write_or_die(header, sizeof(unsigned int), 2, matrix_file_pointer);
+	write_or_die(sizes, sizeof(unsigned long long), 2, matrix_file_pointer);
+
+	//number of kmers that started in each bin, the background to compare every kmer against.
+	vector<unsigned long long> binTotals(table->numBins, 0);
+	unsigned long long grandTotal = 0;
+	int occupiedBins = 0;
+	for (unsigned long long bin = 0; bin < table->numBins; bin++) {
+		for (kmer_code_t code = 0; code < table->numKmers; code++) {
+			binTotals[bin] += table->counts[bin * table->numKmers + code];
+		}
+		grandTotal += binTotals[bin];
+		if (binTotals[bin]) {
+			occupiedBins++;
+		}
+	}
+
+	fprintf(enrichment_file_pointer, POSITIONAL_FILE_COLUMN_HEADERS);
+	vector<unsigned int> row(table->numBins);
+	for (kmer_code_t code = 0; code < table->numKmers; code++) {
+		unsigned long long frequency = 0;
+		for (unsigned long long bin = 0; bin < table->numBins; bin++) {
+			row[bin] = table->counts[bin * table->numKmers + code];
+			frequency += row[bin];
+		}
+		write_or_die(row.data(), sizeof(unsigned int), row.size(),
+				matrix_file_pointer);
+
+		if (frequency == 0) {
+			continue;
+		}
+
+		long double chiSquare = 0;
+		long double peakZ = -INFINITY;
+		long double peakExpected = 0;
+		unsigned long long peakBin = 0;
+		bool peakSeen = false; //whether any occupied bin was scored.
+		for (unsigned long long bin = 0; bin < table->numBins; bin++) {
+			if (binTotals[bin] == 0) {
+				continue;
+			}
+			long double binProportion = (long double) binTotals[bin]
+					/ grandTotal;
+			long double expected = frequency * binProportion;
+			chiSquare += (row[bin] - expected) * (row[bin] - expected)
+					/ expected;
+
+			long double standardDev = sqrt(expected * (1 - binProportion));
+			long double z = standardDev > 0 ?
+					(row[bin] - expected) / standardDev : 0;
+			if (!peakSeen || z > peakZ) {
+				peakZ = z;
+				peakExpected = expected;
+				peakBin = bin;
+				peakSeen = true;
+			}
+		}
+
+		if (!peakSeen) {
+			continue;
+		}
+
+		if (config.zThresholdEnable > 0 && fabsl(peakZ) < config.zThreshold) {
+			continue;
+		}
+
+		fputc('\n', enrichment_file_pointer);
+		for (int i = config.k - 1; i >= 0; i--) {
+			fputc(int2base((code >> (2 * i)) & 3), enrichment_file_pointer);
+		}
+		fprintf(enrichment_file_pointer, ", %llu, %LE, %d, %llu, %u, %LE, %LE",
+				frequency, chiSquare, occupiedBins - 1,
+				peakBin * table->binSize, row[peakBin], peakExpected, peakZ);
+	}
+
+	fclose(matrix_file_pointer);
+	fclose(enrichment_file_pointer);
+	fprintf(stdout,
+			"Positional histogram of %llu bins can be found as: \n    %s\n    %s\n",
+			table->numBins, matrix_file_name, enrichment_file_name);
+	free(matrix_file_name);
+	free(enrichment_file_name);
+}
+/*
+ * A contiguous run of records whose profiles are computed by one worker.
+ * Blocks are handed out dynamically but written out in record order.
+ */
+struct profile_block_t {
+	size_t firstRecord; //first record of the block.
+	size_t lastRecord; //one past the last record of the block.
+	vector<unsigned long long> recordNonZero; //number of distinct kmers in each record.
+	vector<kmer_code_t> codes; //distinct kmers of each record in ascending order.
+	vector<unsigned int> counts; //number of times each of those kmers was found in its record.
+};
+/*
+ * Worker for per_record_profiles().
+ * Claims blocks until there are none left. The scratch array of kmer codes is
+ * reused for every record this worker handles so memory is only grown, never reallocated per record.
+ */
+void profile_worker(const vector<record_t> * const records,
+		vector<profile_block_t> * const blocks,
+		atomic<size_t> * const nextBlock) {
+	vector<kmer_code_t> scratch;
+	size_t b;
+
+	while ((b = (*nextBlock)++) < blocks->size()) {
+		profile_block_t &block = (*blocks)[b];
+
+		for (size_t r = block.firstRecord; r < block.lastRecord; r++) {
+			scratch.clear();
+			scan_record_kmers((*records)[r], config.k,
+					[&scratch](kmer_code_t code, size_t, bool masked, kmer_code_t) {
+						if (!masked) {
+							scratch.push_back(code);
+						}
+					});
+			sort(scratch.begin(), scratch.end());
+
+			size_t nonZero = 0;
+			for (size_t i = 0; i < scratch.size();) {
+				size_t j = i + 1;
+				while (j < scratch.size() && scratch[j] == scratch[i]) {
+					j++;
+				}
+				block.codes.push_back(scratch[i]);
+				block.counts.push_back(j - i);
+				nonZero++;
+				i = j;
+			}
+			block.recordNonZero.push_back(nonZero);
+		}
+	}
+}
+/*
+ * Per record mode. Every record in the sequence file gets its own sparse kmer count vector.
+ * Records are counted in parallel and written to the out file in CSR form:
+ *   char magic[8]                      "FKCSR01"
+ *   uint32 k, uint32 reserved
+ *   uint64 numRecords, uint64 numNonZero
+ *   uint64 offsets[numRecords + 1]     kmers of record r are at [offsets[r], offsets[r + 1])
+ *   uint64 kmerCodes[numNonZero]       packed kmer codes, ascending within a record
+ *   uint32 counts[numNonZero]
+ *   numRecords times: uint32 idLength followed by the identifier text
+ */
+void per_record_profiles() {
+	size_t length = 0;
+	char *buffer = NULL;
+	vector<record_t> records;
+
+	if (config.packedCache) {
+		index_packed_records(config.packedCache, records);
+		length = config.packedCache->header->numBases;
+	} else {
+		buffer = load_sequence_file(&length);
+		index_records(buffer, length, records);
+	}
+	fprintf(stdout, "Found %lu records.\n", (unsigned long) records.size());
+
+	if (config.dedupEnable > 0) {
+		record_hash_set_t recordHashes;
+		size_t unique = 0;
+		for (size_t r = 0; r < records.size(); r++) {
+			if (recordHashes.insert(hash_record(records[r])).second) {
+				records[unique++] = records[r];
+			}
+		}
+		fprintf(stdout, "Skipped %lu duplicate records out of %lu.\n",
+				(unsigned long) (records.size() - unique),
+				(unsigned long) records.size());
+		records.resize(unique);
+	}
+
+	//cut the records into more blocks than threads so a few long records don't leave threads idle.
+	vector<profile_block_t> blocks;
+	const size_t targetBlockBytes = length / (config.threads * 16) + 1;
+	size_t r = 0;
+	while (r < records.size()) {
+		profile_block_t block;
+		block.firstRecord = r;
+		size_t blockBytes = 0;
+		while (r < records.size() && blockBytes < targetBlockBytes) {
+			blockBytes += records[r].sequenceLength;
+			r++;
+		}
+		block.lastRecord = r;
+		blocks.push_back(block);
+	}
+
+	atomic<size_t> nextBlock(0);
+	vector<thread> workers;
+	for (int t = 0; t < config.threads; t++) {
+		workers.push_back(
+				thread(profile_worker, &records, &blocks, &nextBlock));
+	}
+	for (size_t t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+
+	//record offsets into the kmer arrays.
+	vector<unsigned long long> offsets(1, 0);
+	for (size_t b = 0; b < blocks.size(); b++) {
+		for (size_t i = 0; i < blocks[b].recordNonZero.size(); i++) {
+			offsets.push_back(offsets.back() + blocks[b].recordNonZero[i]);
+		}
+	}
+
+	const char magic[8] = "FKCSR01";
+	unsigned int header[2] = { (unsigned int) config.k, 0 };
+	unsigned long long sizes[2] = { records.size(), offsets.back() };
+	write_or_die(magic, sizeof(char), 8, config.out_file_pointer);
+	write_or_die(header, sizeof(unsigned int), 2, config.out_file_pointer);
+	write_or_die(sizes, sizeof(unsigned long long), 2,
+			config.out_file_pointer);
+	write_or_die(&offsets[0], sizeof(unsigned long long), offsets.size(),
+			config.out_file_pointer);
+	for (size_t b = 0; b < blocks.size(); b++) {
+		write_or_die(blocks[b].codes.data(), sizeof(kmer_code_t),
+				blocks[b].codes.size(), config.out_file_pointer);
+	}
+	for (size_t b = 0; b < blocks.size(); b++) {
+		write_or_die(blocks[b].counts.data(), sizeof(unsigned int),
+				blocks[b].counts.size(), config.out_file_pointer);
+	}
+	for (size_t i = 0; i < records.size(); i++) {
+		unsigned int idLength = records[i].idLength;
+		write_or_die(&idLength, sizeof(unsigned int), 1,
+				config.out_file_pointer);
+		write_or_die(records[i].id, sizeof(char), idLength,
+				config.out_file_pointer);
+	}
+
+	fprintf(stdout,
+			"Wrote %llu nonzero kmer counts for %llu records using %d threads.\n",
+			offsets.back(), (unsigned long long) records.size(),
+			config.threads);
+
+	free(buffer);
+}
+/*
+ * One occurrence of a kmer for --index, the record it is in and the offset of its first base.
+ */
+struct index_posting_t {
+	kmer_code_t code;
+	unsigned int record;
+	unsigned int offset;
+};
+/* One kmer of the index directory, its postings are numPostings varint pairs starting at postingsStart. */
+struct index_kmer_t {
+	kmer_code_t code;
+	unsigned long long postingsStart; //byte offset into the postings.
+	unsigned long long numPostings;
+};
+#define INDEX_FILE_MAGIC "FKIDX01"
+#define INDEX_BUCKET_BITS 9 //512 temporary file buckets of postings, as many as the disk engine opens.
+#define INDEX_SPILL_POSTINGS 1024 //postings a thread gathers for a bucket before appending them to its file.
+struct index_header_t {
+	char magic[8];
+	unsigned int k;
+	unsigned int reserved;
+	unsigned long long numRecords;
+	unsigned long long numKmers;
+	unsigned long long numPostings;
+	unsigned long long postingBytes;
+	unsigned long long idBytes;
+};
+static inline void append_varint(vector<unsigned char> &bytes,
+		unsigned long long value) {
+	while (value >= 0x80) {
+		bytes.push_back((unsigned char) (value | 0x80));
+		value >>= 7;
+	}
+	bytes.push_back((unsigned char) value);
+}
+static inline unsigned long long read_varint(const unsigned char ** const bytes) {
+	unsigned long long value = 0;
+	int shift = 0;
+	while (**bytes & 0x80) {
+		value |= (unsigned long long) (*(*bytes)++ & 0x7f) << shift;
+		shift += 7;
+	}
+	value |= (unsigned long long) (*(*bytes)++) << shift;
+	return value;
+}
+/*
+ * A bucket of --index postings, those of every kmer that starts with the same few bases, in a
+ * temporary file like a bucket of the disk engine. Threads append to it unsorted.
+ */
+struct index_bucket_t {
+	mutex lock;
+	FILE *file;
+	unsigned long long numPostings;
+};
+/* The directory entries and varint postings of a sorted bucket, postingsStart counted from its first byte. */
+struct index_bucket_bytes_t {
+	vector<index_kmer_t> directory;
+	vector<unsigned char> postingBytes;
+};
+/* Appends the postings a thread gathered for a bucket to its temporary file. */
+void spill_index_postings(index_bucket_t &bucket,
+		vector<index_posting_t> &postings) {
+	lock_guard<mutex> guard(bucket.lock);
+	write_or_die(postings.data(), sizeof(index_posting_t), postings.size(),
+			bucket.file);
+	bucket.numPostings += postings.size();
+	postings.clear();
+}
+/*
+ * Worker for write_kmer_index(). Lists the postings of the blocks of records it claims and
+ * spills them to the buckets of their leading bases INDEX_SPILL_POSTINGS at a time.
+ */
+void index_worker(const vector<record_t> * const records,
+		const vector<bool> * const skipRecord,
+		const vector<size_t> * const blockStarts,
+		index_bucket_t * const buckets, const int numBuckets,
+		const int bucketShift, atomic<size_t> * const nextBlock) {
+	vector<vector<index_posting_t> > pending(numBuckets);
+	size_t b;
+	while ((b = (*nextBlock)++) + 1 < blockStarts->size()) {
+		for (size_t r = (*blockStarts)[b]; r < (*blockStarts)[b + 1]; r++) {
+			if ((*skipRecord)[r]) {
+				continue;
+			}
+			scan_record_kmers((*records)[r], config.k,
+					[&](kmer_code_t code, size_t offset, bool masked,
+							kmer_code_t) {
+						if (masked || (config.zThresholdEnable > 0
+								&& !binary_search(indexKmers.begin(),
+										indexKmers.end(), code))) {
+							return;
+						}
+						vector<index_posting_t> &postings =
+								pending[code >> bucketShift];
+						index_posting_t posting = { code, (unsigned int) r,
+							(unsigned int) offset };
+						postings.push_back(posting);
+						if (postings.size() == INDEX_SPILL_POSTINGS) {
+							spill_index_postings(buckets[code >> bucketShift],
+									postings);
+						}
+					});
+		}
+	}
+	for (int p = 0; p < numBuckets; p++) {
+		if (!pending[p].empty()) {
+			spill_index_postings(buckets[p], pending[p]);
+		}
+	}
+}
+/*
+ * Worker for write_kmer_index(). Reads the buckets it claims of firstBucket up to lastBucket back,
+ * sorts them by kmer, record and offset and encodes them, so only these buckets are in memory.
+ */
+void index_sort_worker(index_bucket_t * const buckets, const size_t firstBucket,
+		const size_t lastBucket, vector<index_bucket_bytes_t> * const encoded,
+		atomic<size_t> * const nextBucket) {
+	size_t b;
+	while ((b = (*nextBucket)++) < lastBucket) {
+		index_bucket_t &bucket = buckets[b];
+		vector<index_posting_t> postings(bucket.numPostings);
+		rewind(bucket.file);
+		if (fread(postings.data(), sizeof(index_posting_t), postings.size(),
+				bucket.file) != postings.size()) {
+			fprintf(stderr, "Temporary file %lu of the index failed to read.\n",
+					(unsigned long) b);
+			exit(EXIT_FAILURE);
+		}
+		fclose(bucket.file);
+		bucket.file = NULL;
+		sort(postings.begin(), postings.end(),
+				[](const index_posting_t &a, const index_posting_t &b) {
+					if (a.code != b.code) {
+						return a.code < b.code;
+					}
+					if (a.record != b.record) {
+						return a.record < b.record;
+					}
+					return a.offset < b.offset;
+				});
+
+		vector<index_kmer_t> &directory = (*encoded)[b - firstBucket].directory;
+		vector<unsigned char> &postingBytes =
+				(*encoded)[b - firstBucket].postingBytes;
+		unsigned long long previousRecord = 0;
+		unsigned long long previousOffset = 0;
+		for (size_t i = 0; i < postings.size(); i++) {
+			const index_posting_t &posting = postings[i];
+			if (directory.empty() || directory.back().code != posting.code) {
+				index_kmer_t kmer = { posting.code, postingBytes.size(), 0 };
+				directory.push_back(kmer);
+				previousRecord = 0;
+				previousOffset = 0;
+			}
+			directory.back().numPostings++;
+			append_varint(postingBytes, posting.record - previousRecord);
+			append_varint(postingBytes,
+					posting.record == previousRecord ?
+							posting.offset - previousOffset : posting.offset);
+			previousRecord = posting.record;
+			previousOffset = posting.offset;
+		}
+	}
+}
+/* Appends the whole of a temporary file to the out file. */
+void copy_temporary_file(FILE * const from, FILE * const to) {
+	vector<char> chunk(INPUT_CHUNK_SIZE);
+	size_t read;
+	rewind(from);
+	while ((read = fread(chunk.data(), sizeof(char), chunk.size(), from)) > 0) {
+		write_or_die(chunk.data(), sizeof(char), read, to);
+	}
+	if (ferror(from)) {
+		fprintf(stderr, "A temporary file of the index failed to read.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+/*
+ * --index. Writes an inverted index of where every kmer of the histogram, or with -z every kmer
+ * that passed the filter, occurs, so "findKmer query" can list the hits of a motif without
+ * another scan of the sequence file. The records are scanned again in parallel, the postings
+ * spilled to temporary file buckets of their leading bases and sorted a bucket per thread, so only
+ * those buckets are in memory, not every posting:
+ *   index_header_t                     magic "FKIDX01"
+ *   index_kmer_t directory[numKmers]   ascending codes
+ *   uint64 idOffsets[numRecords + 1]   identifier of record r is [idOffsets[r], idOffsets[r + 1]) of the text
+ *   postingBytes of postings
+ *   idBytes of identifier text
+ * The postings of a kmer are ascending (record, offset) pairs written as varints, the record as
+ * the difference from the record before, the offset as the difference from the offset before
+ * when the record is the same, or the offset itself in a new record. Offsets exclude newlines.
+ */
+void write_kmer_index() {
+	size_t length = 0;
+	char *buffer = NULL;
+	vector<record_t> records;
+
+	if (config.packedCache) {
+		index_packed_records(config.packedCache, records);
+		length = config.packedCache->header->numBases;
+	} else {
+		buffer = load_sequence_file(&length);
+		index_records(buffer, length, records);
+	}
+	if (records.size() > 0xffffffffULL) {
+		fprintf(stderr, "--index is limited to 4294967295 records.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	vector<bool> skipRecord(records.size(), false);
+	record_hash_set_t recordHashes;
+	for (size_t r = 0; r < records.size(); r++) {
+		if (records[r].sequenceLength > 0xffffffffULL) {
+			fprintf(stderr,
+					"--index is limited to records of less than 4294967296 bases.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (config.dedupEnable > 0) {
+			skipRecord[r] = !recordHashes.insert(hash_record(records[r])).second;
+		}
+	}
+
+	//the same blocks per_record_profiles() hands out.
+	vector<size_t> blockStarts(1, 0);
+	const size_t targetBlockBytes = length / (config.threads * 16) + 1;
+	size_t blockBytes = 0;
+	for (size_t r = 0; r < records.size(); r++) {
+		blockBytes += records[r].sequenceLength;
+		if (blockBytes >= targetBlockBytes) {
+			blockStarts.push_back(r + 1);
+			blockBytes = 0;
+		}
+	}
+	if (blockStarts.back() != records.size()) {
+		blockStarts.push_back(records.size());
+	}
+
+	//bucket the postings by their leading bases in temporary files, as the disk engine does.
+	const int bucketBits = min(2 * config.k, INDEX_BUCKET_BITS);
+	const int bucketShift = 2 * config.k - bucketBits;
+	const int numBuckets = 1 << bucketBits;
+	index_bucket_t *buckets = new index_bucket_t[numBuckets];
+	for (int p = 0; p < numBuckets; p++) {
+		buckets[p].numPostings = 0;
+		if ((buckets[p].file = tmpfile()) == NULL) {
+			fprintf(stderr, "Temporary file %d of the index failed to open.\n",
+					p);
+			exit(EXIT_FAILURE);
+		}
+	}
+	atomic<size_t> nextBlock(0);
+	vector<thread> workers;
+	for (int t = 0; t < config.threads; t++) {
+		workers.push_back(
+				thread(index_worker, &records, &skipRecord, &blockStarts,
+						buckets, numBuckets, bucketShift, &nextBlock));
+	}
+	for (size_t t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+
+	//sort and encode config.threads buckets at a time, appending them in order.
+	FILE *directoryFile = tmpfile();
+	FILE *postingsFile = tmpfile();
+	if (!directoryFile || !postingsFile) {
+		fprintf(stderr, "Temporary files of the index failed to open.\n");
+		exit(EXIT_FAILURE);
+	}
+	unsigned long long numKmers = 0;
+	unsigned long long numPostings = 0;
+	unsigned long long postingBytes = 0;
+	for (int first = 0; first < numBuckets; first += config.threads) {
+		const int last = min(numBuckets, first + config.threads);
+		vector<index_bucket_bytes_t> encoded(last - first);
+		atomic<size_t> nextBucket(first);
+		workers.clear();
+		for (int t = 0; t < last - first; t++) {
+			workers.push_back(
+					thread(index_sort_worker, buckets, (size_t) first,
+							(size_t) last, &encoded, &nextBucket));
+		}
+		for (size_t t = 0; t < workers.size(); t++) {
+			workers[t].join();
+		}
+		for (int p = first; p < last; p++) {
+			vector<index_kmer_t> &directory = encoded[p - first].directory;
+			for (size_t i = 0; i < directory.size(); i++) {
+				directory[i].postingsStart += postingBytes;
+			}
+			write_or_die(directory.data(), sizeof(index_kmer_t),
+					directory.size(), directoryFile);
+			write_or_die(encoded[p - first].postingBytes.data(),
+					sizeof(unsigned char), encoded[p - first].postingBytes.size(),
+					postingsFile);
+			numKmers += directory.size();
+			numPostings += buckets[p].numPostings;
+			postingBytes += encoded[p - first].postingBytes.size();
+		}
+	}
+	delete[] buckets;
+
+	vector<unsigned long long> idOffsets(1, 0);
+	for (size_t r = 0; r < records.size(); r++) {
+		idOffsets.push_back(idOffsets.back() + records[r].idLength);
+	}
+
+	char *index_file_name = build_out_file_name("mer_Index_Of_", ".idx");
+	FILE *index_file_pointer = fopen(index_file_name, "wb");
+	if (!index_file_pointer) {
+		fprintf(stderr,
+				"Index out file failed to open\nFile MUST be in current directory.\n");
+		exit(EXIT_FAILURE);
+	}
+	index_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_FILE_MAGIC, 8);
+	header.k = config.k;
+	header.numRecords = records.size();
+	header.numKmers = numKmers;
+	header.numPostings = numPostings;
+	header.postingBytes = postingBytes;
+	header.idBytes = idOffsets.back();
+	write_or_die(&header, sizeof(header), 1, index_file_pointer);
+	copy_temporary_file(directoryFile, index_file_pointer);
+	fclose(directoryFile);
+	write_or_die(idOffsets.data(), sizeof(unsigned long long),
+			idOffsets.size(), index_file_pointer);
+	copy_temporary_file(postingsFile, index_file_pointer);
+	fclose(postingsFile);
+	for (size_t r = 0; r < records.size(); r++) {
+		write_or_die(records[r].id, sizeof(char), records[r].idLength,
+				index_file_pointer);
+	}
+	if (fclose(index_file_pointer) == EOF) {
+		fprintf(stderr, "Index out file close error!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(stdout,
+			"Indexed %llu occurrences of %llu kmers in %0.1f mibibytes of postings.\n",
+			numPostings, numKmers, postingBytes / (double) (1024 * 1024));
+	fprintf(stdout, "Your index can be found in the current directory as: \n    %s\n",
+			index_file_name);
+
+	free(index_file_name);
+	free(buffer);
+}
+/*
+ * "findKmer query <index_file> <kmer> ...". Maps an index written by --index and prints
+ * a line of kmer, record identifier and offset for every hit of every kmer given.
+ * Only the directory entries and postings of those kmers are read from the map.
+ */
+int query_index(int argc, char **argv) {
+	if (argc < 4) {
+		fprintf(stderr,
+				"Usage is \"findKmer query 8mer_Index_Of_genome.fa.idx GATTACAA\".\n");
+		return EXIT_FAILURE;
+	}
+	int fd = open(argv[2], O_RDONLY);
+	struct stat fileStat;
+	if (fd < 0 || fstat(fd, &fileStat) != 0
+			|| (size_t) fileStat.st_size < sizeof(index_header_t)) {
+		fprintf(stderr, "%s is not an index file.\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+	void *map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Unable to map index %s\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+	madvise(map, fileStat.st_size, MADV_RANDOM);
+
+	const char *base = (const char*) map;
+	const index_header_t *header = (const index_header_t*) base;
+	const index_kmer_t *directory = (const index_kmer_t*) (base
+			+ sizeof(index_header_t));
+	const unsigned long long *idOffsets =
+			(const unsigned long long*) (directory + header->numKmers);
+	const unsigned char *postings =
+			(const unsigned char*) (idOffsets + header->numRecords + 1);
+	const char *ids = (const char*) (postings + header->postingBytes);
+	if (memcmp(header->magic, INDEX_FILE_MAGIC, 8) != 0
+			|| ids + header->idBytes > base + fileStat.st_size) {
+		fprintf(stderr, "%s is not an index file or is truncated.\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	for (int i = 3; i < argc; i++) {
+		const char *kmer = argv[i];
+		kmer_code_t code = 0;
+		unsigned int bases = 0;
+		bool valid = true;
+		for (const char *c = kmer; valid && *c; c++) {
+			//the gaps of a --pattern kmer, as the histogram writes it.
+			if (*c == '.') {
+				continue;
+			}
+			const int codedBase = baseCodeTable[(unsigned char) *c];
+			valid = codedBase >= 0;
+			code = (code << 2) | (codedBase & 3);
+			bases++;
+		}
+		if (!valid || bases != header->k) {
+			fprintf(stderr, "%s is not a %umer of A, C, G and T.\n", kmer,
+					header->k);
+			continue;
+		}
+
+		const index_kmer_t *entry = lower_bound(directory,
+				directory + header->numKmers, code,
+				[](const index_kmer_t &a, const kmer_code_t b) {
+					return a.code < b;
+				});
+		if (entry == directory + header->numKmers || entry->code != code) {
+			continue;
+		}
+		const unsigned char *posting = postings + entry->postingsStart;
+		unsigned long long record = 0;
+		unsigned long long offset = 0;
+		for (unsigned long long p = 0; p < entry->numPostings; p++) {
+			const unsigned long long recordDelta = read_varint(&posting);
+			const unsigned long long offsetValue = read_varint(&posting);
+			record += recordDelta;
+			offset = recordDelta ? offsetValue : offset + offsetValue;
+			fprintf(stdout, "%s\t%.*s\t%llu\n", kmer,
+					(int) (idOffsets[record + 1] - idOffsets[record]),
+					ids + idOffsets[record], offset);
+		}
+	}
+
+	munmap(map, fileStat.st_size);
+	return EXIT_SUCCESS;
+}
+/*
+ * Counts that no longer fit in the small counters of a count table.
+ * Sharded by kmer so threads spilling different kmers rarely wait on each other.
+ */
+#define OVERFLOW_SHARDS 64
+struct overflow_map_t {
+	mutex locks[OVERFLOW_SHARDS];
+	unordered_map<kmer_code_t, unsigned long long> counts[OVERFLOW_SHARDS];
+};
+void overflow_map_add(overflow_map_t * const overflow, const kmer_code_t code,
+		const unsigned long long n) {
+	const int shard = fmix64(code) % OVERFLOW_SHARDS;
+	lock_guard<mutex> guard(overflow->locks[shard]);
+	overflow->counts[shard][code] += n;
+}
+unsigned long long overflow_map_get(const overflow_map_t * const overflow,
+		const kmer_code_t code) {
+	const int shard = fmix64(code) % OVERFLOW_SHARDS;
+	unordered_map<kmer_code_t, unsigned long long>::const_iterator found =
+			overflow->counts[shard].find(code);
+	return found == overflow->counts[shard].end() ? 0 : found->second;
+}
+unsigned long long overflow_map_size(const overflow_map_t * const overflow) {
+	unsigned long long size = 0;
+	for (int shard = 0; shard < OVERFLOW_SHARDS; shard++) {
+		size += overflow->counts[shard].size();
+	}
+	return size;
+}
+//A kmer and how often it was seen, the bucket entries of the sort and disk engines.
+struct kmer_count_t {
+	kmer_code_t code;
+	unsigned long long count;
+};
+/*
+ * A bucket of the sort and disk engines, all kmers that start with the same few bases.
+ * Workers append runs from their combine buffers, then count_table_finish() sorts and
+ * merges each bucket so it holds every kmer once, in ascending order.
+ */
+struct kmer_partition_t {
+	mutex lock;
+	vector<kmer_count_t> counts; //sort engine.
+	FILE *file; //disk engine, a temporary file of kmer_count_t.
+	unsigned long long distinct;
+};
+/*
+ * Count table of the dense and hash engines. One table is shared by every worker thread
+ * and counters are incremented with relaxed atomics, so memory stays at a single table
+ * no matter how many threads count into it.
+ * The hash engine is open addressing with linear probing. A key slot holds code + 1 so 0 marks it empty.
+ * It doubles with a rehash once more than half of its slots hold a kmer, see count_table_grow().
+ * Counters are 8, 16 or 32 bits. A counter that reaches its maximum stays there and the rest
+ * of that kmer's count goes to the overflow map, so a counter can never roll over.
+ */
+struct count_table_t {
+	int engine; //ENGINE_DENSE or ENGINE_HASH.
+	int k;
+	int counterBits; //8, 16 or 32.
+	unsigned long long numSlots; //4^k for dense, a power of two for hash.
+	void *counts; //numSlots counters of counterBits each.
+	kmer_code_t *keys; //hash engine only, a full code per slot, so narrow counters save little of a hash slot.
+	unsigned long long usedSlots; //hash engine, slots holding a kmer.
+	int inserters; //hash engine, threads adding a batch right now.
+	bool growing; //hash engine, set while count_table_grow() moves the slots.
+	mutex growLock;
+	overflow_map_t *overflow; //full count minus the saturated counter, for kmers whose counter saturated.
+	kmer_partition_t *partitions; //sort and disk engines only, they have no slots.
+	int numPartitions;
+	int partitionShift; //code >> partitionShift is the partition of a kmer.
+};
+/*
+ * Creates an empty table. maxDistinct is the expected number of different kmers, the hash engine
+ * starts at twice that and grows if there are more. It has at least 4 batches of slots for every
+ * thread, so the batches added while a thread waits to grow it can never fill it.
+ */
+count_table_t *count_table_create(const int engine, const int k,
+		const int counterBits, const unsigned long long maxDistinct) {
+	count_table_t *table = new count_table_t;
+	table->engine = engine;
+	table->k = k;
+	table->counterBits = counterBits;
+	table->keys = NULL;
+	table->usedSlots = 0;
+	table->inserters = 0;
+	table->growing = false;
+	table->overflow = new overflow_map_t;
+	table->partitions = NULL;
+	table->numPartitions = 0;
+
+	if (engine == ENGINE_SORT || engine == ENGINE_DISK) {
+		table->numSlots = 0;
+		table->counts = NULL;
+		table->numPartitions = config.partitions;
+		table->partitionShift = 2 * k;
+		for (int p = config.partitions; p > 1; p >>= 1) {
+			table->partitionShift--;
+		}
+		table->partitions = new kmer_partition_t[table->numPartitions];
+		for (int p = 0; p < table->numPartitions; p++) {
+			table->partitions[p].file = NULL;
+			table->partitions[p].distinct = 0;
+			if (engine == ENGINE_DISK
+					&& (table->partitions[p].file = tmpfile()) == NULL) {
+				fprintf(stderr,
+						"Temporary file %d of the disk engine failed to open.\n",
+						p);
+				exit(EXIT_FAILURE);
+			}
+		}
+		fprintf(stdout, "Counting into %d %s buckets.\n",
+				table->numPartitions,
+				engine == ENGINE_DISK ? "temporary file" : "in memory");
+		return table;
+	}
+
+	if (engine == ENGINE_DENSE) {
+		table->numSlots = ((unsigned long long) 1) << (2 * k);
+	} else {
+		table->numSlots = 1;
+		while (table->numSlots < 2 * maxDistinct
+				|| table->numSlots
+						< 4ULL * config.threads * MAX_INSERT_BATCH) {
+			table->numSlots <<= 1;
+		}
+		table->keys = (kmer_code_t*) allocate_count_table(table->numSlots,
+				sizeof(kmer_code_t));
+	}
+	table->counts = allocate_count_table(table->numSlots, counterBits / 8);
+
+	unsigned long long bytes = table->numSlots
+			* (counterBits / 8 + (table->keys ? sizeof(kmer_code_t) : 0));
+	fprintf(stdout,
+			"Allocated %llu slot %s table of %d bit counters, %0.1f mibibytes.\n",
+			table->numSlots, engine == ENGINE_DENSE ? "dense" : "hash",
+			counterBits, bytes / (double) (1024 * 1024));
+	return table;
+}
+void count_table_destroy(count_table_t * const table) {
+	for (int p = 0; p < table->numPartitions; p++) {
+		if (table->partitions[p].file) {
+			fclose(table->partitions[p].file);
+		}
+	}
+	delete[] table->partitions;
+	deallocate_count_table(table->counts, table->numSlots,
+			table->counterBits / 8);
+	deallocate_count_table(table->keys, table->numSlots, sizeof(kmer_code_t));
+	delete table->overflow;
+	delete table;
+}
+/*
+ * The shard of a kmer for --shard. Uses the high half of the hash so that the kmers of one
+ * shard still spread over every slot of a hash table, which uses the low bits.
+ */
+static inline int shard_of(const kmer_code_t code) {
+	return ((fmix64(code) >> 32) * config.shardCount) >> 32;
+}
+/*
+ * Adds as much of n to a counter as fits before it saturates and returns what did not fit.
+ */
+template<typename counter_t>
+static inline unsigned long long saturating_add(counter_t * const counter,
+		const unsigned long long n) {
+	const counter_t saturated = (counter_t) ~(counter_t) 0;
+	counter_t old = __atomic_load_n(counter, __ATOMIC_RELAXED);
+	counter_t add;
+	do {
+		if (old == saturated) {
+			return n;
+		}
+		add = (counter_t) min((unsigned long long) (saturated - old), n);
+	} while (!__atomic_compare_exchange_n(counter, &old, (counter_t) (old + add),
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return n - add;
+}
+static inline void count_table_increment(count_table_t * const table,
+		const unsigned long long slot, const kmer_code_t code,
+		const unsigned long long n) {
+	unsigned long long spilled;
+	if (table->counterBits == 8) {
+		spilled = saturating_add(((unsigned char*) table->counts) + slot, n);
+	} else if (table->counterBits == 16) {
+		spilled = saturating_add(((unsigned short*) table->counts) + slot, n);
+	} else {
+		spilled = saturating_add(((unsigned int*) table->counts) + slot, n);
+	}
+	if (spilled) {
+		overflow_map_add(table->overflow, code, spilled);
+	}
+}
+/* The small counter of a slot, without any overflow. */
+static inline unsigned long long count_table_counter(
+		const count_table_t * const table, const unsigned long long slot) {
+	if (table->counterBits == 8) {
+		return ((const unsigned char*) table->counts)[slot];
+	} else if (table->counterBits == 16) {
+		return ((const unsigned short*) table->counts)[slot];
+	}
+	return ((const unsigned int*) table->counts)[slot];
+}
+/* The full count of the kmer in a slot. */
+static inline unsigned long long count_table_frequency(
+		const count_table_t * const table, const unsigned long long slot,
+		const kmer_code_t code) {
+	unsigned long long frequency = count_table_counter(table, slot);
+	if (frequency == (~0ULL >> (64 - table->counterBits))) {
+		frequency += overflow_map_get(table->overflow, code);
+	}
+	return frequency;
+}
+/* The slot of a kmer in the dense engine, or the slot the hash engine starts probing at. */
+static inline unsigned long long count_table_home(
+		const count_table_t * const table, const kmer_code_t code) {
+	if (table->engine == ENGINE_DENSE) {
+		return code;
+	}
+	return fmix64(code) & (table->numSlots - 1);
+}
+/*
+ * Adds n to the count of a kmer whose home slot is already known, true if the kmer
+ * claimed an empty slot of the hash engine.
+ * Safe to call from any number of threads at once, between count_table_enter() and count_table_leave().
+ */
+static inline bool count_table_add_at(count_table_t * const table,
+		const kmer_code_t code, unsigned long long slot,
+		const unsigned long long n) {
+	if (table->engine == ENGINE_DENSE) {
+		count_table_increment(table, slot, code, n);
+		return false;
+	}
+
+	const kmer_code_t key = code + 1;
+	const unsigned long long mask = table->numSlots - 1;
+	while (true) {
+		kmer_code_t found = __atomic_load_n(&table->keys[slot],
+				__ATOMIC_RELAXED);
+		bool claimed = false;
+		if (found == 0) {
+			kmer_code_t empty = 0;
+			if (__atomic_compare_exchange_n(&table->keys[slot], &empty, key,
+					false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				found = key;
+				claimed = true;
+			} else {
+				found = empty; //another thread claimed the slot first.
+			}
+		}
+		if (found == key) {
+			count_table_increment(table, slot, code, n);
+			return claimed;
+		}
+		slot = (slot + 1) & mask;
+	}
+}
+/*
+ * The hash engine grows while threads add to it. A thread enters the table before a batch and
+ * leaves it after, count_table_grow() sets growing and waits for every thread to leave before it
+ * moves the slots, and a thread that finds growing set waits for it to be cleared before it enters.
+ * The dense engine never grows, so it never enters.
+ */
+static inline void count_table_enter(count_table_t * const table) {
+	if (table->engine != ENGINE_HASH) {
+		return;
+	}
+	while (true) {
+		__atomic_add_fetch(&table->inserters, 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&table->growing, __ATOMIC_SEQ_CST)) {
+			return;
+		}
+		__atomic_sub_fetch(&table->inserters, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&table->growing, __ATOMIC_ACQUIRE)) {
+			this_thread::yield();
+		}
+	}
+}
+/* Leaves the table after a batch that claimed slots, true if it is now more than half full. */
+static inline bool count_table_leave(count_table_t * const table,
+		const unsigned long long claimed) {
+	if (table->engine != ENGINE_HASH) {
+		return false;
+	}
+	const bool full = claimed
+			&& 2 * __atomic_add_fetch(&table->usedSlots, claimed,
+					__ATOMIC_RELAXED) > table->numSlots;
+	__atomic_sub_fetch(&table->inserters, 1, __ATOMIC_RELEASE);
+	return full;
+}
+/*
+ * Doubles the slots of the hash engine and moves every kmer to its slot in the new table.
+ * Called by a thread that found the table more than half full once it left it. Threads that
+ * find it full at the same time wait on growLock and then find it grown.
+ * The run stops instead if the old and new table together would go over config.tableBudget.
+ */
+void count_table_grow(count_table_t * const table) {
+	lock_guard<mutex> guard(table->growLock);
+	if (2 * __atomic_load_n(&table->usedSlots, __ATOMIC_RELAXED)
+			<= table->numSlots) {
+		return;
+	}
+	const unsigned long long growBytes = 3 * table->numSlots
+			* (sizeof(kmer_code_t) + table->counterBits / 8);
+	if (config.tableBudget && growBytes > config.tableBudget) {
+		fflush(stdout);
+		fprintf(stderr,
+				"Growing the hash table to %llu slots needs %0.1f mibibytes, more than the %0.1f mibibytes of the --max-memory budget left for the count table.\nUse --engine disk or a larger budget.\n",
+				2 * table->numSlots, growBytes / (double) (1024 * 1024),
+				config.tableBudget / (double) (1024 * 1024));
+		exit(EXIT_FAILURE);
+	}
+	__atomic_store_n(&table->growing, true, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&table->inserters, __ATOMIC_SEQ_CST)) {
+		this_thread::yield();
+	}
+
+	const unsigned long long oldSlots = table->numSlots;
+	kmer_code_t * const oldKeys = table->keys;
+	void * const oldCounts = table->counts;
+	const int counterBytes = table->counterBits / 8;
+	table->numSlots = 2 * oldSlots;
+	table->keys = (kmer_code_t*) allocate_count_table(table->numSlots,
+			sizeof(kmer_code_t));
+	table->counts = allocate_count_table(table->numSlots, counterBytes);
+	const unsigned long long mask = table->numSlots - 1;
+	for (unsigned long long old = 0; old < oldSlots; old++) {
+		if (oldKeys[old]) {
+			unsigned long long slot = count_table_home(table, oldKeys[old] - 1);
+			while (table->keys[slot]) {
+				slot = (slot + 1) & mask;
+			}
+			table->keys[slot] = oldKeys[old];
+			memcpy((char*) table->counts + slot * counterBytes,
+					(char*) oldCounts + old * counterBytes, counterBytes);
+		}
+	}
+	deallocate_count_table(oldKeys, oldSlots, sizeof(kmer_code_t));
+	deallocate_count_table(oldCounts, oldSlots, counterBytes);
+	fprintf(stdout, "Grew the hash table to %llu slots, %0.1f mibibytes.\n",
+			table->numSlots,
+			table->numSlots * (sizeof(kmer_code_t) + counterBytes)
+					/ (double) (1024 * 1024));
+	__atomic_store_n(&table->growing, false, __ATOMIC_RELEASE);
+}
+/*
+ * Adds n to the count of a kmer. Safe to call from any number of threads at once.
+ */
+static inline void count_table_add(count_table_t * const table,
+		const kmer_code_t code, const unsigned long long n) {
+	count_table_enter(table);
+	const bool claimed = count_table_add_at(table, code,
+			count_table_home(table, code), n);
+	if (count_table_leave(table, claimed)) {
+		count_table_grow(table);
+	}
+}
+/* Frequency of a kmer in the dense or hash engine once counting is done, 0 if it was not found. */
+unsigned long long count_table_get(const count_table_t * const table,
+		const kmer_code_t code) {
+	unsigned long long slot = count_table_home(table, code);
+	if (table->engine == ENGINE_DENSE) {
+		return count_table_frequency(table, slot, code);
+	}
+	const kmer_code_t key = code + 1;
+	while (table->keys[slot]) {
+		if (table->keys[slot] == key) {
+			return count_table_frequency(table, slot, code);
+		}
+		slot = (slot + 1) & (table->numSlots - 1);
+	}
+	return 0;
+}
+/*
+ * Adds runs[i].count to the count of runs[i].code for a batch of kmers.
+ * Once a table is larger than the cache every add is a miss to memory, so the home slots of up to
+ * config.insertBatch kmers are found and prefetched first and only then added to,
+ * which keeps that many misses in flight instead of one at a time.
+ */
+void count_table_add_batch(count_table_t * const table,
+		const kmer_count_t * const runs, const size_t numRuns) {
+	const size_t batch = config.insertBatch > 0 ? config.insertBatch : 1;
+	const int counterBytes = table->counterBits / 8;
+	unsigned long long slots[MAX_INSERT_BATCH];
+
+	for (size_t first = 0; first < numRuns; first += batch) {
+		const size_t last = min(numRuns, first + batch);
+		unsigned long long claimed = 0;
+		count_table_enter(table);
+		for (size_t i = first; i < last; i++) {
+			const unsigned long long slot = count_table_home(table, runs[i].code);
+			slots[i - first] = slot;
+			__builtin_prefetch(
+					(char*) table->counts + slot * counterBytes, 1);
+			if (table->keys) {
+				__builtin_prefetch(table->keys + slot, 1);
+			}
+		}
+		for (size_t i = first; i < last; i++) {
+			claimed += count_table_add_at(table, runs[i].code,
+					slots[i - first], runs[i].count);
+		}
+		if (count_table_leave(table, claimed)) {
+			count_table_grow(table);
+		}
+	}
+}
+/*
+ * Appends sorted kmer runs to the buckets of the sort and disk engines.
+ * Runs of one bucket are contiguous, so each bucket is locked once per call.
+ */
+void count_table_append(count_table_t * const table,
+		const vector<kmer_count_t> &runs) {
+	for (size_t i = 0; i < runs.size();) {
+		const kmer_code_t p = runs[i].code >> table->partitionShift;
+		size_t j = i + 1;
+		while (j < runs.size() && runs[j].code >> table->partitionShift == p) {
+			j++;
+		}
+		kmer_partition_t &partition = table->partitions[p];
+		lock_guard<mutex> guard(partition.lock);
+		if (partition.file) {
+			write_or_die(&runs[i], sizeof(kmer_count_t), j - i, partition.file);
+		} else {
+			partition.counts.insert(partition.counts.end(), runs.begin() + i,
+					runs.begin() + j);
+		}
+		i = j;
+	}
+}
+/*
+ * Sorts the runs of one bucket and merges the runs of the same kmer.
+ */
+void merge_partition(vector<kmer_count_t> &counts) {
+	sort(counts.begin(), counts.end(),
+			[](const kmer_count_t &a, const kmer_count_t &b) {
+				return a.code < b.code;
+			});
+	size_t kept = 0;
+	for (size_t i = 0; i < counts.size(); i++) {
+		if (kept && counts[kept - 1].code == counts[i].code) {
+			counts[kept - 1].count += counts[i].count;
+		} else {
+			counts[kept++] = counts[i];
+		}
+	}
+	counts.resize(kept);
+	vector<kmer_count_t>(counts).swap(counts); //give back the memory of the merged runs.
+}
+/*
+ * Worker for count_table_finish(). The disk engine reads a bucket, merges it and writes it back,
+ * so only one bucket per thread is in memory at a time.
+ */
+void finish_partition_worker(count_table_t * const table,
+		atomic<int> * const nextPartition) {
+	int p;
+	while ((p = (*nextPartition)++) < table->numPartitions) {
+		kmer_partition_t &partition = table->partitions[p];
+		if (partition.file) {
+			fflush(partition.file);
+			vector<kmer_count_t> counts(
+					ftell(partition.file) / sizeof(kmer_count_t));
+			rewind(partition.file);
+			if (fread(counts.data(), sizeof(kmer_count_t), counts.size(),
+					partition.file) != counts.size()) {
+				fprintf(stderr, "Temporary file %d of the disk engine failed to read.\n",
+						p);
+				exit(EXIT_FAILURE);
+			}
+			merge_partition(counts);
+			rewind(partition.file);
+			if (ftruncate(fileno(partition.file), 0) != 0) {
+				fprintf(stderr,
+						"Temporary file %d of the disk engine failed to truncate.\n",
+						p);
+				exit(EXIT_FAILURE);
+			}
+			write_or_die(counts.data(), sizeof(kmer_count_t), counts.size(),
+					partition.file);
+			fflush(partition.file);
+			partition.distinct = counts.size();
+		} else {
+			merge_partition(partition.counts);
+			partition.distinct = partition.counts.size();
+		}
+	}
+}
+/*
+ * Turns the appended runs of the sort and disk engines into final counts. Call once all workers are done.
+ */
+void count_table_finish(count_table_t * const table, const int threads) {
+	if (!table->partitions) {
+		return;
+	}
+	atomic<int> nextPartition(0);
+	vector<thread> workers;
+	for (int t = 0; t < threads; t++) {
+		workers.push_back(
+				thread(finish_partition_worker, table, &nextPartition));
+	}
+	for (int t = 0; t < threads; t++) {
+		workers[t].join();
+	}
+}
+unsigned long long count_table_distinct(const count_table_t * const table) {
+	unsigned long long distinct = 0;
+	for (int p = 0; p < table->numPartitions; p++) {
+		distinct += table->partitions[p].distinct;
+	}
+	for (unsigned long long slot = 0; slot < table->numSlots; slot++) {
+		if (count_table_counter(table, slot)) {
+			distinct++;
+		}
+	}
+	return distinct;
+}
+/*
+ * Calls kmer(code, frequency) for every kmer that was found, in ascending code order,
+ * which is the order histo_tree() walks the tree in.
+ */
+template<typename callback_t>
+void count_table_for_each(const count_table_t * const table, callback_t kmer) {
+	if (table->partitions) {
+		vector<kmer_count_t> chunk(4096);
+		for (int p = 0; p < table->numPartitions; p++) {
+			const kmer_partition_t &partition = table->partitions[p];
+			if (!partition.file) {
+				for (size_t i = 0; i < partition.counts.size(); i++) {
+					kmer(partition.counts[i].code, partition.counts[i].count);
+				}
+				continue;
+			}
+			rewind(partition.file);
+			size_t read;
+			while ((read = fread(chunk.data(), sizeof(kmer_count_t),
+					chunk.size(), partition.file)) > 0) {
+				for (size_t i = 0; i < read; i++) {
+					kmer(chunk[i].code, chunk[i].count);
+				}
+			}
+		}
+	} else if (table->engine == ENGINE_DENSE) {
+		for (kmer_code_t code = 0; code < table->numSlots; code++) {
+			if (count_table_counter(table, code)) {
+				kmer(code, count_table_frequency(table, code, code));
+			}
+		}
+	} else {
+		vector<unsigned long long> slots;
+		slots.reserve(table->usedSlots);
+		for (unsigned long long slot = 0; slot < table->numSlots; slot++) {
+			if (table->keys[slot]) {
+				slots.push_back(slot);
+			}
+		}
+		sort(slots.begin(), slots.end(),
+				[table](unsigned long long a, unsigned long long b) {
+					return table->keys[a] < table->keys[b];
+				});
+		for (size_t i = 0; i < slots.size(); i++) {
+			const kmer_code_t code = table->keys[slots[i]] - 1;
+			kmer(code, count_table_frequency(table, slots[i], code));
+		}
+	}
+}
+//Base statistics one worker gathered while counting, summed once all workers are done.
+struct table_worker_t {
+	unsigned long long baseCounter;
+	unsigned long long baseCounts[4];
+	unsigned long long TotalNumSequencesN;
+	unsigned long long maskedKmers;
+};
+/*
+ * Adds the buffered kmers to the shared table, one atomic add per distinct kmer.
+ */
+void flush_combine_buffer(count_table_t * const table,
+		vector<kmer_code_t> &combine) {
+	sort(combine.begin(), combine.end());
+	vector<kmer_count_t> runs;
+	for (size_t i = 0; i < combine.size();) {
+		size_t j = i + 1;
+		while (j < combine.size() && combine[j] == combine[i]) {
+			j++;
+		}
+		kmer_count_t run = { combine[i], j - i };
+		runs.push_back(run);
+		i = j;
+	}
+	if (table->partitions) {
+		count_table_append(table, runs);
+	} else {
+		count_table_add_batch(table, runs.data(), runs.size());
+	}
+	combine.clear();
+}
+/*
+ * Adds one kmer to the table through the --combine buffer, the --insert-batch batch or on its own.
+ */
+static inline void count_table_insert(count_table_t * const table,
+		vector<kmer_code_t> &combine, vector<kmer_count_t> &batch,
+		const kmer_code_t code) {
+	if (config.combineSize > 0) {
+		combine.push_back(code);
+		if (combine.size() == (size_t) config.combineSize) {
+			flush_combine_buffer(table, combine);
+		}
+	} else if (config.insertBatch > 0) {
+		kmer_count_t kmer = { code, 1 };
+		batch.push_back(kmer);
+		if (batch.size() == (size_t) config.insertBatch) {
+			count_table_add_batch(table, batch.data(), batch.size());
+			batch.clear();
+		}
+	} else {
+		count_table_add(table, code, 1);
+	}
+}
+/*
+ * Worker for count_kmers_with_table(). Claims segments until there are none left.
+ * Base statistics follow the rules of findKmer(): the first kmer of an unbroken run adds
+ * all k of its bases, every later kmer of the run adds only its last base.
+ */
+void table_count_worker(segment_source_t * const source,
+		count_table_t * const table, table_worker_t * const totals) {
+	const int k = table->k;
+	const int span = config.span; //bases of the window, k unless a --pattern has gaps.
+	vector<kmer_code_t> combine;
+	combine.reserve(config.combineSize);
+	vector<kmer_count_t> batch;
+	batch.reserve(config.insertBatch);
+	segment_cursor_t cursor = { NULL, 0 };
+	const segment_t *segment;
+
+	while (next_segment(source, &cursor, &segment)) {
+		const unsigned long long preroll = segment->preroll;
+		size_t lastOffset = 0;
+		bool first = true;
+
+		scan_record_kmers(segment->record, k,
+				[&](kmer_code_t code, size_t offset, bool masked,
+						kmer_code_t window) {
+					bool continuesRun = !first && offset == lastOffset + 1;
+					first = false;
+					lastOffset = offset;
+					if (offset + span - 1 < preroll) {
+						return;
+					}
+
+					if (continuesRun) {
+						totals->baseCounts[window & 3]++;
+						totals->baseCounter++;
+					} else {
+						for (int i = 0; i < span; i++) {
+							totals->baseCounts[(window >> (2 * i)) & 3]++;
+						}
+						totals->baseCounter += span;
+					}
+					if (masked) {
+						totals->maskedKmers++;
+						return;
+					}
+					totals->TotalNumSequencesN++;
+
+					//statistics cover every kmer so all shards report the whole file.
+					if (config.shardCount > 0
+							&& shard_of(code) != config.shardIndex) {
+						return;
+					}
+
+					count_table_insert(table, combine, batch, code);
+				});
+	}
+	flush_combine_buffer(table, combine);
+	count_table_add_batch(table, batch.data(), batch.size());
+}
+/*
+ * Worker for count_kmers_with_table() with --dyad, in the same pass over the segments as
+ * table_count_worker(). A ring keeps the left half-site ending at each of the last bases, so
+ * every right half-site is paired with the left half-sites of all gaps at once. A dyad is
+ * counted as its gap index above the bases of both half-sites, dyads[g] counts the dyads of gap index g.
+ * Every base is counted once for the base statistics, no dyad spans a break.
+ */
+void dyad_count_worker(segment_source_t * const source,
+		count_table_t * const table, table_worker_t * const totals,
+		vector<unsigned long long> * const dyads) {
+	const int left = config.dyadLeft;
+	const int right = config.dyadRight;
+	const int gaps = dyad_gaps();
+	const kmer_code_t leftMask = (((kmer_code_t) 1) << (2 * left)) - 1;
+	const kmer_code_t rightMask = (((kmer_code_t) 1) << (2 * right)) - 1;
+	size_t ringSize = 1; //reaches back over the right half-site and the longest gap.
+	while (ringSize <= (size_t) (right + config.dyadGapMax)) {
+		ringSize <<= 1;
+	}
+	vector<kmer_code_t> ring(ringSize);
+	vector<kmer_code_t> combine;
+	combine.reserve(config.combineSize);
+	vector<kmer_count_t> batch;
+	batch.reserve(config.insertBatch);
+	segment_cursor_t cursor = { NULL, 0 };
+	const segment_t *segment;
+
+	while (next_segment(source, &cursor, &segment)) {
+		const unsigned long long preroll = segment->preroll;
+		kmer_code_t window = 0;
+		unsigned long long run = 0; //bases since the last break.
+		unsigned long long offset = 0; //bases since the start of the segment.
+
+		for_each_record_base(segment->record, [&](int codedBase) {
+			offset++;
+			if (codedBase < 0) {
+				run = 0;
+				return;
+			}
+			window = (window << 2) | codedBase;
+			run++;
+			ring[offset & (ringSize - 1)] = window & leftMask;
+			//the preroll only fills the ring for the first dyads of the segment.
+			if (offset <= preroll) {
+				return;
+			}
+			totals->baseCounts[codedBase]++;
+			totals->baseCounter++;
+
+			const kmer_code_t rightCode = window & rightMask;
+			for (int g = 0; g < gaps
+					&& run >= (unsigned long long) (left + config.dyadGapMin + g + right);
+					g++) {
+				const kmer_code_t leftCode = ring[(offset - right - config.dyadGapMin - g)
+						& (ringSize - 1)];
+				(*dyads)[g]++;
+				totals->TotalNumSequencesN++;
+				count_table_insert(table, combine, batch,
+						((kmer_code_t) g << (2 * config.k)) | (leftCode << (2 * right))
+								| rightCode);
+			}
+		});
+	}
+	flush_combine_buffer(table, combine);
+	count_table_add_batch(table, batch.data(), batch.size());
+}
+static double monotonic_seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+/*
+ * Worker for bench_count_tables(). Adds its share of the kmers one at a time or in batches.
+ */
+void bench_insert_worker(count_table_t * const table,
+		const vector<kmer_code_t> * const codes, const size_t first,
+		const size_t last, const bool batched) {
+	if (!batched) {
+		for (size_t i = first; i < last; i++) {
+			count_table_add(table, (*codes)[i], 1);
+		}
+		return;
+	}
+	vector<kmer_count_t> batch(config.insertBatch);
+	for (size_t i = first; i < last; i += config.insertBatch) {
+		const size_t n = min((size_t) config.insertBatch, last - i);
+		for (size_t j = 0; j < n; j++) {
+			batch[j].code = (*codes)[i + j];
+			batch[j].count = 1;
+		}
+		count_table_add_batch(table, batch.data(), n);
+	}
+}
+/* Seconds it takes config.threads threads to add all of codes to a new table. */
+double bench_insert(const int engine, const int k,
+		const vector<kmer_code_t> &codes, const bool batched,
+		unsigned long long * const tableBytes) {
+	const unsigned long long possible = ((unsigned long long) 1) << (2 * k);
+	count_table_t *table = count_table_create(engine, k, config.counterBits,
+			min(possible, (unsigned long long) codes.size()));
+	*tableBytes = table->numSlots
+			* (config.counterBits / 8 + (table->keys ? sizeof(kmer_code_t) : 0));
+	//fault the pages in first so the timing is of the adds, not of the kernel zeroing pages.
+	memset(table->counts, 0, table->numSlots * (config.counterBits / 8));
+	if (table->keys) {
+		memset(table->keys, 0, table->numSlots * sizeof(kmer_code_t));
+	}
+
+	const double start = monotonic_seconds();
+	vector<thread> workers;
+	for (int t = 0; t < config.threads; t++) {
+		workers.push_back(
+				thread(bench_insert_worker, table, &codes,
+						codes.size() * t / config.threads,
+						codes.size() * (t + 1) / config.threads, batched));
+	}
+	for (int t = 0; t < config.threads; t++) {
+		workers[t].join();
+	}
+	const double seconds = monotonic_seconds() - start;
+	count_table_destroy(table);
+	return seconds;
+}
+/*
+ * "findKmer bench". Times the dense and hash engines adding the kmers of a random sequence,
+ * one at a time and in prefetched batches of --insert-batch, for k = 12 to 20 with --threads threads.
+ * The dense engine stops at k = BENCH_MAX_DENSE_K where its table no longer fits in most machines.
+ */
+void bench_count_tables() {
+	if (config.insertBatch == 0) {
+		config.insertBatch = DEFAULT_INSERT_BATCH;
+	}
+	const int engines[] = { ENGINE_DENSE, ENGINE_HASH };
+	vector<kmer_code_t> codes(BENCH_KMERS);
+	vector<double> results[2][2]; //[engine][batched] kmers per second by k.
+	vector<unsigned long long> bytes[2];
+
+	fprintf(stdout,
+			"Adding %d kmers of a random sequence with %d threads and %d bit counters.\n",
+			BENCH_KMERS, config.threads, config.counterBits);
+	for (int k = 12; k <= 20; k++) {
+		//the kmers of a random sequence, like the counting engines see them.
+		const kmer_code_t mask = (((kmer_code_t) 1) << (2 * k)) - 1;
+		unsigned long long random = 88172645463325252ULL + k;
+		kmer_code_t code = 0;
+		for (size_t i = 0; i < codes.size(); i++) {
+			random ^= random << 13;
+			random ^= random >> 7;
+			random ^= random << 17;
+			code = ((code << 2) | (random >> 62)) & mask;
+			codes[i] = code;
+		}
+
+		for (int e = 0; e < 2; e++) {
+			if (engines[e] == ENGINE_DENSE && k > BENCH_MAX_DENSE_K) {
+				continue;
+			}
+			unsigned long long tableBytes = 0;
+			for (int batched = 0; batched < 2; batched++) {
+				results[e][batched].push_back(
+						codes.size()
+								/ bench_insert(engines[e], k, codes,
+										batched, &tableBytes));
+			}
+			bytes[e].push_back(tableBytes);
+		}
+	}
+
+	fprintf(stdout,
+			"\nengine, k, table mibibytes, one at a time Mkmers/s, batches of %d Mkmers/s, speedup\n",
+			config.insertBatch);
+	for (int e = 0; e < 2; e++) {
+		for (size_t i = 0; i < results[e][0].size(); i++) {
+			fprintf(stdout, "%s, %d, %0.1f, %0.1f, %0.1f, %0.2f\n",
+					engine_name(engines[e]), 12 + (int) i,
+					bytes[e][i] / (double) (1024 * 1024),
+					results[e][0][i] / 1e6, results[e][1][i] / 1e6,
+					results[e][1][i] / results[e][0][i]);
+		}
+	}
+}
+/*
+ * Bytes of text in the sequence file, or of the mapped cache. A gzip file is taken to hold
+ * GZIP_TEXT_RATIO times its size, a pipe an unknown amount, which is 0.
+ */
+unsigned long long input_bytes() {
+	if (config.packedCache) {
+		return config.packedCache->size;
+	}
+	struct stat st;
+	if (fstat(fileno(config.sequence_file_pointer), &st) != 0
+			|| !S_ISREG(st.st_mode)) {
+		return 0;
+	}
+	return config.textFormat == TEXT_PLAIN ?
+			st.st_size : st.st_size * GZIP_TEXT_RATIO;
+}
+/* Upper bound on the kmers in the sequence file, one per base. */
+unsigned long long input_kmers() {
+	if (config.packedCache) {
+		return config.packedCache->header->numBases;
+	}
+	return input_bytes();
+}
+/*
+ * The dense and hash engines. Replaces findKmer() for them: all threads scan their own
+ * segments of the file and count into one shared table.
+ */
+count_table_t *count_kmers_with_table(unsigned long long * const baseCounter,
+		statistics_t * const baseStatistics,
+		unsigned long long * const TotalNumSequencesN,
+		scan_summary_t * const summary) {
+	const unsigned long long possible = ((unsigned long long) 1)
+			<< (2 * count_table_k());
+	//the estimate of a sample when there is one, the hash engine grows past it if it is low.
+	unsigned long long maxDistinct = min(possible,
+			input_kmers() * dyad_gaps());
+	if (sampledDistinct && !config.dyadLeft) {
+		maxDistinct = min(maxDistinct, sampledDistinct);
+	}
+	if (config.shardCount > 0) {
+		maxDistinct = maxDistinct / config.shardCount + 1024;
+	}
+	count_table_t *table = count_table_create(config.engine, count_table_k(),
+			config.counterBits, maxDistinct);
+
+	segment_source_t source;
+	segment_source_open(&source, summary);
+	vector<table_worker_t> totals(config.threads);
+	vector<vector<unsigned long long> > dyads(config.threads,
+			vector<unsigned long long>(dyad_gaps(), 0));
+	vector<thread> workers;
+	for (int t = 0; t < config.threads; t++) {
+		memset(&totals[t], 0, sizeof(table_worker_t));
+		if (config.dyadLeft) {
+			workers.push_back(
+						thread(dyad_count_worker, &source, table, &totals[t],
+							&dyads[t]));
+		} else {
+			workers.push_back(
+					thread(table_count_worker, &source, table, &totals[t]));
+		}
+	}
+	dyadsByGap.assign(dyad_gaps(), 0);
+	for (int t = 0; t < config.threads; t++) {
+		workers[t].join();
+		for (int g = 0; g < dyad_gaps(); g++) {
+			dyadsByGap[g] += dyads[t][g];
+		}
+		*baseCounter += totals[t].baseCounter;
+		*TotalNumSequencesN += totals[t].TotalNumSequencesN;
+		summary->maskedKmers += totals[t].maskedKmers;
+		for (int b = 0; b < 4; b++) {
+			baseStatistics[b].Count += totals[t].baseCounts[b];
+		}
+	}
+
+	if (overflow_map_size(table->overflow)) {
+		fprintf(stdout, "%llu kmers saturated their %d bit counters.\n",
+				overflow_map_size(table->overflow), table->counterBits);
+	}
+
+	segment_source_close(&source);
+	count_table_finish(table, config.threads);
+	return table;
+}
+/*
+ * The histogram for the count table engines, the same rows histo_tree() writes for the tree.
+ * Ranges are the buckets of the sort and disk engines, runs of HISTO_RANGE_KMERS codes of the dense
+ * engine, or runs of HISTO_RANGE_KMERS slots of the hash engine once its slots are sorted by kmer.
+ */
+void histo_table(const count_table_t * const table,
+		const statistics_t * const baseStatistics,
+		const unsigned long long TotalNumSequencesN) {
+	const int k = table->k;
+
+	if (table->partitions) {
+		write_histogram_ranges(table->numPartitions,
+				[&](size_t r, FILE *out, int *array, vector<kmer_code_t> &passed) {
+					const kmer_partition_t &partition = table->partitions[r];
+					if (!partition.file) {
+						for (size_t i = 0; i < partition.counts.size(); i++) {
+							histo_range_kmer(array, k, partition.counts[i].code,
+									partition.counts[i].count, baseStatistics,
+									TotalNumSequencesN, out, passed);
+						}
+						return;
+					}
+					//each bucket has its own file, so workers read them side by side.
+					vector<kmer_count_t> chunk(4096);
+					rewind(partition.file);
+					size_t read;
+					while ((read = fread(chunk.data(), sizeof(kmer_count_t),
+							chunk.size(), partition.file)) > 0) {
+						for (size_t i = 0; i < read; i++) {
+							histo_range_kmer(array, k, chunk[i].code, chunk[i].count,
+									baseStatistics, TotalNumSequencesN, out, passed);
+						}
+					}
+				});
+	} else if (table->engine == ENGINE_DENSE) {
+		write_histogram_ranges(
+				(table->numSlots + HISTO_RANGE_KMERS - 1) / HISTO_RANGE_KMERS,
+				[&](size_t r, FILE *out, int *array, vector<kmer_code_t> &passed) {
+					const kmer_code_t last = min(table->numSlots,
+							(unsigned long long) (r + 1) * HISTO_RANGE_KMERS);
+					for (kmer_code_t code = (kmer_code_t) r * HISTO_RANGE_KMERS;
+							code < last; code++) {
+						if (count_table_counter(table, code)) {
+							histo_range_kmer(array, k, code,
+									count_table_frequency(table, code, code),
+									baseStatistics, TotalNumSequencesN, out, passed);
+						}
+					}
+				});
+	} else {
+		vector<unsigned long long> slots;
+		slots.reserve(table->usedSlots);
+		for (unsigned long long slot = 0; slot < table->numSlots; slot++) {
+			if (table->keys[slot]) {
+				slots.push_back(slot);
+			}
+		}
+		sort(slots.begin(), slots.end(),
+				[table](unsigned long long a, unsigned long long b) {
+					return table->keys[a] < table->keys[b];
+				});
+		write_histogram_ranges(
+				(slots.size() + HISTO_RANGE_KMERS - 1) / HISTO_RANGE_KMERS,
+				[&](size_t r, FILE *out, int *array, vector<kmer_code_t> &passed) {
+					const size_t last = min(slots.size(),
+							(size_t) (r + 1) * HISTO_RANGE_KMERS);
+					for (size_t i = r * HISTO_RANGE_KMERS; i < last; i++) {
+						const kmer_code_t code = table->keys[slots[i]] - 1;
+						histo_range_kmer(array, k, code,
+								count_table_frequency(table, slots[i], code),
+								baseStatistics, TotalNumSequencesN, out, passed);
+					}
+				});
+	}
+}
+/*
+ * A kmer of more than MAX_CODE_K bases, coded like a kmer_code_t with the first base most significant:
+ * lo holds the last 32 bases and hi the k - 32 bases before them. Comparing hi and then lo is the
+ * order of the bases, so long kmers come out of the histogram sorted like short ones.
+ */
+struct long_kmer_t {
+	unsigned long long hi;
+	unsigned long long lo;
+};
+static inline bool operator<(const long_kmer_t &a, const long_kmer_t &b) {
+	return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+static inline bool operator==(const long_kmer_t &a, const long_kmer_t &b) {
+	return a.hi == b.hi && a.lo == b.lo;
+}
+/* The 64 bits of a long kmer from bit shift up, shift < 128. */
+static inline unsigned long long long_kmer_bits(const long_kmer_t &code,
+		const int shift) {
+	if (shift == 0) {
+		return code.lo;
+	}
+	if (shift < 64) {
+		return (code.lo >> shift) | (code.hi << (64 - shift));
+	}
+	return code.hi >> (shift - 64);
+}
+static inline unsigned long long long_kmer_hash(const long_kmer_t &code) {
+	return fmix64(code.hi ^ fmix64(code.lo));
+}
+/* The 32 bases of a word in reverse order. */
+static inline unsigned long long reverse_bases(unsigned long long bases) {
+	bases = ((bases >> 2) & 0x3333333333333333ULL)
+			| ((bases & 0x3333333333333333ULL) << 2);
+	bases = ((bases >> 4) & 0x0F0F0F0F0F0F0F0FULL)
+			| ((bases & 0x0F0F0F0F0F0F0F0FULL) << 4);
+	return __builtin_bswap64(bases);
+}
+/*
+ * --canonical. The smaller of a long kmer of k bases and its reverse complement. The complement of
+ * a base is 3 - base, so complementing is ~. Reversing both words swaps them, which leaves the kmer
+ * in the top 2k bits, and shifting it down drops the complemented bits above the kmer.
+ */
+static inline long_kmer_t long_kmer_canonical(const long_kmer_t &code,
+		const int k) {
+	const unsigned long long hi = reverse_bases(~code.lo);
+	const unsigned long long lo = reverse_bases(~code.hi);
+	const int shift = 128 - 2 * k;
+	long_kmer_t reverse = { hi, lo };
+	if (shift > 0) {
+		reverse.lo = (lo >> shift) | (hi << (64 - shift));
+		reverse.hi = hi >> shift;
+	}
+	return reverse < code ? reverse : code;
+}
+//A long kmer and how often it was seen, the entries of the buckets of a long kmer table.
+struct long_kmer_count_t {
+	long_kmer_t code;
+	unsigned long long count;
+};
+/* complexity_add() for a long kmer. */
+static inline void complexity_add(complexity_t * const complexity,
+		const long_kmer_t &code, const long_kmer_t &previousCode,
+		const int seqSize, const int k) {
+	complexity->counts[code.lo & 3]++;
+	if (seqSize >= 3) {
+		complexity->tripletPairs += complexity->triplets[code.lo & 63]++;
+	}
+	if (seqSize > k) {
+		complexity->counts[long_kmer_bits(previousCode, 2 * (k - 1)) & 3]--;
+		complexity->tripletPairs -=
+				--complexity->triplets[long_kmer_bits(previousCode, 2 * (k - 3))
+						& 63];
+	}
+}
+/*
+ * scan_record_kmers() for kmers of more than MAX_CODE_K bases, calls count(code, offset, masked)
+ * for every complete kmer. A base shifts both words, the first base of lo moving up into hi.
+ */
+template<typename callback_t>
+void scan_record_long_kmers(const record_t &record, const int k,
+		callback_t count) {
+	const unsigned long long hiMask =
+			k < 64 ? (((unsigned long long) 1) << (2 * (k - 32))) - 1 : ~0ULL;
+	long_kmer_t code = { 0, 0 };
+	int seqSize = 0; //same meaning as in findKmer(), reset by every break.
+	size_t offset = 0; //number of bases since the start of the record.
+	const bool masking = masking_enabled();
+	complexity_t complexity;
+	complexity_reset(&complexity);
+
+	for_each_record_base(record, [&](int codedBase) {
+		offset++;
+		if (codedBase < 0) {
+			seqSize = 0;
+			if (masking) {
+				complexity_reset(&complexity);
+			}
+		} else {
+			const long_kmer_t previousCode = code;
+			code.hi = ((code.hi << 2) | (code.lo >> 62)) & hiMask;
+			code.lo = (code.lo << 2) | codedBase;
+			++seqSize;
+			if (masking) {
+				complexity_add(&complexity, code, previousCode, seqSize, k);
+			}
+			if (seqSize >= k) {
+				count(code, offset - k,
+						masking && complexity_masked(&complexity, k));
+			}
+		}
+	});
+}
+/*
+ * A bucket of a long kmer table, all long kmers that start with the same few bases.
+ * The hash engine keeps an open addressing table in slots that doubles once it is half full,
+ * a count of 0 marks a slot empty. The sort engine appends runs to counts.
+ * long_table_finish() leaves every kmer of the bucket once in counts, in ascending order.
+ */
+struct long_partition_t {
+	mutex lock;
+	vector<long_kmer_count_t> slots; //hash engine.
+	unsigned long long used; //slots holding a kmer.
+	vector<long_kmer_count_t> counts;
+};
+/*
+ * Count table of the hash and sort engines for kmers of more than MAX_CODE_K bases.
+ * Workers buffer their kmers and add them a bucket at a time under the lock of the bucket,
+ * so a two word key never needs an atomic of its own. Counts are 64 bits, --counter-bits
+ * does not apply.
+ */
+struct long_table_t {
+	int engine; //ENGINE_HASH or ENGINE_SORT.
+	int k;
+	int numPartitions;
+	int partitionShift; //long_kmer_bits(code, partitionShift) is the bucket of a kmer.
+	long_partition_t *partitions;
+	unsigned long long slotBytes; //hash engine, bytes of the slots of every bucket.
+};
+long_table_t *long_table_create(const int engine, const int k) {
+	long_table_t *table = new long_table_t;
+	table->engine = engine;
+	table->k = k;
+	table->numPartitions = SORT_PARTITIONS;
+	table->partitionShift = 2 * k;
+	for (int p = SORT_PARTITIONS; p > 1; p >>= 1) {
+		table->partitionShift--;
+	}
+	table->partitions = new long_partition_t[table->numPartitions];
+	table->slotBytes = engine == ENGINE_HASH ?
+			(unsigned long long) SORT_PARTITIONS * LONG_HASH_BUCKET_SLOTS
+					* sizeof(long_kmer_count_t) : 0;
+	for (int p = 0; p < table->numPartitions; p++) {
+		table->partitions[p].used = 0;
+		if (engine == ENGINE_HASH) {
+			table->partitions[p].slots.resize(LONG_HASH_BUCKET_SLOTS);
+		}
+	}
+	fprintf(stdout, "Counting %d base kmers as two words into %d %s buckets.\n",
+			k, table->numPartitions, engine_name(engine));
+	return table;
+}
+void long_table_destroy(long_table_t * const table) {
+	delete[] table->partitions;
+	delete table;
+}
+/* Adds n to the count of a kmer of a hash engine bucket. The caller holds the lock of the bucket. */
+void long_partition_add(long_partition_t * const partition,
+		const long_kmer_t &code, const unsigned long long n) {
+	if (2 * (partition->used + 1) > partition->slots.size()) {
+		vector<long_kmer_count_t> old(2 * partition->slots.size());
+		old.swap(partition->slots);
+		partition->used = 0;
+		for (size_t i = 0; i < old.size(); i++) {
+			if (old[i].count) {
+				long_partition_add(partition, old[i].code, old[i].count);
+			}
+		}
+	}
+	const size_t mask = partition->slots.size() - 1;
+	size_t slot = long_kmer_hash(code) & mask;
+	while (partition->slots[slot].count && !(partition->slots[slot].code == code)) {
+		slot = (slot + 1) & mask;
+	}
+	if (!partition->slots[slot].count) {
+		partition->slots[slot].code = code;
+		partition->used++;
+	}
+	partition->slots[slot].count += n;
+}
+/*
+ * Accounts for a hash engine bucket that doubled from slots slots. The run stops if the buckets
+ * went over config.tableBudget.
+ */
+void long_table_grew(long_table_t * const table, const size_t slots) {
+	const unsigned long long bytes = __atomic_add_fetch(&table->slotBytes,
+			(unsigned long long) slots * sizeof(long_kmer_count_t),
+			__ATOMIC_RELAXED);
+	if (config.tableBudget && bytes > config.tableBudget) {
+		fflush(stdout);
+		fprintf(stderr,
+				"The hash engine buckets grew to %0.1f mibibytes, more than the %0.1f mibibytes of the --max-memory budget left for the count table.\nUse a larger budget.\n",
+				bytes / (double) (1024 * 1024),
+				config.tableBudget / (double) (1024 * 1024));
+		exit(EXIT_FAILURE);
+	}
+}
+/*
+ * Adds the buffered kmers of a worker to the buckets, locking each bucket once
+ * and adding each distinct kmer once.
+ */
+void long_table_flush(long_table_t * const table, vector<long_kmer_t> &combine) {
+	sort(combine.begin(), combine.end());
+	for (size_t i = 0; i < combine.size();) {
+		const unsigned long long p = long_kmer_bits(combine[i],
+				table->partitionShift);
+		long_partition_t &partition = table->partitions[p];
+		lock_guard<mutex> guard(partition.lock);
+		while (i < combine.size()
+				&& long_kmer_bits(combine[i], table->partitionShift) == p) {
+			size_t j = i + 1;
+			while (j < combine.size() && combine[j] == combine[i]) {
+				j++;
+			}
+			if (table->engine == ENGINE_HASH) {
+				const size_t slots = partition.slots.size();
+				long_partition_add(&partition, combine[i], j - i);
+				if (partition.slots.size() != slots) {
+					long_table_grew(table, slots);
+				}
+			} else {
+				long_kmer_count_t run = { combine[i], j - i };
+				partition.counts.push_back(run);
+			}
+			i = j;
+		}
+	}
+	combine.clear();
+}
+/*
+ * Worker for long_table_finish(). Gathers the kmers of the slots of a hash engine bucket, or merges
+ * the runs of the same kmer of a sort engine bucket, into counts in ascending order.
+ */
+void finish_long_partition_worker(long_table_t * const table,
+		atomic<int> * const nextPartition) {
+	int p;
+	while ((p = (*nextPartition)++) < table->numPartitions) {
+		long_partition_t &partition = table->partitions[p];
+		for (size_t i = 0; i < partition.slots.size(); i++) {
+			if (partition.slots[i].count) {
+				partition.counts.push_back(partition.slots[i]);
+			}
+		}
+		vector<long_kmer_count_t>().swap(partition.slots);
+
+		vector<long_kmer_count_t> &counts = partition.counts;
+		sort(counts.begin(), counts.end(),
+				[](const long_kmer_count_t &a, const long_kmer_count_t &b) {
+					return a.code < b.code;
+				});
+		size_t kept = 0;
+		for (size_t i = 0; i < counts.size(); i++) {
+			if (kept && counts[kept - 1].code == counts[i].code) {
+				counts[kept - 1].count += counts[i].count;
+			} else {
+				counts[kept++] = counts[i];
+			}
+		}
+		counts.resize(kept);
+		vector<long_kmer_count_t>(counts).swap(counts);
+	}
+}
+/* count_table_finish() for a long kmer table. */
+void long_table_finish(long_table_t * const table, const int threads) {
+	atomic<int> nextPartition(0);
+	vector<thread> workers;
+	for (int t = 0; t < threads; t++) {
+		workers.push_back(
+				thread(finish_long_partition_worker, table, &nextPartition));
+	}
+	for (int t = 0; t < threads; t++) {
+		workers[t].join();
+	}
+}
+unsigned long long long_table_distinct(const long_table_t * const table) {
+	unsigned long long distinct = 0;
+	for (int p = 0; p < table->numPartitions; p++) {
+		distinct += table->partitions[p].counts.size();
+	}
+	return distinct;
+}
+/*
+ * Worker for count_long_kmers(), table_count_worker() for kmers of two words.
+ * Every kmer goes through the --combine buffer, which plan_memory() always sizes for long kmers.
+ */
+void long_count_worker(segment_source_t * const source,
+		long_table_t * const table, table_worker_t * const totals) {
+	const int k = table->k;
+	vector<long_kmer_t> combine;
+	combine.reserve(config.combineSize);
+	segment_cursor_t cursor = { NULL, 0 };
+	const segment_t *segment;
+
+	while (next_segment(source, &cursor, &segment)) {
+		const unsigned long long preroll = segment->preroll;
+		size_t lastOffset = 0;
+		bool first = true;
+
+		scan_record_long_kmers(segment->record, k,
+				[&](const long_kmer_t &code, size_t offset, bool masked) {
+					bool continuesRun = !first && offset == lastOffset + 1;
+					first = false;
+					lastOffset = offset;
+					if (offset + k - 1 < preroll) {
+						return;
+					}
+
+					if (continuesRun) {
+						totals->baseCounts[code.lo & 3]++;
+						totals->baseCounter++;
+					} else {
+						for (int i = 0; i < k; i++) {
+							totals->baseCounts[long_kmer_bits(code, 2 * i) & 3]++;
+						}
+						totals->baseCounter += k;
+					}
+					if (masked) {
+						totals->maskedKmers++;
+						return;
+					}
+					totals->TotalNumSequencesN++;
+
+					combine.push_back(
+							config.canonicalEnable > 0 ?
+									long_kmer_canonical(code, k) : code);
+					if (combine.size() == (size_t) config.combineSize) {
+						long_table_flush(table, combine);
+					}
+				});
+	}
+	long_table_flush(table, combine);
+}
+/*
+ * count_kmers_with_table() for kmers of more than MAX_CODE_K bases.
+ */
+long_table_t *count_long_kmers(unsigned long long * const baseCounter,
+		statistics_t * const baseStatistics,
+		unsigned long long * const TotalNumSequencesN,
+		scan_summary_t * const summary) {
+	long_table_t *table = long_table_create(config.engine, config.k);
+
+	segment_source_t source;
+	segment_source_open(&source, summary);
+	vector<table_worker_t> totals(config.threads);
+	vector<thread> workers;
+	for (int t = 0; t < config.threads; t++) {
+		memset(&totals[t], 0, sizeof(table_worker_t));
+		workers.push_back(
+				thread(long_count_worker, &source, table, &totals[t]));
+	}
+	for (int t = 0; t < config.threads; t++) {
+		workers[t].join();
+		*baseCounter += totals[t].baseCounter;
+		*TotalNumSequencesN += totals[t].TotalNumSequencesN;
+		summary->maskedKmers += totals[t].maskedKmers;
+		for (int b = 0; b < 4; b++) {
+			baseStatistics[b].Count += totals[t].baseCounts[b];
+		}
+	}
+
+	segment_source_close(&source);
+	long_table_finish(table, config.threads);
+	return table;
+}
+/*
+ * histo_table() for a long kmer table, a range for each bucket.
+ */
+void histo_long_table(const long_table_t * const table,
+		const statistics_t * const baseStatistics,
+		const unsigned long long TotalNumSequencesN) {
+	const int k = table->k;
+	write_histogram_ranges(table->numPartitions,
+			[&](size_t r, FILE *out, int *array, vector<kmer_code_t> &) {
+				const vector<long_kmer_count_t> &counts = table->partitions[r].counts;
+				for (size_t i = 0; i < counts.size(); i++) {
+					for (int b = 0; b < k; b++) {
+						array[b] = long_kmer_bits(counts[i].code, 2 * (k - 1 - b)) & 3;
+					}
+					histo_write_kmer(array, k, counts[i].count, baseStatistics,
+							TotalNumSequencesN, out);
+				}
+			});
+}
+//A kmer enriched in consecutive windows of a record, written as one line of the --window file.
+struct window_run_t {
+	unsigned long long start; //first base of the first window.
+	unsigned long long end; //one past the last base of the last window.
+	unsigned long long lastWindow; //index of the last window the kmer was enriched in.
+	unsigned int maxCount;
+	double expected; //count expected in one window.
+};
+/* log10 of the chance of at least c from a Poisson distribution of the given mean. */
+double poisson_log10_tail(const unsigned int c, const double mean) {
+	//the terms from c on, relative to the first, shrink once i passes the mean.
+	double sum = 0;
+	double term = 1;
+	for (unsigned int i = c; term > 1e-12 * sum; i++) {
+		sum += term;
+		term *= mean / (i + 1);
+	}
+	return (-mean + c * log(mean) - lgamma(c + 1.0) + log(sum)) / log(10.0);
+}
+/*
+ * --window. Streams every record again with a window of W bases moved S bases at a time and writes
+ * <k>mer_Windows_Of_<sequence_file>.bed, the stretches where a kmer is found more often than its
+ * genome-wide count predicts. A window of W - k + 1 of the N kmers of the file holds each of them with
+ * probability q = (W - k + 1) / N, so a kmer found c times in the file is expected c q times in a window.
+ * A count is enriched when it is at least 2 and a Poisson count of that mean reaches it with a chance
+ * below --window-p divided by the kmers of the N / S windows of the file.
+ * Window counts are kept incrementally, adding the kmers that enter and removing the kmers that leave,
+ * and the threshold count only depends on the genome-wide count, so each window only looks at the kmers
+ * over theirs. Consecutive windows a kmer is enriched in are one line with its highest count.
+ * Records are scanned in parallel and written in file order.
+ */
+void write_window_enrichment(const count_table_t * const table,
+		const unsigned long long TotalNumSequencesN) {
+	const unsigned long long W = config.windowSize;
+	const unsigned long long S = config.windowStep;
+	const int span = config.span;
+	const double q = min(1.0,
+			(double) (W - span + 1) / max(TotalNumSequencesN, 1ULL));
+	const double windows = max(1.0, (double) TotalNumSequencesN / S);
+	//every kmer of every window is a test.
+	const double tests = windows * (W - span + 1);
+	const double log10Alpha = log10(config.windowP / tests);
+
+	size_t length = 0;
+	char *buffer = NULL;
+	vector<record_t> records;
+	if (config.packedCache) {
+		index_packed_records(config.packedCache, records);
+	} else {
+		buffer = load_sequence_file(&length);
+		index_records(buffer, length, records);
+	}
+
+	char *window_file_name = build_out_file_name("mer_Windows_Of_", ".bed");
+	FILE *window_file_pointer = fopen(window_file_name, "wb");
+	if (!window_file_pointer) {
+		fprintf(stderr,
+				"Window out file failed to open\nFile MUST be in current directory.\n");
+		exit(EXIT_FAILURE);
+	}
+	fprintf(window_file_pointer,
+			"#record\tstart\tend\tkmer\tcount\texpected\t-log10 p\t(%llu base windows every %llu bases, p < %g over %0.0f window kmers)\n",
+			W, S, config.windowP, tests);
+
+	atomic<unsigned long long> enrichedLines(0);
+	write_histogram_ranges(records.size(),
+			[&](size_t r, FILE *out, int *array, vector<kmer_code_t> &) {
+				const record_t &record = records[r];
+				int nameLength = 0;
+				while (record.id && nameLength < (int) record.idLength
+						&& !isspace((unsigned char) record.id[nameLength])) {
+					nameLength++;
+				}
+				const char *name = nameLength ? record.id : config.sequence_file;
+				if (!nameLength) {
+					nameLength = strlen(config.sequence_file);
+				}
+
+				//count in the window and the count that makes the kmer enriched.
+				unordered_map<kmer_code_t, pair<unsigned int, unsigned int> > counts;
+				unordered_map<unsigned long long, unsigned int> thresholds; //by genome-wide count.
+				unordered_set<kmer_code_t> over;
+				unordered_map<kmer_code_t, window_run_t> runs;
+				vector<pair<kmer_code_t, window_run_t> > finished;
+				deque<pair<unsigned long long, kmer_code_t> > inWindow;
+				unsigned long long windowStart = 0;
+
+				auto evaluate = [&]() {
+					const unsigned long long window = windowStart / S;
+					for (unordered_set<kmer_code_t>::const_iterator o = over.begin();
+							o != over.end(); o++) {
+						unordered_map<kmer_code_t, window_run_t>::iterator found =
+								runs.find(*o);
+						if (found != runs.end() && found->second.lastWindow + 1 != window) {
+							finished.push_back(*found);
+							runs.erase(found);
+							found = runs.end();
+						}
+						if (found == runs.end()) {
+							window_run_t run = { windowStart, 0, 0, 0,
+									count_table_get(table, *o) * q };
+							found = runs.insert(make_pair(*o, run)).first;
+						}
+						window_run_t &run = found->second;
+						run.end = windowStart + W;
+						run.lastWindow = window;
+						run.maxCount = max(run.maxCount, counts[*o].first);
+					}
+					//the kmers that were enriched up to the window before end their line.
+					for (unordered_map<kmer_code_t, window_run_t>::iterator run = runs.begin();
+							run != runs.end();) {
+						if (run->second.lastWindow != window) {
+							finished.push_back(*run);
+							run = runs.erase(run);
+						} else {
+							run++;
+						}
+					}
+				};
+
+				scan_record_kmers(record, config.k,
+						[&](kmer_code_t code, size_t offset, bool masked,
+								kmer_code_t) {
+							if (masked) {
+								return;
+							}
+							//every window this kmer does not fit in is complete.
+							while (offset + span > windowStart + W) {
+								if (!inWindow.empty()) {
+									evaluate();
+								}
+								windowStart += S;
+								while (!inWindow.empty() && inWindow.front().first < windowStart) {
+									const kmer_code_t leaving = inWindow.front().second;
+									inWindow.pop_front();
+									pair<unsigned int, unsigned int> &count = counts[leaving];
+									if (--count.first < count.second) {
+										over.erase(leaving);
+									}
+									if (!count.first) {
+										counts.erase(leaving);
+									}
+								}
+							}
+							inWindow.push_back(make_pair(offset, code));
+							pair<unsigned int, unsigned int> &count = counts[code];
+							if (!count.first) {
+								const unsigned long long global = count_table_get(table, code);
+								unsigned int &threshold = thresholds[global];
+								if (!threshold) {
+									const double mean = max(global * q, 1e-300);
+									threshold = max(2.0, floor(mean) + 1);
+									while (poisson_log10_tail(threshold, mean) > log10Alpha) {
+										threshold++;
+									}
+								}
+								count.second = threshold;
+							}
+							if (++count.first == count.second) {
+								over.insert(code);
+							}
+						});
+				if (!inWindow.empty()) {
+					evaluate();
+				}
+				finished.insert(finished.end(), runs.begin(), runs.end());
+
+				//by position like a BED file, then by kmer.
+				sort(finished.begin(), finished.end(),
+						[](const pair<kmer_code_t, window_run_t> &a,
+								const pair<kmer_code_t, window_run_t> &b) {
+							return a.second.start < b.second.start
+									|| (a.second.start == b.second.start && a.first < b.first);
+						});
+				for (size_t f = 0; f < finished.size(); f++) {
+					const window_run_t &run = finished[f].second;
+					fprintf(out, "%.*s\t%llu\t%llu\t", nameLength, name, run.start,
+							run.end);
+					for (int i = 0; i < config.k; i++) {
+						array[i] = (finished[f].first >> (2 * (config.k - 1 - i))) & 3;
+					}
+					write_kmer_bases(array, config.k, out);
+					fprintf(out, "\t%u\t%0.3g\t%0.2f\n", run.maxCount, run.expected,
+							min(300.0, -poisson_log10_tail(run.maxCount, run.expected)
+									- log10(tests)));
+				}
+				enrichedLines += finished.size();
+			}, window_file_pointer);
+
+	if (fclose(window_file_pointer) == EOF) {
+		fprintf(stderr, "Window out file close error!\n");
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stdout,
+			"Found %llu stretches of kmers enriched in %llu base windows of %zu records.\n",
+			(unsigned long long) enrichedLines, W, records.size());
+	fprintf(stdout,
+			"Your enriched windows can be found in the current directory as: \n    %s\n",
+			window_file_name);
+	free(window_file_name);
+	free(buffer);
+}
+/*
+ * Frozen index written by --mphf, a minimal perfect hash of the kmers of the run:
+ *   mphf_header_t
+ *   unsigned long long bits[numWords]         the levels one after another, a set bit is a kmer placed there
+ *   unsigned long long ranks[numWords / 8 + 1] set bits before every 512 bit block
+ *   kmer_code_t fallback[numFallback]         ascending, the kmers that collided on every level
+ *   unsigned long long counts[]               countBits per kmer, by hash index
+ *   unsigned long long fingerprints[]         fingerprintBits per kmer, by hash index
+ * A kmer found on level l at bit b has the index of the set bits before b, a fallback kmer
+ * the index of the set bits plus its place in the fallback.
+ * Levels are gamma times as many bits as the kmers left, as in BBHash.
+ */
+#define MPHF_FILE_MAGIC "FKMPHF1"
+struct mphf_header_t {
+	char magic[8];
+	unsigned int k;
+	unsigned int numLevels;
+	unsigned int countBits;
+	unsigned int fingerprintBits;
+	unsigned long long numKmers;
+	unsigned long long numWords;
+	unsigned long long numFallback;
+	unsigned long long levelWords[MPHF_MAX_LEVELS];
+	unsigned long long TotalNumSequencesN;
+	unsigned long long baseCounts[4];
+};
+//A frozen index, either being built or mapped from its file.
+struct mphf_t {
+	mphf_header_t header;
+	const unsigned long long *bits;
+	const unsigned long long *ranks;
+	const kmer_code_t *fallback;
+	const unsigned long long *counts;
+	const unsigned long long *fingerprints;
+	unsigned long long levelStart[MPHF_MAX_LEVELS]; //first word of each level.
+	unsigned long long ranked; //kmers placed on a level, the fallback indexes start here.
+};
+static inline unsigned long long mphf_hash(const kmer_code_t code,
+		const int level) {
+	return fmix64(code + (level + 1) * 0x9E3779B97F4A7C15ULL);
+}
+static inline unsigned long long mphf_fingerprint(const kmer_code_t code,
+		const unsigned int bits) {
+	return bits ? fmix64(code ^ 0xC2B2AE3D27D4EB4FULL) >> (64 - bits) : 0;
+}
+//Words of an array of n values of the given bits, with a word to spare for the last value.
+static inline unsigned long long packed_array_words(const unsigned long long n,
+		const unsigned int bits) {
+	return (n * bits + 63) / 64 + 1;
+}
+//Sets a value of a zeroed packed array. Values of other threads may share its words.
+static inline void packed_array_set(unsigned long long * const words,
+		const unsigned long long index, const unsigned int bits,
+		const unsigned long long value) {
+	if (!bits) {
+		return;
+	}
+	const unsigned long long bit = index * bits;
+	const unsigned int shift = bit & 63;
+	__atomic_fetch_or(&words[bit >> 6], value << shift, __ATOMIC_RELAXED);
+	if (shift + bits > 64) {
+		__atomic_fetch_or(&words[(bit >> 6) + 1], value >> (64 - shift),
+				__ATOMIC_RELAXED);
+	}
+}
+static inline unsigned long long packed_array_get(
+		const unsigned long long * const words, const unsigned long long index,
+		const unsigned int bits) {
+	if (!bits) {
+		return 0;
+	}
+	const unsigned long long bit = index * bits;
+	const unsigned int shift = bit & 63;
+	unsigned long long value = words[bit >> 6] >> shift;
+	if (shift + bits > 64) {
+		value |= words[(bit >> 6) + 1] << (64 - shift);
+	}
+	return bits == 64 ? value : value & ((1ULL << bits) - 1);
+}
+/* Sets levelStart and ranked once the header and the arrays are in place. */
+void mphf_layout(mphf_t * const mphf) {
+	unsigned long long start = 0;
+	for (unsigned int l = 0; l < mphf->header.numLevels; l++) {
+		mphf->levelStart[l] = start;
+		start += mphf->header.levelWords[l];
+	}
+	mphf->ranked = mphf->header.numKmers - mphf->header.numFallback;
+}
+/* Hash index of a kmer, numKmers if it is not a kmer of the index. */
+unsigned long long mphf_index(const mphf_t * const mphf,
+		const kmer_code_t code) {
+	for (unsigned int l = 0; l < mphf->header.numLevels; l++) {
+		const unsigned long long bit = mphf->levelStart[l] * 64
+				+ mphf_hash(code, l) % (mphf->header.levelWords[l] * 64);
+		const unsigned long long word = bit >> 6;
+		const unsigned long long mask = 1ULL << (bit & 63);
+		if (mphf->bits[word] & mask) {
+			unsigned long long rank = mphf->ranks[word / 8];
+			for (unsigned long long w = word & ~7ULL; w < word; w++) {
+				rank += __builtin_popcountll(mphf->bits[w]);
+			}
+			return rank + __builtin_popcountll(mphf->bits[word] & (mask - 1));
+		}
+	}
+	const kmer_code_t *last = mphf->fallback + mphf->header.numFallback;
+	const kmer_code_t *found = lower_bound(mphf->fallback, last, code);
+	if (found != last && *found == code) {
+		return mphf->ranked + (found - mphf->fallback);
+	}
+	return mphf->header.numKmers;
+}
+/*
+ * Frequency of a kmer, false if the index knows it is not one of its kmers. Without fingerprints
+ * most kmers that are not in the index get the frequency of one that is.
+ */
+bool mphf_lookup(const mphf_t * const mphf, const kmer_code_t code,
+		unsigned long long * const frequency) {
+	const unsigned long long index = mphf_index(mphf, code);
+	if (index >= mphf->header.numKmers
+			|| packed_array_get(mphf->fingerprints, index,
+					mphf->header.fingerprintBits)
+					!= mphf_fingerprint(code, mphf->header.fingerprintBits)) {
+		return false;
+	}
+	*frequency = packed_array_get(mphf->counts, index, mphf->header.countBits);
+	return true;
+}
+/*
+ * Runs part(t, first, last) over [0, n) split into config.threads parts, thread t doing part t.
+ */
+template<typename callback_t>
+void mphf_parallel(const size_t n, callback_t part) {
+	vector<thread> workers;
+	for (int t = 0; t < config.threads; t++) {
+		workers.push_back(
+				thread(part, t, n * t / config.threads,
+						n * (t + 1) / config.threads));
+	}
+	for (int t = 0; t < config.threads; t++) {
+		workers[t].join();
+	}
+}
+/*
+ * --mphf. Freezes the kmers of a count table into a minimal perfect hash with their counts
+ * and --fingerprint-bits fingerprints, a few bits per kmer plus the counter, and writes it to
+ * <k>mer_Frozen_Of_<sequence_file>.mphf. Every level and the counts are built on config.threads threads.
+ */
+void write_mphf_index(const count_table_t * const table,
+		const statistics_t * const baseStatistics,
+		const unsigned long long TotalNumSequencesN) {
+	vector<kmer_count_t> kmers;
+	kmers.reserve(count_table_distinct(table));
+	unsigned long long maxCount = 1;
+	count_table_for_each(table,
+			[&](kmer_code_t code, unsigned long long frequency) {
+				kmer_count_t kmer = { code, frequency };
+				kmers.push_back(kmer);
+				maxCount = max(maxCount, frequency);
+			});
+
+	mphf_t mphf;
+	memset(&mphf, 0, sizeof(mphf));
+	memcpy(mphf.header.magic, MPHF_FILE_MAGIC, 8);
+	mphf.header.k = config.k;
+	mphf.header.countBits = 64 - __builtin_clzll(maxCount);
+	mphf.header.fingerprintBits = config.fingerprintBits;
+	mphf.header.numKmers = kmers.size();
+	mphf.header.TotalNumSequencesN = TotalNumSequencesN;
+	for (int b = 0; b < 4; b++) {
+		mphf.header.baseCounts[b] = baseStatistics[b].Count;
+	}
+
+	//each level keeps the kmers that hash to a bit no other kmer left hashes to.
+	vector<kmer_code_t> left(kmers.size());
+	for (size_t i = 0; i < kmers.size(); i++) {
+		left[i] = kmers[i].code;
+	}
+	vector<unsigned long long> bits;
+	while (!left.empty() && mphf.header.numLevels < MPHF_MAX_LEVELS) {
+		const int level = mphf.header.numLevels;
+		const unsigned long long words = (left.size() * MPHF_GAMMA + 63) / 64;
+		const unsigned long long levelBits = words * 64;
+		vector<unsigned long long> seen(words, 0);
+		vector<unsigned long long> collided(words, 0);
+		mphf_parallel(left.size(), [&](int, size_t first, size_t last) {
+			for (size_t i = first; i < last; i++) {
+				const unsigned long long bit = mphf_hash(left[i], level) % levelBits;
+				const unsigned long long mask = 1ULL << (bit & 63);
+				if (__atomic_fetch_or(&seen[bit >> 6], mask, __ATOMIC_RELAXED) & mask) {
+					__atomic_fetch_or(&collided[bit >> 6], mask, __ATOMIC_RELAXED);
+				}
+			}
+		});
+		vector<vector<kmer_code_t> > next(config.threads);
+		mphf_parallel(left.size(), [&](int t, size_t first, size_t last) {
+			vector<kmer_code_t> &collisions = next[t];
+			for (size_t i = first; i < last; i++) {
+				const unsigned long long bit = mphf_hash(left[i], level) % levelBits;
+				if (collided[bit >> 6] & (1ULL << (bit & 63))) {
+					collisions.push_back(left[i]);
+				}
+			}
+		});
+		for (unsigned long long w = 0; w < words; w++) {
+			bits.push_back(seen[w] & ~collided[w]);
+		}
+		mphf.header.levelWords[level] = words;
+		mphf.header.numLevels++;
+
+		left.clear();
+		for (int t = 0; t < config.threads; t++) {
+			left.insert(left.end(), next[t].begin(), next[t].end());
+		}
+	}
+	sort(left.begin(), left.end());
+	mphf.header.numFallback = left.size();
+	mphf.header.numWords = bits.size();
+
+	vector<unsigned long long> ranks(bits.size() / 8 + 1, 0);
+	unsigned long long rank = 0;
+	for (size_t w = 0; w < bits.size(); w++) {
+		if (w % 8 == 0) {
+			ranks[w / 8] = rank;
+		}
+		rank += __builtin_popcountll(bits[w]);
+	}
+	if (bits.size() % 8 == 0) {
+		ranks[bits.size() / 8] = rank;
+	}
+
+	vector<unsigned long long> counts(
+			packed_array_words(kmers.size(), mphf.header.countBits), 0);
+	vector<unsigned long long> fingerprints(
+			packed_array_words(kmers.size(), mphf.header.fingerprintBits), 0);
+	mphf.bits = bits.data();
+	mphf.ranks = ranks.data();
+	mphf.fallback = left.data();
+	mphf_layout(&mphf);
+	mphf_parallel(kmers.size(), [&](int, size_t first, size_t last) {
+		for (size_t i = first; i < last; i++) {
+			const unsigned long long index = mphf_index(&mphf, kmers[i].code);
+			packed_array_set(counts.data(), index, mphf.header.countBits,
+					kmers[i].count);
+			packed_array_set(fingerprints.data(), index, mphf.header.fingerprintBits,
+					mphf_fingerprint(kmers[i].code, mphf.header.fingerprintBits));
+		}
+	});
+
+	char *mphf_file_name = build_out_file_name("mer_Frozen_Of_", ".mphf");
+	FILE *mphf_file_pointer = fopen(mphf_file_name, "wb");
+	if (!mphf_file_pointer) {
+		fprintf(stderr,
+				"Frozen index out file failed to open\nFile MUST be in current directory.\n");
+		exit(EXIT_FAILURE);
+	}
+	write_or_die(&mphf.header, sizeof(mphf_header_t), 1, mphf_file_pointer);
+	write_or_die(bits.data(), sizeof(unsigned long long), bits.size(),
+			mphf_file_pointer);
+	write_or_die(ranks.data(), sizeof(unsigned long long), ranks.size(),
+			mphf_file_pointer);
+	write_or_die(left.data(), sizeof(kmer_code_t), left.size(),
+			mphf_file_pointer);
+	write_or_die(counts.data(), sizeof(unsigned long long), counts.size(),
+			mphf_file_pointer);
+	write_or_die(fingerprints.data(), sizeof(unsigned long long),
+			fingerprints.size(), mphf_file_pointer);
+	const unsigned long long bytes = ftell(mphf_file_pointer);
+	if (fclose(mphf_file_pointer) == EOF) {
+		fprintf(stderr, "Frozen index out file close error!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	const double hashBits = kmers.empty() ? 0 :
+			(bits.size() + ranks.size() + left.size()) * 64.0 / kmers.size();
+	fprintf(stdout,
+			"Froze %llu kmers in %0.1f mibibytes, %0.2f bits per kmer of hash on %u levels with %llu left over, %u bit counts and %u bit fingerprints.\n",
+			mphf.header.numKmers, bytes / (double) (1024 * 1024), hashBits,
+			mphf.header.numLevels, mphf.header.numFallback,
+			mphf.header.countBits, mphf.header.fingerprintBits);
+	fprintf(stdout,
+			"Your frozen index can be found in the current directory as: \n    %s\n",
+			mphf_file_name);
+	free(mphf_file_name);
+}
+/*
+ * "findKmer lookup <mphf_file> <kmer> ...". Maps a frozen index written by --mphf and prints
+ * the kmer and its frequency for every kmer given, 0 for the kmers the fingerprints reject.
+ */
+int lookup_mphf(int argc, char **argv) {
+	if (argc < 4) {
+		fprintf(stderr,
+				"Usage is \"findKmer lookup 12mer_Frozen_Of_genome.fa.mphf GATTACAAGATT\".\n");
+		return EXIT_FAILURE;
+	}
+	int fd = open(argv[2], O_RDONLY);
+	struct stat fileStat;
+	if (fd < 0 || fstat(fd, &fileStat) != 0
+			|| (size_t) fileStat.st_size < sizeof(mphf_header_t)) {
+		fprintf(stderr, "%s is not a frozen index.\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+	void *map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Unable to map frozen index %s\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+	madvise(map, fileStat.st_size, MADV_RANDOM);
+
+	mphf_t mphf;
+	memcpy(&mphf.header, map, sizeof(mphf_header_t));
+	const mphf_header_t &header = mphf.header;
+	mphf.bits = (const unsigned long long*) ((const char*) map
+			+ sizeof(mphf_header_t));
+	mphf.ranks = mphf.bits + header.numWords;
+	mphf.fallback = (const kmer_code_t*) (mphf.ranks + header.numWords / 8 + 1);
+	mphf.counts = (const unsigned long long*) (mphf.fallback
+			+ header.numFallback);
+	mphf.fingerprints = mphf.counts
+			+ packed_array_words(header.numKmers, header.countBits);
+	if (memcmp(header.magic, MPHF_FILE_MAGIC, 8) != 0
+			|| header.numLevels > MPHF_MAX_LEVELS
+			|| (const char*) (mphf.fingerprints
+					+ packed_array_words(header.numKmers,
+							header.fingerprintBits))
+					> (const char*) map + fileStat.st_size) {
+		fprintf(stderr, "%s is not a frozen index or is truncated.\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+	mphf_layout(&mphf);
+
+	for (int i = 3; i < argc; i++) {
+		const char *kmer = argv[i];
+		kmer_code_t code = 0;
+		unsigned int bases = 0;
+		bool valid = true;
+		for (const char *c = kmer; valid && *c; c++) {
+			//the gaps of a --pattern kmer, as the histogram writes it.
+			if (*c == '.') {
+				continue;
+			}
+			const int codedBase = baseCodeTable[(unsigned char) *c];
+			valid = codedBase >= 0;
+			code = (code << 2) | (codedBase & 3);
+			bases++;
+		}
+		if (!valid || bases != header.k) {
+			fprintf(stderr, "%s is not a %umer of A, C, G and T.\n", kmer,
+					header.k);
+			continue;
+		}
+		unsigned long long frequency = 0;
+		mphf_lookup(&mphf, code, &frequency);
+		fprintf(stdout, "%s\t%llu\n", kmer, frequency);
+	}
+
+	munmap(map, fileStat.st_size);
+	return EXIT_SUCCESS;
+}
+/*
+ * Shard file written by --shard, one per shard:
+ *   shard_header_t
+ *   char sequenceName[sequenceNameLength]   the -p file, names the merged out files
+ *   kmer_count_t kmers[numKmers]            ascending by code
+ * The base statistics are of the whole file, every shard of a run holds the same ones.
+ */
+struct shard_header_t {
+	char magic[8];
+	unsigned int k;
+	unsigned int shardIndex;
+	unsigned int shardCount;
+	unsigned int sequenceNameLength;
+	unsigned int dedupEnable;
+	unsigned int maskEnable; //--min-entropy or --dust.
+	unsigned long long baseCounter;
+	unsigned long long baseCounts[4];
+	unsigned long long TotalNumSequencesN;
+	unsigned long long records;
+	unsigned long long duplicateRecords;
+	unsigned long long maskedKmers;
+	unsigned long long numKmers;
+};
+void write_shard_file(const count_table_t * const table,
+		const unsigned long long baseCounter,
+		const statistics_t * const baseStatistics,
+		const unsigned long long TotalNumSequencesN,
+		const scan_summary_t * const summary) {
+	shard_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SHARD_FILE_MAGIC, 8);
+	header.k = config.k;
+	header.shardIndex = config.shardIndex;
+	header.shardCount = config.shardCount;
+	header.sequenceNameLength = strlen(config.sequence_file);
+	header.dedupEnable = config.dedupEnable > 0;
+	header.maskEnable = masking_enabled();
+	header.baseCounter = baseCounter;
+	for (int b = 0; b < 4; b++) {
+		header.baseCounts[b] = baseStatistics[b].Count;
+	}
+	header.TotalNumSequencesN = TotalNumSequencesN;
+	header.records = summary->records;
+	header.duplicateRecords = summary->duplicateRecords;
+	header.maskedKmers = summary->maskedKmers;
+	header.numKmers = count_table_distinct(table);
+
+	write_or_die(&header, sizeof(header), 1, config.out_file_pointer);
+	write_or_die(config.sequence_file, sizeof(char), header.sequenceNameLength,
+			config.out_file_pointer);
+	count_table_for_each(table,
+			[](kmer_code_t code, unsigned long long frequency) {
+				kmer_count_t kmer = {code, frequency};
+				write_or_die(&kmer, sizeof(kmer), 1, config.out_file_pointer);
+			});
+	fprintf(stdout, "Wrote %llu kmers of shard %d of %d.\n", header.numKmers,
+			config.shardIndex, config.shardCount);
+}
+//One open shard file during a merge, read a chunk of kmers at a time.
+struct shard_reader_t {
+	FILE *file;
+	shard_header_t header;
+	vector<kmer_count_t> chunk;
+	size_t position;
+	unsigned long long remaining; //kmers not yet read into the chunk.
+};
+void open_shard(shard_reader_t * const shard, const char * const filename) {
+	if ((shard->file = fopen(filename, "rb")) == NULL
+			|| fread(&shard->header, sizeof(shard_header_t), 1, shard->file) != 1
+			|| memcmp(shard->header.magic, SHARD_FILE_MAGIC, 8) != 0) {
+		fprintf(stderr, "%s is not a shard file.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	fseek(shard->file, shard->header.sequenceNameLength, SEEK_CUR);
+	shard->position = 0;
+	shard->remaining = shard->header.numKmers;
+}
+/* Reads the next kmer of a shard, false at the end of the shard. */
+bool next_shard_kmer(shard_reader_t * const shard, kmer_count_t * const kmer) {
+	if (shard->position == shard->chunk.size()) {
+		if (!shard->remaining) {
+			return false;
+		}
+		shard->chunk.resize(min(shard->remaining, (unsigned long long) 4096));
+		if (fread(shard->chunk.data(), sizeof(kmer_count_t), shard->chunk.size(),
+				shard->file) != shard->chunk.size()) {
+			fprintf(stderr, "Shard %u is truncated.\n",
+					shard->header.shardIndex);
+			exit(EXIT_FAILURE);
+		}
+		shard->remaining -= shard->chunk.size();
+		shard->position = 0;
+	}
+	*kmer = shard->chunk[shard->position++];
+	return true;
+}
+/*
+ * Reads the k and sequence file name of the first shard so "findKmer merge" names
+ * its out files like the run that was split into shards.
+ */
+void read_merge_identity() {
+	shard_reader_t shard;
+	open_shard(&shard, config.mergeFiles[0]);
+	if (config.k && config.k != (int) shard.header.k) {
+		fprintf(stderr, "The shards are %umers, not %dmers.\n", shard.header.k,
+				config.k);
+		exit(EXIT_FAILURE);
+	}
+	config.k = shard.header.k;
+	char *name = (char*) allocate_array(shard.header.sequenceNameLength + 1,
+			sizeof(char));
+	fseek(shard.file, sizeof(shard_header_t), SEEK_SET);
+	if (fread(name, sizeof(char), shard.header.sequenceNameLength, shard.file)
+			!= shard.header.sequenceNameLength) {
+		fprintf(stderr, "%s is truncated.\n", config.mergeFiles[0]);
+		exit(EXIT_FAILURE);
+	}
+	config.sequence_file = name;
+	config.dedupEnable = shard.header.dedupEnable;
+	fclose(shard.file);
+}
+/*
+ * A count database for "findKmer serve": a shard file of a --shard 0/1 run, mapped.
+ * Its kmers are in ascending code order, so point lookups and prefix ranges are binary searches.
+ * byZ holds every kmer in descending Z score order for TOP.
+ */
+struct kmer_z_t {
+	double z;
+	unsigned long long kmer; //index into kmers.
+};
+struct count_db_t {
+	void *map;
+	size_t size;
+	const shard_header_t *header;
+	const kmer_count_t *kmers;
+	long double probabilities[4]; //of A, C, G and T in the counted file.
+	vector<kmer_z_t> byZ;
+};
+volatile sig_atomic_t serveStop = 0; //set by SIGINT and SIGTERM.
+void serve_signal(int) {
+	serveStop = 1;
+}
+/* Z score of a kmer found frequency times, the same way histo_write_kmer() scores it. */
+long double count_db_z(const count_db_t * const db, const kmer_code_t code,
+		const unsigned long long frequency) {
+	int counts[4] = { 0, 0, 0, 0 };
+	for (unsigned int i = 0; i < db->header->k; i++) {
+		counts[(code >> (2 * i)) & 3]++;
+	}
+	double estimatedProportion = 1;
+	for (int i = 0; i < 4; i++) {
+		estimatedProportion *= pow((double) db->probabilities[i],
+				(double) counts[i]);
+	}
+	const unsigned long long n = db->header->TotalNumSequencesN;
+	const long double p = estimatedProportion;
+	const long double q = 1 - p;
+	return (frequency - n * p) / sqrt(n * p * q);
+}
+/* Shannon entropy per base of a kmer, the h column of the histogram. */
+double count_db_entropy(const count_db_t * const db, const kmer_code_t code) {
+	int counts[4] = { 0, 0, 0, 0 };
+	for (unsigned int i = 0; i < db->header->k; i++) {
+		counts[(code >> (2 * i)) & 3]++;
+	}
+	double h = 0;
+	for (int i = 0; i < 4; i++) {
+		if (counts[i]) {
+			const double p = (double) counts[i] / db->header->k;
+			h += p * log2(1 / p);
+		}
+	}
+	return h;
+}
+/* The kmers whose codes are in [first, last), as indexes into db->kmers. */
+void count_db_range(const count_db_t * const db, const kmer_code_t first,
+		const kmer_code_t last, unsigned long long * const begin,
+		unsigned long long * const end) {
+	const kmer_count_t *kmers = db->kmers;
+	const kmer_count_t *stop = kmers + db->header->numKmers;
+	auto before = [](const kmer_count_t &a, const kmer_code_t b) {
+		return a.code < b;
+	};
+	*begin = lower_bound(kmers, stop, first, before) - kmers;
+	*end = lower_bound(kmers + *begin, stop, last, before) - kmers;
+}
+/*
+ * Maps a --shard 0/1 file for serving and ranks its kmers by Z score.
+ */
+void open_count_db(count_db_t * const db, const char * const filename) {
+	int fd = open(filename, O_RDONLY);
+	struct stat fileStat;
+	if (fd < 0 || fstat(fd, &fileStat) != 0
+			|| (size_t) fileStat.st_size < sizeof(shard_header_t)) {
+		fprintf(stderr, "%s is not a shard file.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	db->size = fileStat.st_size;
+	db->map = mmap(NULL, db->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (db->map == MAP_FAILED) {
+		fprintf(stderr, "Unable to map %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	//keep it all resident, lookups are random.
+	madvise(db->map, db->size, MADV_WILLNEED);
+
+	db->header = (const shard_header_t*) db->map;
+	db->kmers = (const kmer_count_t*) ((const char*) db->map
+			+ sizeof(shard_header_t) + db->header->sequenceNameLength);
+	if (memcmp(db->header->magic, SHARD_FILE_MAGIC, 8) != 0
+			|| sizeof(shard_header_t) + db->header->sequenceNameLength
+					+ db->header->numKmers * sizeof(kmer_count_t) != db->size) {
+		fprintf(stderr, "%s is not a shard file or is truncated.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	if (db->header->shardCount != 1) {
+		fprintf(stderr,
+				"%s is shard %u of %u. Serve the counts of a whole file, counted with --shard 0/1.\n",
+				filename, db->header->shardIndex, db->header->shardCount);
+		exit(EXIT_FAILURE);
+	}
+	for (int b = 0; b < 4; b++) {
+		db->probabilities[b] = (double) db->header->baseCounts[b]
+				/ db->header->baseCounter;
+	}
+
+	db->byZ.resize(db->header->numKmers);
+	for (unsigned long long i = 0; i < db->header->numKmers; i++) {
+		db->byZ[i].z = count_db_z(db, db->kmers[i].code, db->kmers[i].count);
+		db->byZ[i].kmer = i;
+	}
+	sort(db->byZ.begin(), db->byZ.end(),
+			[](const kmer_z_t &a, const kmer_z_t &b) {
+				return a.z > b.z;
+			});
+	fprintf(stdout, "Serving %llu %umers of %.*s from %s.\n",
+			db->header->numKmers, db->header->k,
+			(int) db->header->sequenceNameLength,
+			(const char*) (db->header + 1), filename);
+}
+/* Parses bases into a code. Returns the number of bases, or -1 if one is not A, C, G or T. */
+int parse_bases(const char * const bases, kmer_code_t * const code) {
+	*code = 0;
+	int length = 0;
+	for (const char *c = bases; *c; c++, length++) {
+		const int codedBase = baseCodeTable[(unsigned char) *c];
+		if (codedBase < 0 || length == 32) {
+			return -1;
+		}
+		*code = (*code << 2) | codedBase;
+	}
+	return length;
+}
+/* Appends the "kmer<tab>frequency<tab>z" line of a kmer to out. */
+void serve_kmer_line(const count_db_t * const db, const kmer_code_t code,
+		const unsigned long long frequency, string &out) {
+	char line[128];
+	const int k = db->header->k;
+	for (int i = 0; i < k; i++) {
+		line[i] = int2base((code >> (2 * (k - 1 - i))) & 3);
+	}
+	const int length = k
+			+ sprintf(line + k, "\t%llu\t%LE\n", frequency,
+					count_db_z(db, code, frequency));
+	out.append(line, length);
+}
+/*
+ * Answers one line of the line protocol. Every answer ends with an empty line.
+ *   GET <kmer> [<kmer> ...]       a line for each kmer, frequency 0 if it was not found.
+ *   PREFIX <bases> [<limit>]      the found kmers starting with bases, in order.
+ *   TOP <n> [frequency <min>] [entropy <min h>] [prefix <bases>]
+ *                                 the n found kmers with the highest Z scores that pass the filters.
+ *   STATS                         what the database holds.
+ */
+void serve_line(const count_db_t * const db, char * const line,
+		string &out) {
+	const int k = db->header->k;
+	vector<char*> words;
+	for (char *word = strtok(line, " \t"); word; word = strtok(NULL, " \t")) {
+		words.push_back(word);
+	}
+	if (words.empty()) {
+		out += "ERR empty request\n\n";
+		return;
+	}
+
+	if (strcmp(words[0], "GET") == 0) {
+		for (size_t w = 1; w < words.size(); w++) {
+			kmer_code_t code;
+			if (parse_bases(words[w], &code) != k) {
+				out += "ERR ";
+				out += words[w];
+				out += " is not a kmer of this database\n";
+				continue;
+			}
+			unsigned long long begin, end;
+			count_db_range(db, code, code + 1, &begin, &end);
+			serve_kmer_line(db, code, begin < end ? db->kmers[begin].count : 0,
+					out);
+		}
+	} else if (strcmp(words[0], "PREFIX") == 0) {
+		kmer_code_t prefix;
+		const int length = words.size() > 1 ? parse_bases(words[1], &prefix) : -1;
+		const unsigned long long limit =
+				words.size() > 2 ? strtoull(words[2], NULL, 10) : ~0ULL;
+		if (length < 0 || length > k) {
+			out += "ERR usage is PREFIX <bases> [<limit>]\n";
+		} else {
+			const int shift = 2 * (k - length);
+			unsigned long long begin, end;
+			count_db_range(db, prefix << shift, (prefix + 1) << shift, &begin,
+					&end);
+			for (unsigned long long i = begin; i < end && i - begin < limit; i++) {
+				serve_kmer_line(db, db->kmers[i].code, db->kmers[i].count, out);
+			}
+		}
+	} else if (strcmp(words[0], "TOP") == 0) {
+		unsigned long long n = words.size() > 1 ? strtoull(words[1], NULL, 10) : 0;
+		unsigned long long minFrequency = 0;
+		double minEntropy = 0;
+		kmer_code_t prefix = 0;
+		int prefixLength = 0;
+		bool valid = words.size() > 1 && words.size() % 2 == 0;
+		for (size_t w = 2; valid && w + 1 < words.size(); w += 2) {
+			if (strcmp(words[w], "frequency") == 0) {
+				minFrequency = strtoull(words[w + 1], NULL, 10);
+			} else if (strcmp(words[w], "entropy") == 0) {
+				minEntropy = atof(words[w + 1]);
+			} else if (strcmp(words[w], "prefix") == 0) {
+				prefixLength = parse_bases(words[w + 1], &prefix);
+				valid = prefixLength >= 0 && prefixLength <= k;
+			} else {
+				valid = false;
+			}
+		}
+		if (!valid) {
+			out += "ERR usage is TOP <n> [frequency <min>] [entropy <min h>] [prefix <bases>]\n";
+		} else if (prefixLength > 0) {
+			//a prefix is a contiguous range of the kmers, rank just that range.
+			const int shift = 2 * (k - prefixLength);
+			unsigned long long begin, end;
+			count_db_range(db, prefix << shift, (prefix + 1) << shift, &begin,
+					&end);
+			vector<kmer_z_t> ranked;
+			for (unsigned long long i = begin; i < end; i++) {
+				if (db->kmers[i].count >= minFrequency
+						&& count_db_entropy(db, db->kmers[i].code) >= minEntropy) {
+					kmer_z_t kmer = { (double) count_db_z(db, db->kmers[i].code,
+							db->kmers[i].count), i };
+					ranked.push_back(kmer);
+				}
+			}
+			n = min(n, (unsigned long long) ranked.size());
+			partial_sort(ranked.begin(), ranked.begin() + n, ranked.end(),
+					[](const kmer_z_t &a, const kmer_z_t &b) {
+						return a.z > b.z;
+					});
+			for (unsigned long long i = 0; i < n; i++) {
+				const kmer_count_t &kmer = db->kmers[ranked[i].kmer];
+				serve_kmer_line(db, kmer.code, kmer.count, out);
+			}
+		} else {
+			for (size_t i = 0; i < db->byZ.size() && n > 0; i++) {
+				const kmer_count_t &kmer = db->kmers[db->byZ[i].kmer];
+				if (kmer.count >= minFrequency
+						&& count_db_entropy(db, kmer.code) >= minEntropy) {
+					serve_kmer_line(db, kmer.code, kmer.count, out);
+					n--;
+				}
+			}
+		}
+	} else if (strcmp(words[0], "STATS") == 0) {
+		char stats[512];
+		sprintf(stats,
+				"k\t%u\nsequence\t%.*s\nkmers\t%llu\nbases\t%llu\nkmer occurrences\t%llu\nrecords\t%llu\n",
+				db->header->k, (int) db->header->sequenceNameLength,
+				(const char*) (db->header + 1), db->header->numKmers,
+				db->header->baseCounter, db->header->TotalNumSequencesN,
+				db->header->records);
+		out += stats;
+	} else {
+		out += "ERR unknown request ";
+		out += words[0];
+		out += ", use GET, PREFIX, TOP or STATS\n";
+	}
+	out += "\n";
+}
+/*
+ * Answers a binary lookup: SERVE_BINARY_LOOKUP, a 32 bit count n and n 64 bit kmer codes,
+ * all little endian. The answer is n followed by a 64 bit frequency and a double Z score
+ * for each code. Codes that are not kmers of the database get frequency 0 and a NaN Z score.
+ */
+void serve_binary(const count_db_t * const db, const char * const request,
+		const unsigned int n, string &out) {
+	const kmer_code_t possible = ((kmer_code_t) 1) << (2 * db->header->k);
+	out.append((const char*) &n, sizeof(n));
+	for (unsigned int i = 0; i < n; i++) {
+		kmer_code_t code;
+		memcpy(&code, request + i * sizeof(code), sizeof(code));
+		unsigned long long frequency = 0;
+		double z = NAN;
+		if (code < possible) {
+			unsigned long long begin, end;
+			count_db_range(db, code, code + 1, &begin, &end);
+			frequency = begin < end ? db->kmers[begin].count : 0;
+			z = count_db_z(db, code, frequency);
+		}
+		out.append((const char*) &frequency, sizeof(frequency));
+		out.append((const char*) &z, sizeof(z));
+	}
+}
+//A client of "findKmer serve", or the listening socket itself.
+struct serve_connection_t {
+	int fd;
+	bool listener;
+	bool peerClosed; //the client will send nothing more, close once out is written.
+	string in; //bytes of requests not yet answered.
+	string out; //answers not yet written.
+};
+/*
+ * Answers the complete requests at the front of in. Returns false if the client broke the
+ * protocol and should be dropped.
+ */
+bool serve_requests(const count_db_t * const db,
+		serve_connection_t * const connection) {
+	string &in = connection->in;
+	size_t position = 0;
+	while (position < in.size()) {
+		if (in[position] == SERVE_BINARY_LOOKUP) {
+			unsigned int n;
+			if (in.size() - position < 1 + sizeof(n)) {
+				break;
+			}
+			memcpy(&n, in.data() + position + 1, sizeof(n));
+			if (n > SERVE_MAX_BATCH) {
+				return false;
+			}
+			const size_t length = 1 + sizeof(n) + (size_t) n * sizeof(kmer_code_t);
+			if (in.size() - position < length) {
+				break;
+			}
+			serve_binary(db, in.data() + position + 1 + sizeof(n), n,
+					connection->out);
+			position += length;
+		} else {
+			const size_t newline = in.find('\n', position);
+			if (newline == string::npos) {
+				if (in.size() - position > SERVE_MAX_LINE) {
+					return false;
+				}
+				break;
+			}
+			string line = in.substr(position, newline - position);
+			if (!line.empty() && line[line.size() - 1] == '\r') {
+				line.erase(line.size() - 1);
+			}
+			serve_line(db, &line[0], connection->out);
+			position = newline + 1;
+		}
+	}
+	in.erase(0, position);
+	return true;
+}
+/*
+ * One of the --threads server threads. They all wait on the same epoll set and every socket is
+ * registered EPOLLONESHOT, so the thread that gets an event owns that socket until it re-arms it
+ * and the requests of one client are answered in order without any locking.
+ */
+void serve_worker(const count_db_t * const db, const int epollFd) {
+	char buffer[65536];
+	while (!serveStop) {
+		struct epoll_event event;
+		if (epoll_wait(epollFd, &event, 1, 250) != 1) {
+			continue;
+		}
+		serve_connection_t *connection = (serve_connection_t*) event.data.ptr;
+
+		if (connection->listener) {
+			int fd;
+			while ((fd = accept4(connection->fd, NULL, NULL,
+					SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+				serve_connection_t *client = new serve_connection_t;
+				client->fd = fd;
+				client->listener = false;
+				client->peerClosed = false;
+				struct epoll_event clientEvent;
+				clientEvent.events = EPOLLIN | EPOLLONESHOT;
+				clientEvent.data.ptr = client;
+				epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &clientEvent);
+			}
+			event.events = EPOLLIN | EPOLLONESHOT;
+			epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+			continue;
+		}
+
+		bool valid = !(event.events & EPOLLERR);
+		if (valid && (event.events & (EPOLLIN | EPOLLHUP))) {
+			ssize_t bytes;
+			while ((bytes = read(connection->fd, buffer, sizeof(buffer))) > 0) {
+				connection->in.append(buffer, bytes);
+			}
+			if (bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+				connection->peerClosed = true;
+			}
+			valid = serve_requests(db, connection);
+		}
+		while (valid && !connection->out.empty()) {
+			const ssize_t bytes = send(connection->fd, connection->out.data(),
+					connection->out.size(), MSG_NOSIGNAL);
+			if (bytes < 0) {
+				valid = errno == EAGAIN || errno == EWOULDBLOCK;
+				break;
+			}
+			connection->out.erase(0, bytes);
+		}
+
+		if (!valid || (connection->peerClosed && connection->out.empty())) {
+			epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, NULL);
+			close(connection->fd);
+			delete connection;
+			continue;
+		}
+		event.events = EPOLLONESHOT;
+		if (!connection->peerClosed) {
+			event.events |= EPOLLIN;
+		}
+		if (!connection->out.empty()) {
+			event.events |= EPOLLOUT;
+		}
+		epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+	}
+}
+/*
+ * "findKmer serve --db <shard_file> --socket <path> [--threads|-t <threads>]".
+ * Keeps the counts of a --shard 0/1 run mapped and answers lookups over a UNIX domain socket
+ * until it gets SIGINT or SIGTERM. See serve_line() and serve_binary() for the requests.
+ */
+int serve_counts(int argc, char **argv) {
+	const char *dbFile = NULL;
+	const char *socketPath = NULL;
+	int threads = thread::hardware_concurrency();
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "--db") == 0 && i + 1 < argc) {
+			dbFile = argv[++i];
+		} else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+			socketPath = argv[++i];
+		} else if ((strcmp(argv[i], "--threads") == 0
+				|| strcmp(argv[i], "-t") == 0) && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		} else {
+			dbFile = NULL;
+			break;
+		}
+	}
+	struct sockaddr_un address;
+	if (!dbFile || !socketPath
+			|| strlen(socketPath) >= sizeof(address.sun_path)) {
+		fprintf(stderr,
+				"Usage is \"findKmer serve --db 12mer_Shard_0_of_1_Of_genome.fa.bin --socket /tmp/kmer.sock\".\n");
+		return EXIT_FAILURE;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
 
-					(*baseCounter)++;
-					baseStatistics[codedBase].Count++;
-					(*TotalNumSequencesN)++;
+	count_db_t db;
+	open_count_db(&db, dbFile);
+
+	int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			0);
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketPath);
+	//a socket left behind by a server that was killed.
+	struct stat socketStat;
+	if (stat(socketPath, &socketStat) == 0 && S_ISSOCK(socketStat.st_mode)) {
+		unlink(socketPath);
+	}
+	if (listenFd < 0
+			|| bind(listenFd, (struct sockaddr*) &address, sizeof(address)) != 0
+			|| listen(listenFd, SOMAXCONN) != 0) {
+		fprintf(stderr, "Unable to listen on %s: %s\n", socketPath,
+				strerror(errno));
+		return EXIT_FAILURE;
+	}
 
-				} else if (seqSize == config.k) {
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = serve_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	serve_connection_t listener;
+	listener.fd = listenFd;
+	listener.listener = true;
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = &listener;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+
+	fprintf(stdout, "Listening on %s with %d threads.\n", socketPath, threads);
+	fflush(stdout);
+	vector<thread> workers;
+	for (int t = 0; t < threads; t++) {
+		workers.push_back(thread(serve_worker, &db, epollFd));
+	}
+	for (int t = 0; t < threads; t++) {
+		workers[t].join();
+	}
 
-					//this case will occur less often than seqSize > config.k
-					headNode = tree_create(headNode, kmer, config.k,
-							baseStatistics);
+	close(epollFd);
+	close(listenFd);
+	unlink(socketPath);
+	munmap(db.map, db.size);
+	fprintf(stdout, "Stopped serving %s.\n", dbFile);
+	return EXIT_SUCCESS;
+}
+/*
+ * "findKmer merge". Checks that the files are all N shards of one run, writes the statistics
+ * and streams a k-way merge of the shards into the histogram. Only one chunk per shard is in memory.
+ */
+void merge_shards() {
+	vector<shard_reader_t> shards(config.numMergeFiles);
+	vector<bool> seen;
+	for (int f = 0; f < config.numMergeFiles; f++) {
+		open_shard(&shards[f], config.mergeFiles[f]);
+		const shard_header_t &header = shards[f].header;
+		const shard_header_t &first = shards[0].header;
+		if (header.k != first.k || header.shardCount != first.shardCount
+				|| header.baseCounter != first.baseCounter
+				|| header.TotalNumSequencesN != first.TotalNumSequencesN
+				|| header.maskedKmers != first.maskedKmers
+				|| memcmp(header.baseCounts, first.baseCounts,
+						sizeof(header.baseCounts)) != 0) {
+			fprintf(stderr, "%s is not a shard of the same run as %s.\n",
+					config.mergeFiles[f], config.mergeFiles[0]);
+			exit(EXIT_FAILURE);
+		}
+		seen.resize(header.shardCount, false);
+		if (seen[header.shardIndex]) {
+			fprintf(stderr, "Shard %u of %u is given twice.\n",
+					header.shardIndex, header.shardCount);
+			exit(EXIT_FAILURE);
+		}
+		seen[header.shardIndex] = true;
+	}
+	for (size_t i = 0; i < seen.size(); i++) {
+		if (!seen[i]) {
+			fprintf(stderr, "Shard %zu of %zu is missing.\n", i, seen.size());
+			exit(EXIT_FAILURE);
+		}
+	}
 
-					for (int i = 0; i < config.k; i++) {
-						baseStatistics[kmer[i]].Count++;
-						DEBUG_STATISTICS(
-								fprintf(stdout,"i == %d, int2base(kmer[i]) == %c, baseStatistics[kmer[i]].Count == %d.\n",i, int2base(kmer[i]),baseStatistics[kmer[i]].Count));
-
-					}DEBUG_STATISTICS(fprintf(stdout,"\n"));
-					(*baseCounter) += seqSize;
-					(*TotalNumSequencesN)++;
-				} //end detection of a kmer of length k or greater.
-				else //This section will catch cases where seqSize are explicitly less than k.
-				{
-					headNode = tree_create(headNode, kmer+(config.k-seqSize), seqSize, baseStatistics);
-				}
+	const shard_header_t &first = shards[0].header;
+	unsigned long long baseCounter = first.baseCounter;
+	unsigned long long TotalNumSequencesN = first.TotalNumSequencesN;
+	statistics_t baseStatistics[4] = { };
+	for (int b = 0; b < 4; b++) {
+		baseStatistics[b].Count = first.baseCounts[b];
+	}
+	scan_summary_t summary = { first.records, first.duplicateRecords,
+			first.maskedKmers };
+	unsigned long long distinct = 0;
+	for (size_t f = 0; f < shards.size(); f++) {
+		distinct += shards[f].header.numKmers;
+	}
+	statistics(&baseCounter, baseStatistics, &TotalNumSequencesN, distinct,
+			((unsigned long long) 1) << (2 * config.k), &summary);
 
-			} //end end of sequence detection.
-		} //end ignore newline character
-	} //end while loop to read the file.
+	fprintf(stdout, "Now creating histogram.\n");
+	typedef pair<kmer_code_t, size_t> head_t; //next kmer of a shard, and the shard.
+	priority_queue<head_t, vector<head_t>, greater<head_t> > heads;
+	vector<unsigned long long> counts(shards.size());
+	kmer_count_t kmer;
+	for (size_t f = 0; f < shards.size(); f++) {
+		if (next_shard_kmer(&shards[f], &kmer)) {
+			heads.push(head_t(kmer.code, f));
+			counts[f] = kmer.count;
+		}
+	}
+	if (config.mismatches > 0) {
+		mismatchCounts = (unsigned long long*) calloc(
+				((unsigned long long) 1) << (2 * config.k),
+				sizeof(unsigned long long));
+		if (!mismatchCounts) {
+			fprintf(stderr, "mismatchCounts:: memory allocation failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	int *array = (int*) allocate_array(config.k, sizeof(int));
+	while (!heads.empty()) {
+		const kmer_code_t code = heads.top().first;
+		unsigned long long frequency = 0;
+		//shards by hash never share a kmer, but shards of the same kmer still add up.
+		while (!heads.empty() && heads.top().first == code) {
+			const size_t f = heads.top().second;
+			heads.pop();
+			frequency += counts[f];
+			if (next_shard_kmer(&shards[f], &kmer)) {
+				heads.push(head_t(kmer.code, f));
+				counts[f] = kmer.count;
+			}
+		}
+		histo_write_code(array, config.k, code, frequency, baseStatistics,
+				TotalNumSequencesN, config.out_file_pointer);
+	}
+	free(array);
+	for (size_t f = 0; f < shards.size(); f++) {
+		fclose(shards[f].file);
+	}
 
-	return headNode;
+	if (mismatchCounts) {
+		write_mismatch_histogram(baseStatistics, TotalNumSequencesN);
+		free(mismatchCounts);
+		mismatchCounts = NULL;
+	}
 }
 void scratch_function() {
 
@@ -1223,6 +8554,228 @@ void destroy(node_t *root) {
 	}
 
 }
+/*
+ * Bytes the input takes while counting. Text streams through the io buffers of the reader pipeline
+ * and the packed blocks handed to the threads, after the compressed read ahead of a gzip file, plus
+ * the record held back for --dedup, a quarter byte per base of the largest record and at most of
+ * the whole file. A packed cache is mapped and read in place, its pages are page cache the kernel
+ * can drop.
+ */
+unsigned long long input_memory(const int threads) {
+	if (config.packedCache) {
+		return 0;
+	}
+	return (unsigned long long) PIPELINE_DEPTH * PIPELINE_BUFFER_SIZE
+			+ (unsigned long long) (threads + PIPELINE_DEPTH)
+					* (PIPELINE_BLOCK_BASES / 4)
+			+ (config.textFormat != TEXT_PLAIN ? INPUT_CHUNK_SIZE : 0)
+			+ (config.dedupEnable > 0 ? input_bytes() / 4 : 0);
+}
+/*
+ * Peak bytes an engine is expected to use. The number of kmers is taken to be the input size,
+ * so distinct kmers are bounded by min(4^k, input) and the prediction errs high, unless
+ * a sample estimated the distinct kmers, see plan_sample().
+ */
+unsigned long long predict_engine_memory(const int engine, const int k,
+		const int threads, const int partitions,
+		const unsigned long long kmers) {
+	const unsigned long long possible = possible_kmers(k);
+	//a shard holds about 1/N of the kmers.
+	const unsigned long long shardKmers =
+			config.shardCount > 0 ? kmers / config.shardCount + 1024 : kmers;
+	unsigned long long distinct = min(possible, shardKmers);
+	if (sampledDistinct) {
+		distinct = min(distinct, config.shardCount > 0 ?
+				sampledDistinct / config.shardCount + 1024 : sampledDistinct);
+	}
+	//a run or a slot of a kmer of more than MAX_CODE_K bases holds two words and a 64 bit count.
+	const bool longKmers = k > MAX_CODE_K;
+	const unsigned long long runBytes =
+			longKmers ? sizeof(long_kmer_count_t) : sizeof(kmer_count_t);
+	const unsigned long long combine = (unsigned long long) threads
+			* max(config.combineSize, DEFAULT_PARTITION_COMBINE_SIZE)
+			* (longKmers ?
+					sizeof(long_kmer_t) + runBytes : sizeof(kmer_code_t) + runBytes);
+	unsigned long long bytes = MEMORY_SLACK + input_memory(threads);
+
+	if (engine == ENGINE_TREE) {
+		//every depth has at most min(4^depth, distinct kmers) nodes, plus the malloc header of each.
+		const unsigned long long leaves =
+				sampledDistinct ? min(kmers, sampledDistinct) : kmers;
+		for (int depth = 1; depth <= k; depth++) {
+			bytes += min(((unsigned long long) 1) << (2 * depth), leaves)
+					* (sizeof(node_t) + 16);
+		}
+		return bytes;
+	}
+
+	if (engine == ENGINE_DENSE) {
+		bytes += possible * (config.counterBits / 8) + combine;
+	} else if (engine == ENGINE_HASH) {
+		unsigned long long slots = 1;
+		while (slots < 2 * distinct) {
+			slots <<= 1;
+		}
+		if (longKmers) {
+			//a bucket doubling holds its old slots too.
+			bytes += slots * runBytes * 3 / 2 + combine;
+		} else {
+			//and the slots of the kmers, sorted by kmer for the histogram.
+			bytes += slots * (sizeof(kmer_code_t) + config.counterBits / 8)
+					+ distinct * sizeof(unsigned long long) + combine;
+		}
+	} else if (engine == ENGINE_SORT) {
+		//a run per kmer at worst, and half as much again for vectors growing.
+		bytes += shardKmers * runBytes * 3 / 2 + combine;
+	} else if (engine == ENGINE_DISK) {
+		//each thread merges one bucket, twice the average size to allow for uneven buckets.
+		bytes += threads * 2 * (shardKmers / partitions + 1)
+				* sizeof(kmer_count_t) + combine;
+	}
+	return bytes;
+}
+/*
+ * Picks the engine, threads and buckets for the run from the input size and --max-memory.
+ * ENGINE_AUTO takes the first of dense, hash, sort and disk that fits, dense only while
+ * the table would be mostly full. Without a budget auto plans for the physical memory.
+ * Input of unknown size, a pipe or stdin, can hold any number of kmers, so with a budget auto
+ * only takes the engines whose memory does not grow with them, dense and disk.
+ * An engine the user named is kept, the run stops here if it is predicted not to fit.
+ */
+void plan_memory() {
+	const unsigned long long inputBytes = input_bytes();
+	const bool unboundedInput = config.maxMemory && !config.packedCache
+			&& inputBytes == 0;
+	const unsigned long long kmers = input_kmers() * dyad_gaps();
+	const int k = count_table_k();
+	const unsigned long long possible = possible_kmers(k);
+	unsigned long long budget = config.maxMemory;
+	if (!budget) {
+		budget = (unsigned long long) sysconf(_SC_PHYS_PAGES)
+				* sysconf(_SC_PAGE_SIZE);
+	}
+
+	//enough disk buckets that each thread's bucket fits in the budget left after the input.
+	const unsigned long long inputMemory = input_memory(config.threads);
+	unsigned long long available = budget > inputMemory + 2 * MEMORY_SLACK ?
+			budget - inputMemory - 2 * MEMORY_SLACK : MEMORY_SLACK;
+	config.partitions = min(possible,
+			(unsigned long long) (unboundedInput ? MAX_DISK_PARTITIONS : 64));
+	while (config.partitions < MAX_DISK_PARTITIONS
+			&& (unsigned long long) config.partitions < possible
+			&& (unsigned long long) config.threads * 2
+					* (kmers / config.partitions + 1)
+					* sizeof(kmer_count_t) > available) {
+		config.partitions <<= 1;
+	}
+
+	if (config.engine == ENGINE_AUTO) {
+		const int candidates[] = { ENGINE_DENSE, ENGINE_HASH, ENGINE_DENSE,
+				ENGINE_SORT, ENGINE_DISK };
+		int c;
+		for (c = 0; c < 5; c++) {
+			const int engine = candidates[c];
+			if (config.positionalBinSize > 0) {
+				config.engine = ENGINE_TREE; //the only engine with positions.
+				break;
+			}
+			if (engine == ENGINE_DENSE
+					&& (k > MAX_DENSE_K
+							|| (c == 0 && possible > 4 * kmers))) {
+				continue;
+			}
+			if (config.windowSize > 0
+					&& (engine == ENGINE_SORT || engine == ENGINE_DISK)) {
+				continue; //the window scan looks kmers up in the table.
+			}
+			if (k > MAX_CODE_K && engine == ENGINE_DISK) {
+				continue; //long kmers are counted in memory.
+			}
+			if (unboundedInput
+					&& (engine == ENGINE_HASH || engine == ENGINE_SORT)) {
+				continue;
+			}
+			if (engine == ENGINE_SORT) {
+				config.partitions = min((unsigned long long) SORT_PARTITIONS,
+						possible);
+			}
+			if (predict_engine_memory(engine, k, config.threads,
+					config.partitions, kmers) <= budget) {
+				config.engine = engine;
+				break;
+			}
+		}
+		if (c == 5) {
+			//the hash engine stops before it grows past the budget, the sort engine cannot.
+			config.engine = config.windowSize > 0 ? ENGINE_HASH :
+					k > MAX_CODE_K ?
+							(unboundedInput ? ENGINE_HASH : ENGINE_SORT) :
+							ENGINE_DISK;
+		}
+	} else if (config.engine == ENGINE_SORT) {
+		config.partitions = min((unsigned long long) SORT_PARTITIONS, possible);
+	}
+
+	//the disk engine can still trade threads for memory.
+	while (config.engine == ENGINE_DISK && config.threads > 1
+			&& predict_engine_memory(config.engine, k, config.threads,
+					config.partitions, kmers) > budget) {
+		config.threads--;
+	}
+
+	if ((config.engine == ENGINE_SORT || config.engine == ENGINE_DISK
+			|| k > MAX_CODE_K) && config.combineSize == 0) {
+		config.combineSize = DEFAULT_PARTITION_COMBINE_SIZE;
+	}
+
+	config.predictedMemory = predict_engine_memory(config.engine, k,
+			config.threads, config.partitions, kmers);
+	config.tableBudget = config.maxMemory ? available : 0;
+	if (config.mismatches > 0) {
+		config.predictedMemory += (config.mismatches + 1) * possible
+				* sizeof(unsigned long long);
+	}
+	fprintf(stdout,
+			"Memory plan: %s engine, %d threads, %d buckets, %0.1f mibibytes predicted peak for %0.1f mibibytes of input.\n",
+			engine_name(config.engine),
+			config.engine == ENGINE_TREE && config.positionalBinSize > 0 ?
+					1 : config.threads,
+			config.engine == ENGINE_SORT || config.engine == ENGINE_DISK ?
+					config.partitions : 0,
+			config.predictedMemory / (double) (1024 * 1024),
+			inputBytes / (double) (1024 * 1024));
+
+	if (config.maxMemory && config.predictedMemory > config.maxMemory) {
+		fprintf(stderr,
+				"The %s engine is predicted to need %0.1f mibibytes, over the --max-memory budget of %0.1f mibibytes.\nUse --engine auto or a larger budget.\n",
+				engine_name(config.engine),
+				config.predictedMemory / (double) (1024 * 1024),
+				config.maxMemory / (double) (1024 * 1024));
+		exit(EXIT_FAILURE);
+	}
+}
+/* Logs the peak resident memory of the run against the plan. */
+void report_peak_memory() {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return;
+	}
+	const unsigned long long peak = (unsigned long long) usage.ru_maxrss * 1024;
+	fprintf(stdout,
+			"Peak memory: %0.1f mibibytes predicted, %0.1f mibibytes actual.\n",
+			config.predictedMemory / (double) (1024 * 1024),
+			peak / (double) (1024 * 1024));
+	fflush(stdout);
+	if (config.maxMemory && peak > config.maxMemory) {
+		fprintf(stderr,
+				"Peak memory of %0.1f mibibytes went over the --max-memory budget.\n",
+				peak / (double) (1024 * 1024));
+	}
+}
+/*
+ * Prints the disk and memory the tree is likely to take for the distinct kmers of the input and
+ * returns the most nodes it can have, 4^1 + ... + 4^k and the head.
+ */
 unsigned long int estimate_RAM_usage() {
 
 	if (sizeof(int) < 4 || sizeof(long int) < 8 || sizeof(long long int) < 8) {
@@ -1258,37 +8811,669 @@ unsigned long int estimate_RAM_usage() {
 	while (n <= config.k) {
 		maxNumberOfNodes += pow(4.0, n++);
 	}
-	if (((sizeof(char) * (config.k + 10)) * maxNumberOfNodes)
+	//a depth holds no more nodes than there are distinct kmers, sampled or one per base of the input.
+	const unsigned long long leaves =
+			sampledDistinct ? sampledDistinct : input_kmers();
+	unsigned long long likelyNodes = 1;
+	for (int depth = 1; depth <= config.k; depth++) {
+		const unsigned long long nodes = ((unsigned long long) 1) << (2 * depth);
+		likelyNodes += leaves ? min(nodes, leaves) : nodes;
+	}
+	if (((sizeof(char) * (config.k + 10)) * likelyNodes)
 			>= (1024 * 1024 * 1024)) {
 		cout
-				<< ((sizeof(char) * (config.k + 10)) * maxNumberOfNodes)
+				<< ((sizeof(char) * (config.k + 10)) * likelyNodes)
 						/ (double) (1024 * 1024 * 1024) << " gibibytes";
 	} else {
 		cout
-				<< ((sizeof(char) * (config.k + 10)) * maxNumberOfNodes)
+				<< ((sizeof(char) * (config.k + 10)) * likelyNodes)
 						/ (double) (1024 * 1024) << " mibibytes";
 	}
 
 	cout << " of disk usage and ";
 
-	if (maxNumberOfNodes * sizeof(node_t) >= (1024 * 1024 * 1024)) {
+	if (likelyNodes * sizeof(node_t) >= (1024 * 1024 * 1024)) {
 		cout
-				<< (maxNumberOfNodes * sizeof(node_t)
+				<< (likelyNodes * sizeof(node_t)
 						/ (double) (1024 * 1024 * 1024))
 				<< " gibibytes of RAM usage likely" << endl;
 		;
 		cout << "We are stopping here to make sure that is ok with you!"
 				<< endl;
 		cout << "Hit enter to proceed or else abort the program." << endl;
-		if (config.suppressOutputEnable == 0) {
+		if (config.suppressOutputEnable == 0 && !config.maxMemory) {
 			getchar();
 		}
 	} else {
-		cout << (maxNumberOfNodes * sizeof(node_t) / (double) (1024 * 1024))
+		cout << (likelyNodes * sizeof(node_t) / (double) (1024 * 1024))
 				<< " mibibytes of RAM usage likely" << endl;
 	}
 	return maxNumberOfNodes;
 }
+/*
+ * Start of the sampled text block at offset, the start of its line so a block never begins inside
+ * a header. A line longer than a block is unwrapped sequence and is cut at offset itself.
+ */
+size_t sample_block_start(const char * const map, const size_t length,
+		const size_t offset) {
+	if (offset == 0 || offset >= length) {
+		return min(offset, length);
+	}
+	const size_t window = min(offset, (size_t) SAMPLE_BLOCK_SIZE);
+	const char *newline = (const char*) memrchr(map + offset - window, '\n',
+			window);
+	return newline ? newline + 1 - map : offset;
+}
+/* What sample_kmers() counted in the blocks it picked. */
+struct kmer_sample_t {
+	size_t numBlocks; //blocks of the sequence file.
+	size_t numPicks; //blocks counted.
+	unsigned long long totalSize; //bytes of text or bases of the packed cache.
+	unsigned long long sampledSize;
+	unsigned long long sampledRecords;
+	double fraction; //of the file in the counted blocks.
+	double seconds;
+	unsigned long long baseCounter;
+	unsigned long long baseCounts[4];
+	unsigned long long sampledKmers;
+	unsigned long long observed; //distinct kmers of the sample, f1 of them seen once and f2 twice.
+	unsigned long long f1;
+	unsigned long long f2;
+	vector<kmer_count_t> top; //the SAMPLE_TOP_KMERS most frequent, most frequent first.
+};
+/*
+ * Counts SAMPLE_BLOCK_SIZE blocks of the sequence file picked at random until the fraction, or
+ * maxBlocks, is read, in a small hash table that grows as it fills, and sets sampledDistinct to the
+ * distinct kmers of the whole file: the observed ones plus the unseen ones the Chao and Lin
+ * estimator for sampling without replacement predicts from the kmers seen once and twice.
+ * Kmers that span two blocks and --dedup are ignored.
+ */
+void sample_kmers(const double sampleFraction, const size_t maxBlocks,
+		kmer_sample_t &sample) {
+	const double start = monotonic_seconds();
+	const int k = config.k;
+	const unsigned long long possible = ((unsigned long long) 1) << (2 * k);
+	unsigned long long random = SAMPLE_SEED;
+	segment_source_t source; //the picked blocks.
+	source.nextSegment = 0;
+	source.pipeline = NULL;
+	sample.sampledSize = 0;
+	sample.sampledRecords = 0;
+	char *map = NULL;
+	size_t mapLength = 0;
+
+	vector<segment_t> blocks; //every block of a packed cache, the picked ones become segments.
+	if (config.packedCache) {
+		vector<record_t> records;
+		index_packed_records(config.packedCache, records);
+		split_records(records, config.span, SAMPLE_BLOCK_SIZE, blocks);
+		sample.totalSize = config.packedCache->header->numBases;
+		sample.numBlocks = blocks.size();
+	} else {
+		const int fd = open(sequence_path(), O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0) {
+			fprintf(stderr, "Unable to read %s to sample it.\n",
+					config.sequence_file);
+			exit(EXIT_FAILURE);
+		}
+		mapLength = st.st_size;
+		if (mapLength) {
+			map = (char*) mmap(NULL, mapLength, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map == MAP_FAILED) {
+				fprintf(stderr, "Unable to map %s to sample it.\n",
+						config.sequence_file);
+				exit(EXIT_FAILURE);
+			}
+			//only the picked blocks are read, read ahead would read the rest too.
+			madvise(map, mapLength, MADV_RANDOM);
+		}
+		close(fd);
+		sample.totalSize = mapLength;
+		sample.numBlocks = (mapLength + SAMPLE_BLOCK_SIZE - 1) / SAMPLE_BLOCK_SIZE;
+	}
+	const size_t numBlocks = sample.numBlocks;
+
+	//pick the blocks with a partial shuffle and read them in file order.
+	vector<size_t> picks(numBlocks);
+	for (size_t b = 0; b < numBlocks; b++) {
+		picks[b] = b;
+	}
+	const size_t numPicks = min(min(numBlocks, maxBlocks),
+			(size_t) ceil(sampleFraction * numBlocks));
+	for (size_t b = 0; b < numPicks; b++) {
+		random ^= random << 13;
+		random ^= random >> 7;
+		random ^= random << 17;
+		swap(picks[b], picks[b + random % (numBlocks - b)]);
+	}
+	picks.resize(numPicks);
+	sort(picks.begin(), picks.end());
+	sample.numPicks = numPicks;
+
+	for (size_t p = 0; p < picks.size(); p++) {
+		if (config.packedCache) {
+			const segment_t &block = blocks[picks[p]];
+			source.segments.push_back(block);
+			sample.sampledSize += block.record.sequenceLength - block.preroll;
+			sample.sampledRecords += block.record.id && block.preroll == 0;
+			continue;
+		}
+		const size_t first = sample_block_start(map, mapLength,
+				picks[p] * SAMPLE_BLOCK_SIZE);
+		const size_t last = sample_block_start(map, mapLength,
+				(picks[p] + 1) * SAMPLE_BLOCK_SIZE);
+		vector<record_t> records;
+		index_records(map + first, last - first, records);
+		for (size_t r = 0; r < records.size(); r++) {
+			segment_t segment = { records[r], 0, 0 };
+			source.segments.push_back(segment);
+			sample.sampledRecords += records[r].id != NULL;
+		}
+		sample.sampledSize += last - first;
+	}
+	const double fraction =
+			sample.totalSize ? (double) sample.sampledSize / sample.totalSize : 1;
+	sample.fraction = fraction;
+
+	count_table_t *table = count_table_create(ENGINE_HASH, k, 32,
+			max(min(possible, sample.sampledSize), (unsigned long long) 1024));
+	vector<table_worker_t> totals(config.threads);
+	vector<thread> workers;
+	for (int t = 0; t < config.threads; t++) {
+		memset(&totals[t], 0, sizeof(table_worker_t));
+		workers.push_back(
+				thread(table_count_worker, &source, table, &totals[t]));
+	}
+	sample.baseCounter = 0;
+	sample.sampledKmers = 0;
+	for (int b = 0; b < 4; b++) {
+		sample.baseCounts[b] = 0;
+	}
+	for (int t = 0; t < config.threads; t++) {
+		workers[t].join();
+		sample.baseCounter += totals[t].baseCounter;
+		sample.sampledKmers += totals[t].TotalNumSequencesN;
+		for (int b = 0; b < 4; b++) {
+			sample.baseCounts[b] += totals[t].baseCounts[b];
+		}
+	}
+	sample.seconds = monotonic_seconds() - start;
+
+	//the frequency spectrum of the sample.
+	unsigned long long observed = 0, f1 = 0, f2 = 0;
+	auto moreFrequent = [](const kmer_count_t &a, const kmer_count_t &b) {
+		return a.count > b.count || (a.count == b.count && a.code < b.code);
+	};
+	vector<kmer_count_t> &top = sample.top; //a heap with the least frequent of the top kmers in front.
+	top.clear();
+	count_table_for_each(table,
+			[&](kmer_code_t code, unsigned long long frequency) {
+				observed++;
+				f1 += frequency == 1;
+				f2 += frequency == 2;
+				kmer_count_t kmer = { code, frequency };
+				if (top.size() < SAMPLE_TOP_KMERS) {
+					top.push_back(kmer);
+					push_heap(top.begin(), top.end(), moreFrequent);
+				} else if (moreFrequent(kmer, top.front())) {
+					pop_heap(top.begin(), top.end(), moreFrequent);
+					top.back() = kmer;
+					push_heap(top.begin(), top.end(), moreFrequent);
+				}
+			});
+	count_table_destroy(table);
+	sort(top.begin(), top.end(), moreFrequent);
+	sample.observed = observed;
+	sample.f1 = f1;
+	sample.f2 = f2;
+
+	const unsigned long long sampledKmers = sample.sampledKmers;
+	const double estimatedKmers = sampledKmers / fraction;
+	double unseen = 0;
+	if (fraction < 1 && f1 > 0 && sampledKmers > 1) {
+		unseen = (double) f1 * f1
+				/ ((double) sampledKmers / (sampledKmers - 1) * 2 * max(f2, 1ULL)
+						+ fraction / (1 - fraction) * f1);
+	}
+	sampledDistinct = max(observed,
+			(unsigned long long) min((double) possible,
+					min(estimatedKmers, observed + unseen)));
+	if (!sampledDistinct) {
+		sampledDistinct = 1; //0 would mean no sample to predict_engine_memory().
+	}
+
+	if (map) {
+		munmap(map, mapLength);
+	}
+}
+/*
+ * --sample. Counts the blocks sample_kmers() picks for the fraction and writes what a full run is
+ * expected to find and need:
+ * - the distinct kmers,
+ * - the most frequent kmers, their counts scaled up with 95% binomial intervals and their Z scores,
+ * - the base composition statistics() would report,
+ * - the runtime, the time of the sample scaled up, and the memory plan with the estimated
+ *   distinct kmers instead of min(4^k, input).
+ */
+void sample_sequence_file() {
+	const int k = config.k;
+	const unsigned long long possible = ((unsigned long long) 1) << (2 * k);
+	kmer_sample_t sample;
+	sample_kmers(config.sampleFraction, ~(size_t) 0, sample);
+	const double fraction = sample.fraction;
+	const double seconds = sample.seconds;
+	const vector<kmer_count_t> &top = sample.top;
+	const double estimatedKmers = sample.sampledKmers / fraction;
+
+	double probabilities[4];
+	for (int b = 0; b < 4; b++) {
+		probabilities[b] = sample.baseCounter ?
+				(double) sample.baseCounts[b] / sample.baseCounter : 0;
+	}
+
+	FILE * const outs[2] = { stdout, config.out_file_pointer };
+	for (int o = 0; o < 2; o++) {
+		FILE * const out = outs[o];
+		fprintf(out,
+				"Sampled %zu of %zu blocks, %0.4f of %llu %s, %llu records and %llu kmers in %0.2f seconds.\n",
+				sample.numPicks, sample.numBlocks, fraction, sample.totalSize,
+				config.packedCache ? "bases" : "bytes", sample.sampledRecords,
+				sample.sampledKmers, seconds);
+		fprintf(out, "Estimated kmers: %0.0f.\n", estimatedKmers);
+		fprintf(out,
+				"Estimated distinct kmers: %llu, %llu seen in the sample, %llu once and %llu twice, of %llu possible.\n",
+				sampledDistinct, sample.observed, sample.f1, sample.f2, possible);
+		fprintf(out,
+				"Estimated base composition: A %0.4f, C %0.4f, G %0.4f, T %0.4f.\n",
+				probabilities[0], probabilities[1], probabilities[2],
+				probabilities[3]);
+		fprintf(out,
+				"Estimated counting time: %0.1f seconds with %d threads.\n",
+				seconds / fraction, config.threads);
+		fprintf(out,
+				"\nkmer, sample count, estimated count, 95%% low, 95%% high, estimated z\n");
+		int array[64];
+		for (size_t i = 0; i < top.size(); i++) {
+			const double count = top[i].count;
+			const double margin = 1.96 * sqrt(count * (1 - fraction));
+			double p = 1;
+			for (int j = 0; j < k; j++) {
+				array[j] = (top[i].code >> (2 * (k - 1 - j))) & 3;
+				p *= probabilities[array[j]];
+			}
+			write_kmer_bases(array, k, out);
+			fprintf(out, ", %0.0f, %0.0f, %0.0f, %0.0f, %0.2f\n", count,
+					count / fraction, max(count, (count - margin) / fraction),
+					(count + margin) / fraction,
+					p > 0 && p < 1 ?
+							(count / fraction - estimatedKmers * p)
+									/ sqrt(estimatedKmers * p * (1 - p)) :
+							0);
+		}
+		fprintf(out, "\n");
+	}
+
+	//the plan with the estimated distinct kmers, a named engine over --max-memory stops here.
+	plan_memory();
+	fprintf(config.out_file_pointer,
+			"Memory plan: %s engine, %d threads, %0.1f mibibytes predicted peak.\n",
+			engine_name(config.engine),
+			config.engine == ENGINE_TREE && config.positionalBinSize > 0 ?
+					1 : config.threads,
+			config.predictedMemory / (double) (1024 * 1024));
+}
+/*
+ * --plan-sample. Estimates the distinct kmers of a counting run from a few blocks sample_kmers()
+ * picks, so plan_memory() and the hash table are sized by them instead of min(4^k, input).
+ * Text that streams, gzip or stdin, has no blocks to pick and the sample counts neither dyads
+ * nor kmers of more than MAX_CODE_K bases, those runs are planned without it.
+ */
+void plan_sample() {
+	sampledDistinct = 0;
+	if (config.planSampleFraction <= 0 || config.k > MAX_CODE_K
+			|| config.dyadLeft
+			|| (!config.packedCache
+					&& (sequence_streams_stdin()
+							|| config.textFormat != TEXT_PLAIN
+							|| input_bytes() == 0))) {
+		return;
+	}
+	const table_memory_t runMemory = tableMemory; //the sample's table is not one the run reports.
+	kmer_sample_t sample;
+	sample_kmers(config.planSampleFraction, PLAN_SAMPLE_MAX_BLOCKS, sample);
+	tableMemory = runMemory;
+	fprintf(stdout,
+			"Estimated %llu distinct kmers from %zu of %zu blocks of the sequence file in %0.2f seconds.\n",
+			sampledDistinct, sample.numPicks, sample.numBlocks, sample.seconds);
+}
+//One line of a --jobs manifest and what became of it.
+struct job_t {
+	char *input; //sequence file.
+	int k;
+	int zThresholdEnable;
+	long double zThreshold;
+	char *outFile; //histogram name, from the manifest or named like a single run names it.
+	int group; //jobs with the same input share a group and its packed cache.
+	int threads;
+	unsigned long long predictedMemory;
+	pid_t pid; //0 until started.
+	int status; //JOB_ values.
+	double start;
+	double seconds;
+	double cpuSeconds;
+	long peakKilobytes;
+};
+volatile sig_atomic_t jobsStop = 0; //set by SIGINT and SIGTERM, the running jobs are killed.
+void jobs_signal(int) {
+	jobsStop = 1;
+}
+/*
+ * Reads the manifest of --jobs. Each line is "<sequence_file> <k> [<z threshold>|-] [<out_file>|-]",
+ * - takes the default. Blank lines and lines starting with # are skipped.
+ */
+vector<job_t> read_job_manifest(const char * const filename) {
+	FILE *manifest = fopen(filename, "r");
+	if (!manifest) {
+		fprintf(stderr, "Job manifest %s failed to open.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	vector<job_t> jobs;
+	vector<string> inputs;
+	char line[4096];
+	for (int lineNumber = 1; fgets(line, sizeof(line), manifest); lineNumber++) {
+		char input[4096], z[64] = "-", out[4096] = "-";
+		int k;
+		if (line[0] == '#' || sscanf(line, "%4095s", input) != 1) {
+			continue;
+		}
+		const int fields = sscanf(line, "%4095s %d %63s %4095s", input, &k, z,
+				out);
+		if (fields < 2 || k < 1 || k > MAX_K) {
+			fprintf(stderr,
+					"Line %d of %s is not \"<sequence_file> <k> [<z threshold>|-] [<out_file>|-]\" with 0 < k <= %d.\n",
+					lineNumber, filename, MAX_K);
+			exit(EXIT_FAILURE);
+		}
+		check_file(input, "r");
+
+		job_t job;
+		memset(&job, 0, sizeof(job));
+		job.input = strdup(input);
+		job.k = k;
+		job.zThresholdEnable = strcmp(z, "-") != 0;
+		job.zThreshold = job.zThresholdEnable ? strtold(z, NULL) : DEFAULT_Z_THRESHOLD;
+		job.outFile = strcmp(out, "-") == 0 ? NULL : strdup(out);
+		job.group = find(inputs.begin(), inputs.end(), string(input))
+				- inputs.begin();
+		if (job.group == (int) inputs.size()) {
+			inputs.push_back(input);
+		}
+		job.status = JOB_PENDING;
+		jobs.push_back(job);
+	}
+	fclose(manifest);
+	if (jobs.empty()) {
+		fprintf(stderr, "Job manifest %s has no jobs.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	return jobs;
+}
+/*
+ * Parses the input of a group once into a 2 bit packed cache in a memory file, which every
+ * job of the group then counts from. Returns -1 if the input already is a packed cache.
+ */
+int pack_job_input(const char * const input) {
+	const packed_cache_t *cache = map_packed_cache(input);
+	if (cache) {
+		munmap(cache->map, cache->size);
+		delete cache;
+		return -1;
+	}
+	config.sequence_file = input;
+	config.stdinEnable = 0;
+	config.decompressedFd = -1;
+	if ((config.sequence_file_pointer = open_sequence_input()) == NULL) {
+		fprintf(stderr, "Sequence file %s failed to open\n", input);
+		exit(EXIT_FAILURE);
+	}
+	const int packedFd = memfd_create(input, 0);
+	if (packedFd < 0
+			|| (config.out_file_pointer = fdopen(dup(packedFd), "wb")) == NULL) {
+		fprintf(stderr, "Unable to create a memory file for the packed %s.\n",
+				input);
+		exit(EXIT_FAILURE);
+	}
+	pack_sequence_file();
+	fclose(config.out_file_pointer);
+	fclose(config.sequence_file_pointer);
+	if (config.decompressedFd >= 0) {
+		close(config.decompressedFd); //the text of a gzip file, the cache replaces it.
+	}
+	return packedFd;
+}
+/* Makes config the configuration of one job, on top of the options given with --jobs. */
+void configure_job(const struct conf &base, const job_t &job,
+		const int packedFd) {
+	config = base;
+	config.sequence_file = job.input;
+	config.stdinEnable = 0;
+	config.decompressedFd = packedFd;
+	config.textFormat = TEXT_PLAIN;
+	config.k = job.k;
+	config.zThresholdEnable = job.zThresholdEnable;
+	config.zThreshold = job.zThreshold;
+	config.threads = job.threads;
+	config.suppressOutputEnable = 1; //a job has no terminal to pause on.
+}
+/*
+ * Runs a job in a child process. The configuration is global, so jobs cannot share one
+ * process, but a child inherits the packed cache of its group instead of parsing the input again.
+ * The histogram is written as <out_file>.part and only renamed once the job succeeds, so a
+ * killed job never leaves a truncated histogram behind. Returns true in the parent, false in
+ * the child, which goes on to run the job as if it had been given on the command line.
+ */
+bool start_job(const struct conf &base, job_t &job, const int packedFd) {
+	fflush(stdout);
+	fflush(stderr);
+	const pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "Unable to start a job: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (pid > 0) {
+		job.pid = pid;
+		job.status = JOB_RUNNING;
+		job.start = monotonic_seconds();
+		return true;
+	}
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	configure_job(base, job, packedFd);
+	config.out_file = (char*) allocate_array(strlen(job.outFile) + 6,
+			sizeof(char));
+	sprintf(config.out_file, "%s.part", job.outFile);
+	//what a single run prints goes to a log, kept if the job fails.
+	string log = string(job.outFile) + ".log";
+	if (!freopen(log.c_str(), "w", stdout) || !freopen(log.c_str(), "a", stderr)) {
+		exit(EXIT_FAILURE);
+	}
+	setvbuf(stderr, NULL, _IONBF, 0);
+	return false;
+}
+/* Records the end of a job that wait4() returned. */
+void finish_job(job_t &job, const int status, const struct rusage &usage,
+		const int number, const int numJobs) {
+	job.seconds = monotonic_seconds() - job.start;
+	job.cpuSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+			+ usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	job.peakKilobytes = usage.ru_maxrss;
+	job.pid = 0;
+
+	string part = string(job.outFile) + ".part";
+	string log = string(job.outFile) + ".log";
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0
+			&& rename(part.c_str(), job.outFile) == 0) {
+		job.status = JOB_DONE;
+		unlink(log.c_str());
+		fprintf(stdout,
+				"Finished job %d of %d in %0.1f seconds, %0.1f cpu seconds, %0.1f mibibytes peak: %s\n",
+				number, numJobs, job.seconds, job.cpuSeconds,
+				job.peakKilobytes / 1024.0, job.outFile);
+	} else {
+		job.status = JOB_FAILED;
+		unlink(part.c_str());
+		fprintf(stdout, "FAILED job %d of %d after %0.1f seconds, %s %d. See %s\n",
+				number, numJobs, job.seconds,
+				WIFSIGNALED(status) ? "signal" : "exit status",
+				WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status),
+				log.c_str());
+	}
+	fflush(stdout);
+}
+/*
+ * "findKmer --jobs <manifest>". Runs every job of the manifest in one process tree.
+ * Jobs are grouped by input and each input is parsed once, into a packed cache. The jobs of a
+ * group are planned with plan_memory() and started largest first whenever a core is idle and
+ * their predicted memory fits in what the running jobs leave of --max-memory, or of the
+ * physical memory without a budget. Returns false in a job's child process.
+ */
+bool run_jobs(int * const exitStatus) {
+	const struct conf base = config;
+	vector<job_t> jobs = read_job_manifest(config.jobsFile);
+	set_default_conf();
+	const int cores = config.threads;
+	const unsigned long long budget =
+			config.maxMemory ? config.maxMemory :
+					(unsigned long long) sysconf(_SC_PHYS_PAGES)
+							* sysconf(_SC_PAGE_SIZE);
+	int numGroups = 0;
+	for (size_t j = 0; j < jobs.size(); j++) {
+		numGroups = max(numGroups, jobs[j].group + 1);
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = jobs_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	fprintf(stdout,
+			"Running %lu jobs on %d inputs with %d cores and %0.1f mibibytes.\n",
+			(unsigned long) jobs.size(), numGroups, cores,
+			budget / (double) (1024 * 1024));
+	for (int group = 0; group < numGroups && !jobsStop; group++) {
+		vector<int> pending;
+		for (size_t j = 0; j < jobs.size(); j++) {
+			if (jobs[j].group == group) {
+				pending.push_back(j);
+			}
+		}
+		const double parseStart = monotonic_seconds();
+		const int packedFd = pack_job_input(jobs[pending[0]].input);
+		fprintf(stdout, "Parsed %s once for %lu jobs in %0.1f seconds.\n",
+				jobs[pending[0]].input, (unsigned long) pending.size(),
+				monotonic_seconds() - parseStart);
+
+		//plan each job the way a single run would, sharing the cores between the jobs.
+		const int threads = max(1, cores / min(cores, (int) pending.size()));
+		for (size_t p = 0; p < pending.size(); p++) {
+			job_t &job = jobs[pending[p]];
+			job.threads = threads;
+			configure_job(base, job, packedFd);
+			config.out_file = job.outFile;
+			set_default_conf();
+			config.packedCache = map_packed_cache(sequence_path());
+			plan_sample();
+			plan_memory();
+			job.predictedMemory = config.predictedMemory;
+			job.outFile = config.out_file;
+			munmap(config.packedCache->map, config.packedCache->size);
+			delete config.packedCache;
+		}
+		config = base;
+		stable_sort(pending.begin(), pending.end(),
+				[&jobs](const int a, const int b) {
+					return jobs[a].predictedMemory > jobs[b].predictedMemory;
+				});
+
+		int running = 0;
+		unsigned long long runningMemory = 0;
+		while ((!pending.empty() || running > 0) && !jobsStop) {
+			//an idle core takes the largest pending job that fits, one job always runs.
+			for (size_t p = 0; p < pending.size() && running < cores;) {
+				job_t &job = jobs[pending[p]];
+				if (running > 0 && runningMemory + job.predictedMemory > budget) {
+					p++;
+					continue;
+				}
+				if (!start_job(base, job, packedFd)) {
+					return false;
+				}
+				fprintf(stdout,
+						"Started job %d of %lu: %dmers of %s%s, %d threads, %0.1f mibibytes predicted.\n",
+						pending[p] + 1, (unsigned long) jobs.size(), job.k,
+						job.input, job.zThresholdEnable ? " Z filtered" : "",
+						job.threads, job.predictedMemory / (double) (1024 * 1024));
+				fflush(stdout);
+				running++;
+				runningMemory += job.predictedMemory;
+				pending.erase(pending.begin() + p);
+			}
+
+			int status;
+			struct rusage usage;
+			const pid_t pid = wait4(-1, &status, 0, &usage);
+			if (pid < 0) {
+				continue; //interrupted by a signal.
+			}
+			for (size_t j = 0; j < jobs.size(); j++) {
+				if (jobs[j].pid == pid) {
+					finish_job(jobs[j], status, usage, j + 1, jobs.size());
+					running--;
+					runningMemory -= jobs[j].predictedMemory;
+				}
+			}
+		}
+		if (packedFd >= 0) {
+			close(packedFd);
+		}
+	}
+
+	if (jobsStop) {
+		for (size_t j = 0; j < jobs.size(); j++) {
+			if (jobs[j].pid > 0) {
+				kill(jobs[j].pid, SIGTERM);
+				waitpid(jobs[j].pid, NULL, 0);
+				unlink((string(jobs[j].outFile) + ".part").c_str());
+				jobs[j].status = JOB_FAILED;
+			}
+		}
+		fprintf(stdout, "Interrupted, the jobs that were running were stopped.\n");
+	}
+
+	const char *statusNames[] = { "pending", "running", "done", "failed" };
+	fprintf(stdout,
+			"\njob, sequence file, k, z threshold, status, seconds, cpu seconds, peak mibibytes, out file\n");
+	*exitStatus = EXIT_SUCCESS;
+	for (size_t j = 0; j < jobs.size(); j++) {
+		const job_t &job = jobs[j];
+		fprintf(stdout, "%lu, %s, %d, ", (unsigned long) j + 1, job.input, job.k);
+		if (job.zThresholdEnable) {
+			fprintf(stdout, "%LG", job.zThreshold);
+		} else {
+			fprintf(stdout, "-");
+		}
+		fprintf(stdout, ", %s, %0.1f, %0.1f, %0.1f, %s\n",
+				statusNames[job.status], job.seconds, job.cpuSeconds,
+				job.peakKilobytes / 1024.0, job.outFile ? job.outFile : "-");
+		if (job.status != JOB_DONE) {
+			*exitStatus = EXIT_FAILURE;
+		}
+	}
+	return true;
+}
 int main(int argc, char *argv[]) {
 
 	/* Deal with command line arguments */
@@ -1298,12 +9483,119 @@ int main(int argc, char *argv[]) {
 			currentArgument++;}fprintf(stdout, "\n");)
 
 	init_conf();
+	init_base_code_table();
+	init_complexity_table();
+	init_table_memory();
+	if (argc > 1 && strcmp(argv[1], "query") == 0) {
+		/* A query only reads an index, its output is the hits alone */
+		return query_index(argc, argv);
+	}
+	if (argc > 1 && strcmp(argv[1], "lookup") == 0) {
+		/* A lookup only reads a frozen index, its output is the counts alone */
+		return lookup_mphf(argc, argv);
+	}
+	if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+		/* A server only reads the counts of an earlier run */
+		return serve_counts(argc, argv);
+	}
 	usage();
 	while (!parse_arguments(argc, argv))
 		usage();
+	if (config.command == COMMAND_BENCH) {
+		/* A benchmark has no sequence or out file */
+		set_default_conf();
+		bench_count_tables();
+		return 0;
+	}
+	if (config.jobsFile) {
+		/* Each job goes on from here in its own process, the scheduler stops here */
+		int exitStatus;
+		if (run_jobs(&exitStatus)) {
+			return exitStatus;
+		}
+	}
+	if (config.command == COMMAND_MERGE && config.numMergeFiles > 0) {
+		read_merge_identity();
+	}
 	print_conf(argc);
+	init_classify_kernel();
+	init_pattern();
+
+	if (config.command == COMMAND_PACK) {
+		pack_sequence_file();
+
+		if (fclose(config.out_file_pointer) == EOF) {
+			fprintf(stderr,
+					"Out file close error! This is not expected and might mean the data was not written to the file properly before the close.\n");
+		}
+		fprintf(stdout,
+				"Your packed cache can be found in the current directory as: \n    %s\n",
+				config.out_file);
+		fclose(config.sequence_file_pointer);
+		fprintf(stdout, "End of program was reached properly.\n\n");
+		return 0;
+	}
+
+	if (config.command == COMMAND_MERGE) {
+		merge_shards();
+
+		if (fclose(config.out_file_pointer) == EOF) {
+			fprintf(stderr,
+					"Out file close error! This is not expected and might mean the data was not written to the file properly before the close.\n");
+		}
+		fprintf(stdout,
+				"Your file can be found in the current directory as: \n    %s\n",
+				config.out_file);
+		fprintf(stdout, "End of program was reached properly.\n\n");
+		return 0;
+	}
+
+	//stdin that open_sequence_input() left to stream holds no packed cache, and must not be read here.
+	config.packedCache =
+			sequence_streams_stdin() ? NULL : map_packed_cache(sequence_path());
+	if (config.packedCache) {
+		fprintf(stdout, "Sequence file is a 2 bit packed cache.\n");
+	}
+
+	if (config.sampleFraction > 0) {
+		/* A sample only estimates the run, nothing else is counted */
+		sample_sequence_file();
+
+		if (fclose(config.out_file_pointer) == EOF) {
+			fprintf(stderr,
+					"Out file close error! This is not expected and might mean the data was not written to the file properly before the close.\n");
+		}
+		fprintf(stdout,
+				"Your sample report can be found in the current directory as: \n    %s\n",
+				config.out_file);
+		fclose(config.sequence_file_pointer);
+		fprintf(stdout, "End of program was reached properly.\n\n");
+		return 0;
+	}
+
+	if (config.perRecordEnable > 0) {
+		/* Per record profiles replace the histogram of the whole file */
+		per_record_profiles();
+
+		if (fclose(config.out_file_pointer) == EOF) {
+			fprintf(stderr,
+					"Out file close error! This is not expected and might mean the data was not written to the file properly before the close.\n");
+		}
+		fprintf(stdout,
+				"Your file can be found in the current directory as: \n    %s\n",
+				config.out_file);
+		fclose(config.sequence_file_pointer);
+		fprintf(stdout, "End of program was reached properly.\n\n");
+		return 0;
+	}
 
-	unsigned long int maxNumberOfNodes = estimate_RAM_usage(); //Most number of nodes that can be created in memory.
+	plan_sample();
+	plan_memory();
+
+	unsigned long int maxNumberOfNodes = 0; //Most number of nodes that can be created in memory.
+	if (config.engine == ENGINE_TREE) {
+		maxNumberOfNodes = estimate_RAM_usage();
+	}
 
 	/* Begin the procedure to extract valid sequences from file */
 	fprintf(stdout, "!!!Find The KMER!!!\n");
@@ -1315,38 +9607,107 @@ int main(int argc, char *argv[]) {
 	node_t * headNode = NULL;
 	unsigned long long baseCounter = 0; //number of bases that fit into a kmer in the entire file. GATTACA has baseCounter = 7 if k <= 7
 	unsigned long long TotalNumSequencesN = 0; //number of kmers found. if k = 2 then GATA has N=3.
-	statistics_t baseStatistics[4] = { 0 };
+	statistics_t baseStatistics[4] = { };
+	scan_summary_t summary = { };
+
+	positional_table_t *positionalTable = NULL;
+	if (config.positionalBinSize > 0) {
+		positionalTable = new positional_table_t;
+		positionalTable->binSize = config.positionalBinSize;
+		positionalTable->numKmers = ((unsigned long long) 1) << (2 * config.k);
+		positionalTable->numBins = 0;
+	}
 
-	headNode = findKmer(headNode, &baseCounter, baseStatistics,
-			&TotalNumSequencesN);
+	count_table_t *countTable = NULL;
+	long_table_t *longTable = NULL;
+	if (config.engine == ENGINE_TREE) {
+		headNode = findKmer(headNode, &baseCounter, baseStatistics,
+				&TotalNumSequencesN, positionalTable, &summary);
+
+		statistics(&baseCounter, baseStatistics, &TotalNumSequencesN,
+				nodeCounter, maxNumberOfNodes, &summary);
+	} else if (config.k > MAX_CODE_K) {
+		longTable = count_long_kmers(&baseCounter, baseStatistics,
+				&TotalNumSequencesN, &summary);
+
+		statistics(&baseCounter, baseStatistics, &TotalNumSequencesN,
+				long_table_distinct(longTable), possible_kmers(config.k),
+				&summary);
+	} else {
+		countTable = count_kmers_with_table(&baseCounter, baseStatistics,
+				&TotalNumSequencesN, &summary);
+
+		if (config.shardCount > 0) {
+			/* A shard writes its counts for "findKmer merge" instead of the histogram */
+			write_shard_file(countTable, baseCounter, baseStatistics,
+					TotalNumSequencesN, &summary);
+			count_table_destroy(countTable);
+
+			if (fclose(config.out_file_pointer) == EOF) {
+				fprintf(stderr,
+						"Out file close error! This is not expected and might mean the data was not written to the file properly before the close.\n");
+			}
+			fprintf(stdout,
+					"Your shard file can be found in the current directory as: \n    %s\n",
+					config.out_file);
+			report_peak_memory();
+			fclose(config.sequence_file_pointer);
+			fprintf(stdout, "End of program was reached properly.\n\n");
+			return 0;
+		}
 
-	statistics(&baseCounter, baseStatistics, &TotalNumSequencesN,
-			&maxNumberOfNodes);
+		statistics(&baseCounter, baseStatistics, &TotalNumSequencesN,
+				count_table_distinct(countTable),
+				(((unsigned long long) 1) << (2 * config.k)) * dyad_gaps(), &summary);
+	}
 
 	fprintf(stdout, "Now creating histogram.\n");
 
-	//create a temporary array for the recursive function to keep as scratch memory to hold the sequence.
-	//int* histogram_temp = (int*) allocate_array(config.k, sizeof(int));
-	int* histogram_temp = (int*) malloc(config.k * sizeof(int));
-	if (!histogram_temp) {
-		fprintf(stderr, "allocate_array():: memory allocation failed\n");
-		exit(EXIT_FAILURE);
+	/* Output the occurrence of every sequence of length k */
+
+	if (config.mismatches > 0) {
+		mismatchCounts = (unsigned long long*) calloc(
+				((unsigned long long) 1) << (2 * config.k),
+				sizeof(unsigned long long));
+		if (!mismatchCounts) {
+			fprintf(stderr, "mismatchCounts:: memory allocation failed\n");
+			exit(EXIT_FAILURE);
+		}
 	}
-	//Initialize memory.
-	for (int i = 0; i < config.k; i++) {
-		*(histogram_temp + i) = -1;
+
+	if (longTable) {
+		histo_long_table(longTable, baseStatistics, TotalNumSequencesN);
+		long_table_destroy(longTable);
+	} else if (countTable) {
+		if (config.mphfEnable > 0) {
+			write_mphf_index(countTable, baseStatistics, TotalNumSequencesN);
+		}
+		histo_table(countTable, baseStatistics, TotalNumSequencesN);
+		if (config.windowSize > 0) {
+			write_window_enrichment(countTable, TotalNumSequencesN);
+		}
+		count_table_destroy(countTable);
+	} else {
+		histo_tree(headNode, baseStatistics, TotalNumSequencesN);
 	}
 
-	/* Output the occurrence of every sequence of length k */
+	//Begin cleanup and closing of files.
+	destroy(headNode);
 
-	histo_recursive(headNode, histogram_temp, 0, config.k, &baseCounter,
-			baseStatistics, &TotalNumSequencesN);
+	if (mismatchCounts) {
+		write_mismatch_histogram(baseStatistics, TotalNumSequencesN);
+		free(mismatchCounts);
+		mismatchCounts = NULL;
+	}
 
-	//Begin cleanup and closing of files.
-	free(histogram_temp);
-	histogram_temp = NULL;
+	if (positionalTable) {
+		write_positional_histogram(positionalTable);
+		delete positionalTable;
+	}
 
-	destroy(headNode);
+	if (config.indexEnable > 0) {
+		write_kmer_index();
+	}
 
 	DEBUG(fprintf(stdout, "\n"));
 	fprintf(stdout, "histogram creation finished.\n");
@@ -1364,9 +9725,9 @@ int main(int argc, char *argv[]) {
 		fprintf(stderr,
 				"Sequence file close error! This is likely ok though.\n");
 	}
+	report_peak_memory();
 	//Do not put any code after this point.
-	//Since the sequence file name is a constant char pointer, we cannot use free according to the standard since we cannot set it to null later.
-	//This will be fixed in the destructor of the config object later.
+	//The sequence file name is always a copy made with strdup(), never a pointer into argv.
 	free((char *) config.sequence_file);
 	free(config.out_file);
 	fprintf(stdout, "End of program was reached properly.\n\n");
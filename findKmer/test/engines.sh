@@ -0,0 +1,94 @@
+# Counts fixture.fa with every engine and thread count and compares each histogram with the
+# first one counted for that k, the tree engine's up to k = 20. The fixture is also read
+# gzip compressed, from stdin and as a packed cache.
+# The first histogram of each k is checked against the distinct kmers, total and top count
+# of the uppercase ACGT runs of the fixture, and at k = 7 against fixture_7mers.txt.
+# Run by "make test" from the findKmer directory. Prints FAIL lines and exits 1 on a difference.
+
+FINDKMER="$(cd "$(dirname "$0")/.." && pwd)/findKmer"
+FIXTURE="$(cd "$(dirname "$0")" && pwd)/fixture.fa"
+EXPECTED_7MERS="$(cd "$(dirname "$0")" && pwd)/fixture_7mers.txt"
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+#findKmer reads and writes in the current directory.
+cd "$WORK" || exit 1
+cp "$FIXTURE" fixture.fa
+gzip -c fixture.fa > fixture.fa.gz
+"$FINDKMER" pack -p fixture.fa > pack.log 2>&1 || { echo "FAIL pack"; cat pack.log; exit 1; }
+
+failures=0
+
+# expected <k>: distinct kmers, total count and highest count of the fixture.
+expected() {
+	case $1 in
+	1) echo "4 1735 485" ;;
+	7) echo "1518 1705 84" ;;
+	20) echo "1570 1640 71" ;;
+	25) echo "1550 1615 66" ;;
+	40) echo "1490 1540 51" ;;
+	esac
+}
+
+# check_reference <k> <name>: checks the first histogram of k against the expected counts.
+check_reference() {
+	k=$1; name=$2
+	# Kmer and frequency columns without the header.
+	tail -n +2 $name.csv | awk -F', ' '{ print $1, $4 }' > $name.counts
+	totals=$(awk '{ n++; total += $2; if ($2 > top) top = $2 } END { print n, total, top }' $name.counts)
+	if [ "$totals" != "$(expected $k)" ]; then
+		echo "FAIL $name: $totals distinct kmers, total and top count, expected $(expected $k)"
+		return 1
+	fi
+	if [ $k -eq 7 ] && ! cmp -s $name.counts "$EXPECTED_7MERS"; then
+		echo "FAIL $name: kmer counts differ from fixture_7mers.txt"
+		return 1
+	fi
+}
+
+# count <k> <name> <findKmer options>: counts into <name>.csv and compares it with ref_<k>.csv.
+count() {
+	k=$1; name=$2; shift 2
+	if ! "$FINDKMER" -q 1 -k $k -e $name.csv "$@" > $name.log 2>&1 < fixture.fa; then
+		echo "FAIL $name: findKmer exited with an error"
+		tail -3 $name.log
+		failures=$((failures + 1))
+		return
+	fi
+	if [ ! -f ref_$k.csv ]; then
+		if ! check_reference $k $name; then
+			failures=$((failures + 1))
+			return
+		fi
+		cp $name.csv ref_$k.csv
+	elif ! cmp -s $name.csv ref_$k.csv; then
+		echo "FAIL $name: histogram differs from $(cat ref_$k.name)"
+		failures=$((failures + 1))
+		return
+	fi
+	[ -f ref_$k.name ] || echo $name > ref_$k.name
+	echo "ok   $name"
+}
+
+for k in 1 7 20 25 40; do
+	engines="tree dense hash sort disk"
+	[ $k -gt 16 ] && engines="tree hash sort disk"
+	[ $k -gt 20 ] && engines="hash sort disk"
+	[ $k -gt 31 ] && engines="hash sort"
+	for engine in $engines; do
+		for threads in 1 3; do
+			count $k ${k}_${engine}_$threads --engine $engine -t $threads -p fixture.fa
+		done
+	done
+	for engine in $engines; do
+		count $k ${k}_${engine}_gzip --engine $engine -p fixture.fa.gz
+		count $k ${k}_${engine}_stdin --engine $engine -p -
+		[ $k -le 31 ] && count $k ${k}_${engine}_packed --engine $engine -p fixture.fa.packed
+	done
+done
+
+if [ $failures -gt 0 ]; then
+	echo "$failures histograms failed."
+	exit 1
+fi
+echo "Every engine counted the expected histograms."